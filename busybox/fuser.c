@@ -156,6 +156,22 @@ static smallint scan_proc_net_or_maps(const char *path, unsigned port)
 	return retval;
 }
 
+// change for ofgwrite: Don't kill VU+ and GB specific processes
+static int is_vendor_exe(const char *ln)
+{
+	return strcmp(ln, "/oldroot/usr/bin/dvb_server") == 0
+		|| strcmp(ln, "/oldroot/usr/bin/init_client") == 0
+		|| strcmp(ln, "/oldroot/usr/bin/ntfs-3g") == 0
+		|| strcmp(ln, "/oldroot/usr/share/platform/dvb_init") == 0
+		|| strcmp(ln, "/oldroot/usr/bin/nxserver") == 0
+		|| strcmp(ln, "/oldroot/usr/bin/init_driver") == 0
+		|| strcmp(ln, "/oldroot/usr/share/platform/dvb_init.bin") == 0
+		|| strcmp(ln, "/oldroot/usr/share/platform/nxserver") == 0
+		|| strcmp(ln, "/oldroot/usr/bin/showiframe") == 0
+		|| ( strncmp(ln, "/oldroot/lib/modules/", 21) == 0
+			&& strstr(ln, "/extra/hi_play.ko") != NULL );
+}
+
 static smallint scan_recursive(const char *path)
 {
 	DIR *d;
@@ -249,19 +265,7 @@ static smallint scan_recursive(const char *path)
 					char* ln = xmalloc_readlink(subpath);
 					if (ln != NULL)
 					{
-						// change for ofgwrite: Don't kill VU+ and GB specific processes
-						if (strcmp(ln, "/oldroot/usr/bin/dvb_server") == 0
-							|| strcmp(ln, "/oldroot/usr/bin/init_client") == 0
-							|| strcmp(ln, "/oldroot/usr/bin/ntfs-3g") == 0
-							|| strcmp(ln, "/oldroot/usr/share/platform/dvb_init") == 0
-							|| strcmp(ln, "/oldroot/usr/bin/nxserver") == 0
-							|| strcmp(ln, "/oldroot/usr/bin/init_driver") == 0
-							|| strcmp(ln, "/oldroot/usr/share/platform/dvb_init.bin") == 0
-							|| strcmp(ln, "/oldroot/usr/share/platform/nxserver") == 0
-							|| strcmp(ln, "/oldroot/usr/bin/showiframe") == 0
-							|| ( strncmp(ln, "/oldroot/lib/modules/", 21) == 0
-								&& strstr(ln, "/extra/hi_play.ko") != NULL )
-						   )
+						if (is_vendor_exe(ln))
 						{
 							my_printf("found vu or gb or octagon or ntfs process %s -> don't kill\n", ln);
 							retval = 0;
@@ -347,3 +351,86 @@ int fuser_main(int argc UNUSED_PARAM, char **argv)
 
 	return EXIT_FAILURE;
 }
+
+// changed for ofgwrite: collect the processes using the filesystem of @path
+// instead of killing them while scanning. Every process is checked only
+// until the first reference to the filesystem is found.
+static int pid_uses_fs(unsigned pid)
+{
+	static const char *const links[] = { "exe", "cwd", "root" };
+	char path[sizeof("/proc/%u/maps") + sizeof(int)*3];
+	struct stat statbuf;
+	struct dirent *d_ent;
+	char *ln;
+	DIR *d;
+	int i, found = 0;
+
+	sprintf(path, "/proc/%u/exe", pid);
+	ln = xmalloc_readlink(path);
+	if (ln != NULL) {
+		int vendor = is_vendor_exe(ln);
+
+		if (vendor)
+			my_printf("found vu or gb or octagon or ntfs process %s -> don't kill\n", ln);
+		free(ln);
+		if (vendor)
+			return 0;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(links); i++) {
+		sprintf(path, "/proc/%u/%s", pid, links[i]);
+		if (stat(path, &statbuf) == 0 && search_dev_inode(&statbuf))
+			return 1;
+	}
+
+	sprintf(path, "/proc/%u/fd", pid);
+	d = opendir(path);
+	if (d) {
+		while (!found && (d_ent = readdir(d)) != NULL) {
+			char *subpath = concat_subpath_file(path, d_ent->d_name);
+
+			if (subpath == NULL)
+				continue;
+			found = stat(subpath, &statbuf) == 0 && search_dev_inode(&statbuf);
+			free(subpath);
+		}
+		closedir(d);
+		if (found)
+			return 1;
+	}
+
+	sprintf(path, "/proc/%u/maps", pid);
+	G.recursion_depth = PROC_DIR_LINKS;
+	found = scan_proc_net_or_maps(path, 0);
+	G.recursion_depth = 0;
+	return found;
+}
+
+int fuser_mount_pids(const char *mount_point, pid_t **pids)
+{
+	struct stat statbuf;
+	procps_status_t *p = NULL;
+	inode_list *ilist;
+	int cnt = 0;
+
+	INIT_G();
+	option_mask32 = OPT_MOUNT;
+	if (stat(mount_point, &statbuf) < 0)
+		return -1;
+	add_inode(&statbuf);
+
+	*pids = NULL;
+	while ((p = procps_scan(p, PSSCAN_PID)) != NULL) {
+		// pid 1 can't be killed, init u moves it to the new root
+		if (p->pid == G.mypid || p->pid == 1 || !pid_uses_fs(p->pid))
+			continue;
+		*pids = xrealloc(*pids, (cnt + 1) * sizeof(**pids));
+		(*pids)[cnt++] = p->pid;
+	}
+
+	while ((ilist = G.inode_list_head) != NULL) {
+		G.inode_list_head = ilist->next;
+		free(ilist);
+	}
+	return cnt;
+}
@@ -228,6 +228,10 @@ void init_transformer_state(transformer_state_t *xstate) FAST_FUNC;
 ssize_t transformer_write(transformer_state_t *xstate, const void *buf, size_t bufsize) FAST_FUNC;
 ssize_t xtransformer_write(transformer_state_t *xstate, const void *buf, size_t bufsize) FAST_FUNC;
 int check_signature16(transformer_state_t *xstate, unsigned magic16) FAST_FUNC;
+/* changed for ofgwrite */
+transformer_state_t *setup_transformer_on_fd(int fd, int fail_if_not_compressed);
+/* changed for ofgwrite: buffer size of bunzip2, set by tune_probe() */
+extern unsigned bunzip_iobuf_size;
 
 IF_DESKTOP(long long) int inflate_unzip(transformer_state_t *xstate) FAST_FUNC;
 IF_DESKTOP(long long) int unpack_Z_stream(transformer_state_t *xstate) FAST_FUNC;
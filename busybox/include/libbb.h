@@ -394,6 +394,10 @@ extern char *find_block_device(const char *path) FAST_FUNC;
 /* bb_copyfd_XX print read/write errors and return -1 if they occur */
 extern off_t bb_copyfd_eof(int fd1, int fd2) FAST_FUNC;
 extern off_t bb_copyfd_size(int fd1, int fd2, off_t size) FAST_FUNC;
+/* changed for ofgwrite: buffer of bb_copyfd_*() and its size, set by
+ * tune_probe() */
+extern char *bb_copybuf;
+extern unsigned bb_copybuf_size;
 extern void bb_copyfd_exact_size(int fd1, int fd2, off_t size) FAST_FUNC;
 /* "short" copy can be detected by return value < size */
 /* this helper yells "short read!" if param is not -1 */
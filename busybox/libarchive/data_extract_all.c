@@ -5,6 +5,8 @@
 
 #include "libbb.h"
 #include "bb_archive.h"
+/* changed for ofgwrite: extracted data counts as written */
+#include <telemetry.h>
 
 void FAST_FUNC data_extract_all(archive_handle_t *archive_handle)
 {
@@ -121,6 +123,7 @@ void FAST_FUNC data_extract_all(archive_handle_t *archive_handle)
 			file_header->mode
 			);
 		bb_copyfd_exact_size(archive_handle->src_fd, dst_fd, file_header->size);
+		telemetry_add_written(file_header->size);
 		close(dst_fd);
 #ifdef ARCHIVE_REPLACE_VIA_RENAME
 		if (archive_handle->ah_flags & ARCHIVE_REPLACE_VIA_RENAME) {
@@ -41,6 +41,7 @@
 
 // changed for ofgwrite
 #include "../ofgwrite.h"
+#include <telemetry.h>
 
 #include "libbb.h"
 #include "bb_archive.h"
@@ -70,7 +71,9 @@
 #define RETVAL_OBSOLETE_INPUT           (dbg("%d", __LINE__), -7)
 
 /* Other housekeeping constants */
-#define IOBUF_SIZE          4096
+// changed for ofgwrite: set by tune_probe()
+unsigned bunzip_iobuf_size = 4096;
+#define IOBUF_SIZE          bunzip_iobuf_size
 
 /* This is what we know about each Huffman coding group */
 struct group_data {
@@ -140,6 +143,7 @@ static unsigned get_bits(bunzip_data *bd, int bits_wanted)
 			bd->inbufPos = 0;
 			// changed for ofgwrite
 			bz2_current_pos += bd->inbufCount;
+			telemetry_add_read(bd->inbufCount);
 			bz2_new_percent = (int)(bz2_current_pos * 100 / rootfs_file_stat.st_size);
 			if (bz2_new_percent > bz2_current_percent)
 			{
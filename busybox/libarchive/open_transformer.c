@@ -161,7 +161,8 @@ void FAST_FUNC fork_transformer(int fd, const char *transform_prog)
 /* Used by e.g. rpm which gives us a fd without filename,
  * thus we can't guess the format from filename's extension.
  */
-static transformer_state_t *setup_transformer_on_fd(int fd, int fail_if_not_compressed)
+// changed for ofgwrite: used by the prefetch of the rootfs image
+transformer_state_t *setup_transformer_on_fd(int fd, int fail_if_not_compressed)
 {
 	union {
 		uint8_t b[4];
@@ -23,6 +23,11 @@
  */
 #define SENDFILE_BIGBUF (16*1024*1024)
 
+/* changed for ofgwrite: set by tune_probe(), the buffer belongs to its
+ * arena */
+char *bb_copybuf;
+unsigned bb_copybuf_size = CONFIG_FEATURE_COPYBUF_KB * 1024;
+
 /* Used by NOFORK applets (e.g. cat) - must not use xmalloc.
  * size < 0 means "ignore write errors", used by tar --to-command
  * size = 0 means "copy till EOF"
@@ -37,8 +42,11 @@ static off_t bb_full_fd_action(int src_fd, int dst_fd, off_t size)
 	char *buffer = buffer; /* for compiler */
 	int buffer_size = 0;
 #else
-	char buffer[CONFIG_FEATURE_COPYBUF_KB * 1024];
-	enum { buffer_size = sizeof(buffer) };
+	/* changed for ofgwrite: the buffer chosen by tune_probe(), only tar
+	 * extraction copies, so one thread uses it at a time */
+	char small_buf[CONFIG_FEATURE_COPYBUF_KB * 1024];
+	char *buffer = small_buf;
+	int buffer_size = sizeof(small_buf);
 #endif
 
 	if (size < 0) {
@@ -49,6 +57,13 @@ static off_t bb_full_fd_action(int src_fd, int dst_fd, off_t size)
 	if (src_fd < 0)
 		goto out;
 
+#if CONFIG_FEATURE_COPYBUF_KB <= 4
+	if (bb_copybuf) {
+		buffer = bb_copybuf;
+		buffer_size = bb_copybuf_size;
+	}
+#endif
+
 	sendfile_sz = !ENABLE_FEATURE_USE_SENDFILE
 		? 0
 		: SENDFILE_BIGBUF;
@@ -119,8 +134,10 @@ static off_t bb_full_fd_action(int src_fd, int dst_fd, off_t size)
 	}
  out:
 
+#if CONFIG_FEATURE_COPYBUF_KB > 4
 	if (buffer_size > 4 * 1024)
 		munmap(buffer, buffer_size);
+#endif
 	return status ? -1 : total;
 }
 
@@ -68,3 +68,10 @@ int rm_main(int argc UNUSED_PARAM, char **argv)
 
 	return status;
 }
+
+/* changed for ofgwrite: in-process "rm -rf path" */
+int rm_recursive(const char *path)
+{
+	applet_name = "rm";
+	return remove_file(path, FILEUTILS_RECUR | FILEUTILS_FORCE) >= 0 ? 0 : 1;
+}
@@ -145,10 +145,13 @@
 //kbuild:lib-$(CONFIG_TAR) += tar.o
 
 #include <fnmatch.h>
+#include <pthread.h>
 #include "libbb.h"
 #include "bb_archive.h"
 // adapted for ofgwrite
 #include "../ofgwrite.h"
+#include <tune.h>
+extern int g_fbFd;
 /* FIXME: Stop using this non-standard feature */
 #ifndef FNM_LEADING_DIR
 # define FNM_LEADING_DIR 0
@@ -1217,3 +1220,266 @@ int tar_main(int argc UNUSED_PARAM, char **argv)
 
 	return bb_got_signal;
 }
+
+/* changed for ofgwrite: extracts src_fd to base_dir, reports the
+ * progress by the file position if size is known */
+static int tar_extract_fd(int src_fd, const char *base_dir, off_t size)
+{
+	archive_handle_t *tar_handle;
+	int current_percent = 0;
+	int new_percent;
+
+	tar_handle = init_handle();
+	tar_handle->ah_flags = ARCHIVE_CREATE_LEADING_DIRS
+	                     | ARCHIVE_RESTORE_DATE
+	                     | ARCHIVE_UNLINK_OLD;
+	if (getuid() != 0)
+		tar_handle->ah_flags |= ARCHIVE_DONT_RESTORE_PERM;
+	tar_handle->action_data = data_extract_all;
+	tar_handle->src_fd = src_fd;
+
+	xchdir(base_dir);
+
+	bb_got_signal = EXIT_FAILURE;
+	while (get_header_tar(tar_handle) == EXIT_SUCCESS) {
+		bb_got_signal = EXIT_SUCCESS; /* saw at least one header, good */
+		if (size) {
+			new_percent = lseek(tar_handle->src_fd, 0, SEEK_CUR) * 100 / size;
+			if (new_percent > current_percent) {
+				set_step_progress(new_percent);
+				current_percent = new_percent;
+			}
+		}
+	}
+
+	close(tar_handle->src_fd);
+	return bb_got_signal;
+}
+
+/* changed for ofgwrite: libofgwrite must not end the host process, its
+ * die_func jumps back here and tar_extract() fails instead. Only the
+ * thread which armed it may jump, forked children (e.g. the decompressor)
+ * inherit the flag but must end. */
+static jmp_buf extract_jmp;
+static int extract_jmp_armed;
+static pid_t extract_jmp_pid;
+static pthread_t extract_jmp_thread;
+
+void tar_extract_abort(void)
+{
+	if (!extract_jmp_armed)
+		return;
+	if (getpid() != extract_jmp_pid)
+		_exit(xfunc_error_retval);
+	if (pthread_equal(pthread_self(), extract_jmp_thread)) {
+		extract_jmp_armed = 0;
+		longjmp(extract_jmp, 1);
+	}
+}
+
+/* changed for ofgwrite: in-process "tar -xf tar_filename -C base_dir".
+ * The working directory is restored, libofgwrite runs in the E2 process. */
+int tar_extract(const char *tar_filename, const char *base_dir)
+{
+	struct stat st;
+	volatile int src_fd = -1;
+	volatile int cwd_fd;
+	int ret;
+
+	die_func = &handle_busybox_fatal_error;
+	applet_name = "tar";
+
+	cwd_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (setjmp(extract_jmp)) {
+		/* the decompressor gets EPIPE and ends */
+		if (src_fd >= 0) {
+			close(src_fd);
+			if (SEAMLESS_COMPRESSION || OPT_COMPRESS)
+				check_errors_in_children(0);
+		}
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+	extract_jmp_pid = getpid();
+	extract_jmp_thread = pthread_self();
+	extract_jmp_armed = 1;
+
+	if (ENABLE_FEATURE_TAR_AUTODETECT) {
+		src_fd = open_zipped(tar_filename, /*fail_if_not_compressed:*/ 0);
+		if (src_fd < 0)
+			bb_perror_msg_and_die("can't open '%s'", tar_filename);
+	} else {
+		src_fd = xopen(tar_filename, O_RDONLY);
+	}
+
+	/* compressed archives report the progress while decompressing,
+	 * uncompressed (prefetched) ones by their file position */
+	if (fstat(src_fd, &st) != 0 || !S_ISREG(st.st_mode))
+		st.st_size = 0;
+
+	tar_extract_fd(src_fd, base_dir, st.st_size);
+	extract_jmp_armed = 0;
+
+	if (SEAMLESS_COMPRESSION || OPT_COMPRESS)
+		check_errors_in_children(0);
+	ret = bb_got_signal;
+
+ out:
+	if (cwd_fd >= 0) {
+		if (fchdir(cwd_fd) != 0)
+			bb_perror_msg("can't restore working directory");
+		close(cwd_fd);
+	}
+	return ret;
+}
+
+/* changed for ofgwrite: "tar -xf tar_filename -C base_dir" for several
+ * directories at once. The archive is decompressed once and teed to one
+ * extracting child per directory, results[i] is the exit code of the
+ * extraction to base_dirs[i]. A failing directory doesn't stop the others. */
+int tar_extract_multi(const char *tar_filename, const char *const *base_dirs, int *results, int cnt)
+{
+	int tee_buf = tune_get()->image_buf;
+	struct stat st;
+	void (*old_sigpipe)(int);
+	int fds[cnt];
+	pid_t pids[cnt];
+	int src_fd, status, alive, i, j;
+	int current_percent = 0;
+	int new_percent;
+	long long done = 0;
+	char *buf;
+	ssize_t n;
+
+	die_func = &handle_busybox_fatal_error;
+	applet_name = "tar";
+
+	src_fd = open_zipped(tar_filename, /*fail_if_not_compressed:*/ 0);
+	if (src_fd < 0) {
+		bb_perror_msg("can't open '%s'", tar_filename);
+		return EXIT_FAILURE;
+	}
+	if (fstat(src_fd, &st) != 0 || !S_ISREG(st.st_mode))
+		st.st_size = 0;
+
+	/* the image read buffer of the tune budget, the extractors have their
+	 * own copies of the arena */
+	buf = tune_buffer(TUNE_IMAGE_BUF);
+	if (!buf) {
+		bb_error_msg("can't allocate tee buffer");
+		close(src_fd);
+		return EXIT_FAILURE;
+	}
+
+	/* a dying extractor must not kill ofgwrite */
+	old_sigpipe = signal(SIGPIPE, SIG_IGN);
+
+	alive = 0;
+	for (i = 0; i < cnt; i++) {
+		int p[2];
+
+		results[i] = EXIT_FAILURE;
+		fds[i] = -1;
+		pids[i] = -1;
+		if (pipe2(p, O_CLOEXEC) != 0) {
+			bb_perror_msg("can't extract to '%s'", base_dirs[i]);
+			continue;
+		}
+		pids[i] = fork();
+		if (pids[i] == 0) {
+			/* errors end the child only, the GUI belongs to the parent */
+			die_func = NULL;
+			g_fbFd = -1;
+			signal(SIGPIPE, SIG_DFL);
+			close(src_fd);
+			close(p[1]);
+			for (j = 0; j < i; j++)
+				if (fds[j] >= 0)
+					close(fds[j]);
+			_exit(tar_extract_fd(p[0], base_dirs[i], 0));
+		}
+		close(p[0]);
+		if (pids[i] < 0) {
+			bb_perror_msg("can't extract to '%s'", base_dirs[i]);
+			close(p[1]);
+			continue;
+		}
+		fds[i] = p[1];
+		alive++;
+	}
+
+	while (alive && (n = safe_read(src_fd, buf, tee_buf)) > 0) {
+		for (i = 0; i < cnt; i++) {
+			if (fds[i] < 0 || full_write(fds[i], buf, n) == n)
+				continue;
+			bb_error_msg("extracting to '%s' failed", base_dirs[i]);
+			close(fds[i]);
+			fds[i] = -1;
+			alive--;
+		}
+		done += n;
+		/* bz2 archives report their progress from the decompressor, an
+		 * uncompressed one (e.g. the prefetched copy) by the teed bytes.
+		 * Every block goes to all extractors before the next one is read,
+		 * so this is the progress of each of them. */
+		if (st.st_size) {
+			new_percent = done * 100 / st.st_size;
+			if (new_percent > current_percent) {
+				set_step_progress(new_percent);
+				current_percent = new_percent;
+			}
+		}
+	}
+	close(src_fd);
+
+	for (i = 0; i < cnt; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+		if (pids[i] > 0 && safe_waitpid(pids[i], &status, 0) == pids[i] && status == 0)
+			results[i] = EXIT_SUCCESS;
+	}
+	signal(SIGPIPE, old_sigpipe);
+
+	/* the decompressor failed -> no target is complete */
+	bb_got_signal = EXIT_SUCCESS;
+	if (SEAMLESS_COMPRESSION || OPT_COMPRESS)
+		check_errors_in_children(0);
+	if (bb_got_signal) {
+		for (i = 0; i < cnt; i++)
+			results[i] = EXIT_FAILURE;
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < cnt; i++)
+		if (results[i] != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+/* changed for ofgwrite: "tar -tf tar_filename" without listing, *size is
+ * the size of the uncompressed archive */
+int tar_test(const char *tar_filename, long long *size)
+{
+	archive_handle_t *tar_handle;
+
+	applet_name = "tar";
+
+	tar_handle = init_handle();
+	tar_handle->action_data = data_skip;
+	tar_handle->src_fd = open_zipped(tar_filename, /*fail_if_not_compressed:*/ 0);
+	if (tar_handle->src_fd < 0) {
+		bb_perror_msg("can't open '%s'", tar_filename);
+		return EXIT_FAILURE;
+	}
+
+	bb_got_signal = EXIT_FAILURE;
+	while (get_header_tar(tar_handle) == EXIT_SUCCESS)
+		bb_got_signal = EXIT_SUCCESS; /* saw at least one header, good */
+	*size = tar_handle->offset;
+
+	close(tar_handle->src_fd);
+
+	if (SEAMLESS_COMPRESSION || OPT_COMPRESS)
+		check_errors_in_children(0);
+
+	return bb_got_signal;
+}
@@ -3,13 +3,20 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <stdint.h>
 #include <memory.h>
 #include <string.h>
 #include <unistd.h>
 #include <linux/kd.h>
 #include <sys/ioctl.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "font.h"
+#include <telemetry.h>
+
+int flash_job_concurrent();
+int flash_job_progress(int percent);
 
 #define TRANS "\x00\x00\x00\x00"
 #define BLACK "\x00\x00\x00\x80"
@@ -28,7 +35,8 @@
 #endif
 
 int g_fbFd = -1;
-unsigned char *g_lfb = NULL;
+unsigned char *g_lfb = NULL; // drawing target, the back buffer if there is one
+unsigned char *g_fb_mem = NULL; // mapped framebuffer
 char g_fbDevice[] = "/dev/fb0";
 int g_manual_blit = 0;
 struct fb_var_screeninfo g_screeninfo_var;
@@ -58,14 +66,83 @@ struct progressbar
 	int width; // inner dimension
 	int height; // inner dimension
 	int steps;
+	int painted; // inner width already painted white
 };
 
 struct progressbar g_pb_overall;
 struct progressbar g_pb_step;
 
+#define UI_FRAME_MS 40
+
+// concurrent flash jobs and the UI thread draw from several threads
+static pthread_mutex_t g_fb_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static int* g_step_percent;
+static pthread_t g_ui_thread;
+static int g_ui_running;
+static int g_ui_stop;
+static pid_t g_ui_pid;
+
+// libofgwrite gets the steps and their progress by a callback
+static void (*g_progress_func)(void* user, const char* step, int percent);
+static void* g_progress_user;
+static pid_t g_progress_pid;
+static char g_progress_step[100];
+static int g_progress_percent;
+
+// Everything is drawn into a back buffer in RAM, blit() copies the area
+// painted since the last blit to the framebuffer. So a repainted window
+// never shows half drawn and the framebuffer is written once per frame.
+struct dirty_rect
+{
+	int x1, y1, x2, y2; // empty if x1 >= x2
+} g_dirty;
+
+static void mark_dirty(int x1, int y1, int x2, int y2)
+{
+	pthread_mutex_lock(&g_fb_lock);
+	if (g_dirty.x1 >= g_dirty.x2)
+	{
+		g_dirty.x1 = x1;
+		g_dirty.y1 = y1;
+		g_dirty.x2 = x2;
+		g_dirty.y2 = y2;
+	}
+	else
+	{
+		if (x1 < g_dirty.x1) g_dirty.x1 = x1;
+		if (y1 < g_dirty.y1) g_dirty.y1 = y1;
+		if (x2 > g_dirty.x2) g_dirty.x2 = x2;
+		if (y2 > g_dirty.y2) g_dirty.y2 = y2;
+	}
+	pthread_mutex_unlock(&g_fb_lock);
+}
+
+// copies the dirty area of the back buffer to the framebuffer
+static void present()
+{
+	unsigned int offset;
+	int y;
+
+	pthread_mutex_lock(&g_fb_lock);
+	if (g_dirty.x1 < g_dirty.x2 && g_lfb != g_fb_mem)
+	{
+		if (g_dirty.x1 < 0) g_dirty.x1 = 0;
+		if (g_dirty.y1 < 0) g_dirty.y1 = 0;
+		if (g_dirty.x2 > g_screeninfo_var.xres) g_dirty.x2 = g_screeninfo_var.xres;
+		if (g_dirty.y2 > g_screeninfo_var.yres) g_dirty.y2 = g_screeninfo_var.yres;
+		for (y = g_dirty.y1; y < g_dirty.y2; y++)
+		{
+			offset = (y + g_screeninfo_var.yoffset) * g_screeninfo_fix.line_length + (g_dirty.x1 + g_screeninfo_var.xoffset) * 4;
+			memcpy(g_fb_mem + offset, g_lfb + offset, (g_dirty.x2 - g_dirty.x1) * 4);
+		}
+	}
+	g_dirty.x1 = g_dirty.x2 = 0;
+	pthread_mutex_unlock(&g_fb_lock);
+}
 
 void blit()
 {
+	present();
 	if (g_manual_blit == 1) {
 		if (ioctl(g_fbFd, FBIO_BLIT) < 0)
 			perror("FBIO_BLIT");
@@ -100,12 +177,45 @@ void set_window_dimension()
 	g_window.y2 = g_screeninfo_var.yres / 2 + g_window.height / 2;
 }
 
+// The first row is filled with 32 bit stores, which the compiler turns
+// into vector stores, and copied to the other rows.
 void paint_box(int x1, int y1, int x2, int y2, char* color)
 {
-	int x,y;
-	for (y = y1; y < y2; y++)
-		for (x = x1; x < x2; x++)
-			memcpy(&g_lfb[(x + g_screeninfo_var.xoffset) * 4 + (y + g_screeninfo_var.yoffset) * g_screeninfo_fix.line_length], color, 4);
+	uint32_t pixel;
+	uint32_t* row;
+	unsigned char* first;
+	int x, y;
+	int len = (x2 - x1) * 4;
+
+	if (x2 <= x1 || y2 <= y1)
+		return;
+
+	memcpy(&pixel, color, 4);
+	first = &g_lfb[(x1 + g_screeninfo_var.xoffset) * 4 + (y1 + g_screeninfo_var.yoffset) * g_screeninfo_fix.line_length];
+	row = (uint32_t*)first;
+	for (x = 0; x < x2 - x1; x++)
+		row[x] = pixel;
+	for (y = 1; y < y2 - y1; y++)
+		memcpy(first + y * g_screeninfo_fix.line_length, first, len);
+	mark_dirty(x1, y1, x2, y2);
+}
+
+// Paints a progressbar up to percent. Only the difference to the painted
+// part is drawn, returns 0 if nothing changed.
+static int paint_progress(struct progressbar* pb, int percent)
+{
+	int x = pb->x1 + pb->outer_border_width + pb->inner_border_width;
+	int y = pb->y1 + pb->outer_border_width + pb->inner_border_width;
+	int width = (int)(pb->width / 100.0 * percent);
+
+	if (width == pb->painted)
+		return 0;
+	if (width > pb->painted)
+		paint_box(x + pb->painted, y, x + width, y + pb->height, WHITE);
+	else // concurrent jobs can report less progress after a step change
+		paint_box(x + width, y, x + pb->painted, y + pb->height, BLACK);
+	pb->painted = width;
+	return 1;
 }
 
 void init_progressbars(int steps)
@@ -120,6 +230,7 @@ void init_progressbars(int steps)
 	g_pb_overall.x2 = g_window.x2 - (g_window.width * 0.2 / 2 - g_pb_overall.outer_border_width - g_pb_overall.inner_border_width);
 	g_pb_overall.y2 = g_pb_overall.y1 + g_pb_overall.height + 2 * g_pb_overall.outer_border_width + 2* g_pb_overall.inner_border_width;
 	g_pb_overall.steps = steps;
+	g_pb_overall.painted = 0;
 
 	g_pb_step.width = g_window.width * 0.8;
 	g_pb_step.height = g_window.height * 0.1;
@@ -129,6 +240,74 @@ void init_progressbars(int steps)
 	g_pb_step.y1 = g_window.y1 + g_window.height * 0.65;
 	g_pb_step.x2 = g_window.x2 - (g_window.width * 0.2 / 2 - g_pb_step.outer_border_width - g_pb_step.inner_border_width);
 	g_pb_step.y2 = g_pb_step.y1 + g_pb_step.height + 2 * g_pb_step.outer_border_width + 2 * g_pb_step.inner_border_width;
+	g_pb_step.painted = 0;
+}
+
+// The UI thread paints the published step progress at a fixed frame rate,
+// so the flash loops never wait for painting and FBIO_BLIT.
+static void* ui_thread(void* arg)
+{
+	struct timespec frame = { 0, UI_FRAME_MS * 1000000 };
+	int percent;
+
+	while (!__atomic_load_n(&g_ui_stop, __ATOMIC_RELAXED))
+	{
+		nanosleep(&frame, NULL);
+		percent = __atomic_load_n(g_step_percent, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&g_fb_lock);
+		if (paint_progress(&g_pb_step, percent))
+			blit();
+		pthread_mutex_unlock(&g_fb_lock);
+	}
+	return NULL;
+}
+
+static void ui_start()
+{
+	// shared with forked decompressors, which report progress, too
+	if (g_step_percent == NULL)
+	{
+		g_step_percent = mmap(NULL, sizeof(*g_step_percent), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (g_step_percent == MAP_FAILED)
+		{
+			g_step_percent = NULL;
+			return;
+		}
+	}
+	*g_step_percent = 0;
+	if (g_ui_running && g_ui_pid == getpid())
+		return;
+	g_ui_stop = 0;
+	g_ui_pid = getpid();
+	g_ui_running = pthread_create(&g_ui_thread, NULL, ui_thread, NULL) == 0;
+	if (!g_ui_running)
+		perror("UI thread");
+}
+
+static void ui_stop()
+{
+	// a forked child doesn't have the thread
+	if (!g_ui_running || g_ui_pid != getpid())
+		return;
+	__atomic_store_n(&g_ui_stop, 1, __ATOMIC_RELAXED);
+	pthread_join(g_ui_thread, NULL);
+	g_ui_running = 0;
+}
+
+// Console progress lines are printed at the frame rate of the UI, done
+// forces the last line.
+int progress_due(int done)
+{
+	static long long last;
+	struct timespec ts;
+	long long now;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	if (!done && now - __atomic_load_n(&last, __ATOMIC_RELAXED) < UI_FRAME_MS)
+		return 0;
+	__atomic_store_n(&last, now, __ATOMIC_RELAXED);
+	return 1;
 }
 
 void paint_progressbars()
@@ -137,6 +316,7 @@ void paint_progressbars()
 	paint_box(g_pb_overall.x1, g_pb_overall.y1, g_pb_overall.x2, g_pb_overall.y2, WHITE);
 
 	// paint black inner box in overall progressbar
+	g_pb_overall.painted = 0;
 	paint_box(g_pb_overall.x1 + g_pb_overall.outer_border_width
 			, g_pb_overall.y1 + g_pb_overall.outer_border_width
 			, g_pb_overall.x2 - g_pb_overall.outer_border_width
@@ -147,6 +327,7 @@ void paint_progressbars()
 	paint_box(g_pb_step.x1, g_pb_step.y1, g_pb_step.x2, g_pb_step.y2, WHITE);
 
 	// paint black inner box in overall progressbar
+	g_pb_step.painted = 0;
 	paint_box(g_pb_step.x1 + g_pb_step.outer_border_width
 			, g_pb_step.y1 + g_pb_step.outer_border_width
 			, g_pb_step.x2 - g_pb_step.outer_border_width
@@ -156,13 +337,21 @@ void paint_progressbars()
 
 void close_framebuffer()
 {
-	// hide all old osd content
-	paint_box(0, 0, g_screeninfo_var.xres, g_screeninfo_var.yres, TRANS);
+	ui_stop();
 
+	// hide all old osd content, there is nothing to paint on if opening
+	// or mapping the framebuffer failed
 	if (g_lfb)
+		paint_box(0, 0, g_screeninfo_var.xres, g_screeninfo_var.yres, TRANS);
+
+	if (g_fb_mem)
 	{
-		msync(g_lfb, g_screeninfo_fix.smem_len, MS_SYNC);
-		munmap(g_lfb, g_screeninfo_fix.smem_len);
+		present();
+		msync(g_fb_mem, g_screeninfo_fix.smem_len, MS_SYNC);
+		munmap(g_fb_mem, g_screeninfo_fix.smem_len);
+		if (g_lfb != g_fb_mem)
+			free(g_lfb);
+		g_lfb = g_fb_mem = NULL;
 	}
 
 	if (g_fbFd >= 0)
@@ -205,14 +394,19 @@ int set_screeninfo()
 	return 1;
 }
 
+static int fb_unavailable_reported;
+
 int open_framebuffer()
 {
 	g_fbFd = open(g_fbDevice, O_RDWR);
 	if (g_fbFd < 0)
 	{
-		perror(g_fbDevice);
+		// the device is polled while E2 stops, report it once
+		if (!fb_unavailable_reported)
+			perror(g_fbDevice);
 		goto nolfb;
 	}
+	fb_unavailable_reported = 0;
 
 	enableManualBlit();
 
@@ -234,18 +428,28 @@ nolfb:
 		close(g_fbFd);
 		g_fbFd = -1;
 	}
-	my_printf("framebuffer not available.\n");
+	if (!fb_unavailable_reported)
+		my_printf("framebuffer not available.\n");
+	fb_unavailable_reported = 1;
 	return 0;
 }
 
 int mmap_fb()
 {
-	g_lfb = (unsigned char*)mmap(0, g_screeninfo_fix.smem_len, PROT_WRITE|PROT_READ, MAP_SHARED, g_fbFd, 0);
-	if (!g_lfb)
+	g_fb_mem = (unsigned char*)mmap(0, g_screeninfo_fix.smem_len, PROT_WRITE|PROT_READ, MAP_SHARED, g_fbFd, 0);
+	if (g_fb_mem == MAP_FAILED)
 	{
+		g_fb_mem = NULL;
 		perror("mmap");
 		return 0;
 	}
+
+	// the back buffer covers the visible page, its content is painted by
+	// init_framebuffer(); without memory for it draw directly
+	g_lfb = malloc((g_screeninfo_var.yoffset + g_screeninfo_var.yres) * g_screeninfo_fix.line_length);
+	if (g_lfb == NULL)
+		g_lfb = g_fb_mem;
+	g_dirty.x1 = g_dirty.x2 = 0;
 	return 1;
 }
 
@@ -283,24 +487,48 @@ int set_fb_resolution()
 	return 1;
 }
 
-void set_step_progress(int percent)
+void set_progress_callback(void (*func)(void* user, const char* step, int percent), void* user)
 {
-	if (g_fbFd == -1)
+	pthread_mutex_lock(&g_fb_lock);
+	g_progress_user = user;
+	g_progress_pid = getpid();
+	g_progress_step[0] = '\0';
+	g_progress_percent = -1;
+	__atomic_store_n(&g_progress_func, func, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&g_fb_lock);
+}
+
+// step NULL keeps the current step, forked children don't report
+static void report_progress(const char* step, int percent)
+{
+	if (__atomic_load_n(&g_progress_func, __ATOMIC_ACQUIRE) == NULL || g_progress_pid != getpid())
 		return;
 
+	pthread_mutex_lock(&g_fb_lock);
+	if (step != NULL)
+		snprintf(g_progress_step, sizeof(g_progress_step), "%s", step);
+	if (g_progress_func != NULL && (step != NULL || percent != g_progress_percent))
+	{
+		g_progress_percent = percent;
+		g_progress_func(g_progress_user, g_progress_step, percent);
+	}
+	pthread_mutex_unlock(&g_fb_lock);
+}
+
+// Called in the erase and program loops. Only publishes the progress, the
+// UI thread paints it.
+void set_step_progress(int percent)
+{
+	percent = flash_job_progress(percent);
 	if (percent < 0)
 		percent = 0;
 	if (percent > 100)
 		percent = 100;
-	int x = g_pb_step.x1 + g_pb_step.outer_border_width + g_pb_step.inner_border_width;
-	int y = g_pb_step.y1 + g_pb_step.outer_border_width + g_pb_step.inner_border_width;
-
-	paint_box(x
-			, y
-			, (int)(x + g_pb_step.width / 100.0 * percent)
-			, y + g_pb_step.height
-			, WHITE);
-	blit();
+	report_progress(NULL, percent);
+	if (g_fbFd == -1 || g_step_percent == NULL)
+		return;
+
+	__atomic_store_n(g_step_percent, percent, __ATOMIC_RELAXED);
 }
 
 void set_overall_progress(int step)
@@ -310,65 +538,145 @@ void set_overall_progress(int step)
 		percent = 0;
 	if (percent > 100)
 		percent = 100;
-	int x = g_pb_overall.x1 + g_pb_overall.outer_border_width + g_pb_overall.inner_border_width;
-	int y = g_pb_overall.y1 + g_pb_overall.outer_border_width + g_pb_overall.inner_border_width;
 
+	pthread_mutex_lock(&g_fb_lock);
 	// paint overall bar
-	paint_box(x
-			, y
-			, (int)(x + g_pb_overall.width / 100.0 * percent)
-			, y + g_pb_overall.height
-			, WHITE);
+	paint_progress(&g_pb_overall, percent);
 
-	if (percent >= 99)
-		return;
-	// reset step progressbar
-	x = g_pb_step.x1 + g_pb_step.outer_border_width + g_pb_step.inner_border_width;
-	y = g_pb_step.y1 + g_pb_step.outer_border_width + g_pb_step.inner_border_width;
-	paint_box(x
-			, y
-			, x + g_pb_step.width
-			, y + g_pb_step.height
-			, BLACK);
+	if (percent < 99)
+	{
+		// reset step progressbar
+		if (g_step_percent != NULL)
+			__atomic_store_n(g_step_percent, 0, __ATOMIC_RELAXED);
+		paint_progress(&g_pb_step, 0);
+	}
+	pthread_mutex_unlock(&g_fb_lock);
 }
 
-void render_char(char ch, int x, int y, char* color, int thick)
+// Glyphs as runs of set pixels per row, built once from the font bitmaps.
+// A run is drawn by copying a row of the text colour, thick text scales
+// the runs by two.
+#define GLYPH_CNT      (sizeof(font) / sizeof(font[0]))
+#define GLYPH_MAX_RUNS ((CHAR_WIDTH + 1) / 2)
+
+struct glyph_row
+{
+	unsigned char cnt;
+	unsigned char start[GLYPH_MAX_RUNS];
+	unsigned char len[GLYPH_MAX_RUNS];
+};
+
+static struct glyph_row g_glyphs[GLYPH_CNT][CHAR_HEIGHT];
+static int g_glyphs_ready;
+
+static void init_glyphs()
 {
-	const unsigned short* bitmap = font[ch-0x20];
+	struct glyph_row* row;
+	unsigned int c, h;
+	int w, line, run;
 
-	int h, w, line;
-	const unsigned int pos = (y + g_screeninfo_var.yoffset) * g_screeninfo_fix.line_length + (x + g_screeninfo_var.xoffset) * 4;
-	for (h = 0; h < CHAR_HEIGHT; h++)
+	if (g_glyphs_ready)
+		return;
+	for (c = 0; c < GLYPH_CNT; c++)
 	{
-		line = bitmap[h] >> 2;  // ignore 2 lsb bits
-		for (w = CHAR_WIDTH - 1; w >= 0; w--)
+		for (h = 0; h < CHAR_HEIGHT; h++)
 		{
-			if ((line & 0x01) == 0x01)
+			row = &g_glyphs[c][h];
+			line = font[c][h] >> 2;  // ignore 2 lsb bits, msb is the left pixel
+			run = 0;
+			row->cnt = 0;
+			for (w = 0; w <= CHAR_WIDTH; w++)
 			{
-				memcpy(&g_lfb[pos + (thick + 1) * h * g_screeninfo_fix.line_length + (thick + 1) * w * 4], color, 4);
-				if (thick)
+				if (w < CHAR_WIDTH && (line >> (CHAR_WIDTH - 1 - w)) & 0x01)
 				{
-					memcpy(&g_lfb[pos + 2 * h * g_screeninfo_fix.line_length + 2 * w * 4 + 4], color, 4);
-					memcpy(&g_lfb[pos + (2 * h + 1) * g_screeninfo_fix.line_length + 2 * w * 4], color, 4);
-					memcpy(&g_lfb[pos + (2 * h + 1) * g_screeninfo_fix.line_length + 2 * w * 4 + 4], color, 4);
+					if (run++ == 0)
+						row->start[row->cnt] = w;
+				}
+				else if (run)
+				{
+					row->len[row->cnt++] = run;
+					run = 0;
 				}
 			}
-
-			line = line >> 1;
 		}
 	}
+	g_glyphs_ready = 1;
+}
+
+static void render_glyph(unsigned char ch, int x, int y, const uint32_t* color_row, int thick)
+{
+	const struct glyph_row* row;
+	unsigned char* line;
+	int scale = thick + 1;
+	int h, i, sub;
+
+	if (ch < 0x20 || ch - 0x20 >= GLYPH_CNT)
+		return;
+	row = g_glyphs[ch - 0x20];
+	line = &g_lfb[(y + g_screeninfo_var.yoffset) * g_screeninfo_fix.line_length + (x + g_screeninfo_var.xoffset) * 4];
+	for (h = 0; h < CHAR_HEIGHT; h++, row++)
+		for (sub = 0; sub < scale; sub++, line += g_screeninfo_fix.line_length)
+			for (i = 0; i < row->cnt; i++)
+				memcpy(line + row->start[i] * scale * 4, color_row, row->len[i] * scale * 4);
+}
+
+void render_char(char ch, int x, int y, char* color, int thick)
+{
+	uint32_t color_row[CHAR_WIDTH * 2];
+	int i;
+
+	init_glyphs();
+	for (i = 0; i < CHAR_WIDTH * 2; i++)
+		memcpy(&color_row[i], color, 4);
+	render_glyph(ch, x, y, color_row, thick);
+	mark_dirty(x, y, x + CHAR_WIDTH * (thick + 1), y + CHAR_HEIGHT * (thick + 1));
 }
 
 void render_string(char* str, int x, int y, char* color, int thick)
 {
+	uint32_t color_row[CHAR_WIDTH * 2];
+	int advance = CHAR_WIDTH + CHAR_WIDTH * thick;
 	int i;
-	for (i = 0; i < strlen(str); i++)
-		render_char(str[i], x + i * (CHAR_WIDTH + CHAR_WIDTH * thick), y, color, thick);
+
+	init_glyphs();
+	for (i = 0; i < CHAR_WIDTH * 2; i++)
+		memcpy(&color_row[i], color, 4);
+	for (i = 0; str[i] != '\0'; i++)
+		render_glyph(str[i], x + i * advance, y, color_row, thick);
+	mark_dirty(x, y, x + i * advance, y + CHAR_HEIGHT * (thick + 1));
+}
+
+// Texts shown in the fixed lines of the window. A line is only redrawn if
+// its text changes.
+enum TextLineEnum
+{
+	TEXT_TITLE, TEXT_SUB_TITLE, TEXT_OVERALL, TEXT_STEP, TEXT_LINES
+};
+
+static char g_shown_text[TEXT_LINES][128];
+
+static int text_changed(enum TextLineEnum line, const char* str)
+{
+	if (strlen(str) >= sizeof(g_shown_text[line]))
+	{
+		g_shown_text[line][0] = '\0';
+		return 1;
+	}
+	if (strcmp(g_shown_text[line], str) == 0)
+		return 0;
+	strcpy(g_shown_text[line], str);
+	return 1;
+}
+
+// the window was repainted, all texts are gone
+static void forget_texts()
+{
+	memset(g_shown_text, 0, sizeof(g_shown_text));
 }
 
 void set_title(char* str)
 {
-	if (g_fbFd == -1)
+	if (g_fbFd == -1 || !text_changed(TEXT_TITLE, str))
 		return;
 
 	// hide text
@@ -390,7 +698,7 @@ void set_title(char* str)
 
 void set_sub_title(char* str)
 {
-	if (g_fbFd == -1)
+	if (g_fbFd == -1 || !text_changed(TEXT_SUB_TITLE, str))
 		return;
 
 	// hide text
@@ -412,7 +720,7 @@ void set_sub_title(char* str)
 
 void set_overall_text(char* str)
 {
-	if (g_fbFd == -1)
+	if (g_fbFd == -1 || !text_changed(TEXT_OVERALL, str))
 		return;
 
 	// hide text
@@ -434,7 +742,7 @@ void set_overall_text(char* str)
 
 void set_step_text(char* str)
 {
-	if (g_fbFd == -1)
+	if (g_fbFd == -1 || !text_changed(TEXT_STEP, str))
 		return;
 
 	// hide text
@@ -456,17 +764,34 @@ void set_step_text(char* str)
 
 void set_step(char* str)
 {
+	// steps of concurrent flash jobs only advance the overall progress
+	if (flash_job_concurrent())
+	{
+		pthread_mutex_lock(&g_fb_lock);
+		if (g_fbFd != -1)
+			set_overall_progress(g_step);
+		g_step++;
+		pthread_mutex_unlock(&g_fb_lock);
+		set_step_progress(0);
+		return;
+	}
+
+	telemetry_step(str);
+	report_progress(str, 0);
 	if (g_fbFd == -1)
 		return;
 
+	pthread_mutex_lock(&g_fb_lock);
 	set_step_text(str);
 	set_overall_progress(g_step);
 	g_step++;
 	set_step_progress(0);
+	pthread_mutex_unlock(&g_fb_lock);
 }
 
 void set_step_without_incr(char* str)
 {
+	report_progress(str, 0);
 	if (g_fbFd == -1)
 		return;
 
@@ -624,8 +949,11 @@ int init_framebuffer(int steps)
 
 	// hide all old osd content
 	paint_box(0, 0, g_screeninfo_var.xres, g_screeninfo_var.yres, TRANS);
+	forget_texts();
+	init_glyphs();
 
 	init_progressbars(steps);
+	ui_start();
 
 	return 1;
 }
@@ -644,6 +972,7 @@ int show_main_window(int show_background_image, const char* version)
 
 	// paint window
 	paint_box(g_window.x1, g_window.y1, g_window.x2, g_window.y2, BLACK);
+	forget_texts();
 	paint_progressbars();
 
 	set_title("ofgwrite Flashing Tool");
@@ -36,6 +36,7 @@
 #include <common.h>
 #include <crc32.h>
 #include <libmtd.h>
+#include <flash_erase.h>
 
 #include <mtd/mtd-user.h>
 #include <mtd/jffs2-user.h>
@@ -47,12 +48,82 @@ static int jffs2;		/* format for jffs2 usage */
 static int noskipbad;		/* do not skip bad blocks */
 static int unlock;		/* unlock sectors before erasing */
 
-static struct jffs2_unknown_node cleanmarker;
+static struct jffs2_cleanmarker cleanmarker;
 int target_endian = __BYTE_ORDER;
 
+int jffs2_cleanmarker_init(struct jffs2_cleanmarker *clm,
+			   const struct mtd_dev_info *mtd, int fd,
+			   const char *mtd_device)
+{
+	memset(clm, 0, sizeof(*clm));
+	clm->len = 8;
+	clm->isNAND = mtd->type == MTD_NANDFLASH || mtd->type == MTD_MLCNANDFLASH;
+
+	clm->node.magic = cpu_to_je16 (JFFS2_MAGIC_BITMASK);
+	clm->node.nodetype = cpu_to_je16 (JFFS2_NODETYPE_CLEANMARKER);
+	if (!clm->isNAND)
+		clm->node.totlen = cpu_to_je32(sizeof(clm->node));
+	else {
+		struct nand_oobinfo oobinfo;
+
+		if (ioctl(fd, MEMGETOOBSEL, &oobinfo) != 0)
+			return sys_errmsg("%s: unable to get NAND oobinfo", mtd_device);
+
+		/* Check for autoplacement */
+		if (oobinfo.useecc == MTD_NANDECC_AUTOPLACE) {
+			/* Get the position of the free bytes */
+			if (!oobinfo.oobfree[0][1])
+				return errmsg(" Eeep. Autoplacement selected and no empty space in oob");
+			clm->pos = oobinfo.oobfree[0][0];
+			clm->len = oobinfo.oobfree[0][1];
+			if (clm->len > 8)
+				clm->len = 8;
+		} else {
+			/* Legacy mode */
+			switch (mtd->oob_size) {
+				case 8:
+					clm->pos = 6;
+					clm->len = 2;
+					break;
+				case 16:
+					clm->pos = 8;
+					clm->len = 8;
+					break;
+				case 64:
+					clm->pos = 16;
+					clm->len = 8;
+					break;
+			}
+		}
+		clm->node.totlen = cpu_to_je32(8);
+	}
+	clm->node.hdr_crc = cpu_to_je32(mtd_crc32(0, &clm->node, sizeof(clm->node) - 4));
+
+	return 0;
+}
+
+int jffs2_cleanmarker_write(const struct jffs2_cleanmarker *clm, libmtd_t desc,
+			    const struct mtd_dev_info *mtd, int fd, int eb)
+{
+	uint64_t offset = (uint64_t)eb * mtd->eb_size;
+
+	if (clm->isNAND) {
+		if (mtd_write_oob(desc, mtd, fd, offset + clm->pos, clm->len, (void *)&clm->node) != 0)
+			return -1;
+	} else {
+		if (pwrite(fd, &clm->node, sizeof(clm->node), (loff_t)offset) != sizeof(clm->node))
+			return -1;
+	}
+
+	return 0;
+}
+
 static void show_progress(struct mtd_dev_info *mtd, off_t start, int eb,
 			  int eb_start, int eb_cnt)
 {
+	/* the call after the loop prints 100 % */
+	if (!progress_due(eb - eb_start >= eb_cnt))
+		return;
 	bareverbose(!quiet, "\rErasing %d Kibyte @ %"PRIxoff_t" -- %2i %% complete ",
 		mtd->eb_size / 1024, start, ((eb - eb_start) * 100) / eb_cnt);
 	fflush(stdout);
@@ -93,7 +164,7 @@ int flash_erase_main(int argc, char *argv[])
 {
 	libmtd_t mtd_desc;
 	struct mtd_dev_info mtd;
-	int fd, clmpos = 0, clmlen = 8;
+	int fd;
 	unsigned long long start;
 	unsigned int eb, eb_start, eb_cnt;
 	bool isNAND;
@@ -190,47 +261,8 @@ int flash_erase_main(int argc, char *argv[])
 
 	isNAND = mtd.type == MTD_NANDFLASH || mtd.type == MTD_MLCNANDFLASH;
 
-	if (jffs2) {
-		cleanmarker.magic = cpu_to_je16 (JFFS2_MAGIC_BITMASK);
-		cleanmarker.nodetype = cpu_to_je16 (JFFS2_NODETYPE_CLEANMARKER);
-		if (!isNAND)
-			cleanmarker.totlen = cpu_to_je32(sizeof(cleanmarker));
-		else {
-			struct nand_oobinfo oobinfo;
-
-			if (ioctl(fd, MEMGETOOBSEL, &oobinfo) != 0)
-				return sys_errmsg("%s: unable to get NAND oobinfo", mtd_device);
-
-			/* Check for autoplacement */
-			if (oobinfo.useecc == MTD_NANDECC_AUTOPLACE) {
-				/* Get the position of the free bytes */
-				if (!oobinfo.oobfree[0][1])
-					return errmsg(" Eeep. Autoplacement selected and no empty space in oob");
-				clmpos = oobinfo.oobfree[0][0];
-				clmlen = oobinfo.oobfree[0][1];
-				if (clmlen > 8)
-					clmlen = 8;
-			} else {
-				/* Legacy mode */
-				switch (mtd.oob_size) {
-					case 8:
-						clmpos = 6;
-						clmlen = 2;
-						break;
-					case 16:
-						clmpos = 8;
-						clmlen = 8;
-						break;
-					case 64:
-						clmpos = 16;
-						clmlen = 8;
-						break;
-				}
-			}
-			cleanmarker.totlen = cpu_to_je32(8);
-		}
-		cleanmarker.hdr_crc = cpu_to_je32(mtd_crc32(0, &cleanmarker, sizeof(cleanmarker) - 4));
-	}
+	if (jffs2 && jffs2_cleanmarker_init(&cleanmarker, &mtd, fd, mtd_device) != 0)
+		return -1;
 
 	/*
 	 * Now do the actual erasing of the MTD device
@@ -275,16 +307,9 @@ int flash_erase_main(int argc, char *argv[])
 			continue;
 
 		/* write cleanmarker */
-		if (isNAND) {
-			if (mtd_write_oob(mtd_desc, &mtd, fd, (uint64_t)offset + clmpos, clmlen, &cleanmarker) != 0) {
-				sys_errmsg("%s: MTD writeoob failure", mtd_device);
-				continue;
-			}
-		} else {
-			if (pwrite(fd, &cleanmarker, sizeof(cleanmarker), (loff_t)offset) != sizeof(cleanmarker)) {
-				sys_errmsg("%s: MTD write failure", mtd_device);
-				continue;
-			}
+		if (jffs2_cleanmarker_write(&cleanmarker, mtd_desc, &mtd, fd, eb) != 0) {
+			sys_errmsg("%s: MTD %s failure", mtd_device, isNAND ? "writeoob" : "write");
+			continue;
 		}
 		verbose(!quiet, " Cleanmarker written at %"PRIxoff_t, offset);
 	}
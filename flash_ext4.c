@@ -1,11 +1,16 @@
 #include "ofgwrite.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
+#include <telemetry.h>
+#include <tune.h>
 
 int flash_ext4_kernel(char* device, char* filename, off_t kernel_file_size, int quiet, int no_write)
 {
-	char buffer[512];
+	int buffer_size = tune_get()->write_buf;
+	char* buffer;
 
 	// Open kernel file
 	FILE* kernel_file;
@@ -25,6 +30,16 @@ int flash_ext4_kernel(char* device, char* filename, off_t kernel_file_size, int
 		return 0;
 	}
 
+	// may run concurrently with flashcp, which uses TUNE_WRITE_BUF
+	buffer = tune_buffer(TUNE_KERNEL_BUF);
+	if (buffer == NULL)
+	{
+		my_printf("Error allocating kernel buffer\n");
+		fclose(kernel_file);
+		fclose(kernel_dev);
+		return 0;
+	}
+
 	set_step("Writing ext4 kernel");
 	int ret;
 	long long readBytes = 0;
@@ -33,7 +48,7 @@ int flash_ext4_kernel(char* device, char* filename, off_t kernel_file_size, int
 	while (!feof(kernel_file))
 	{
 		// Don't add my_printf for debugging! Debug messages will be written to kernel device!
-		ret = fread(buffer, 1, sizeof(buffer), kernel_file);
+		ret = fread(buffer, 1, buffer_size, kernel_file);
 		if (ret == 0)
 		{
 			if (feof(kernel_file))
@@ -44,6 +59,7 @@ int flash_ext4_kernel(char* device, char* filename, off_t kernel_file_size, int
 			return 0;
 		}
 		readBytes += ret;
+		telemetry_add_read(ret);
 		new_percent = readBytes * 100/ kernel_file_size;
 		if (current_percent < new_percent)
 		{
@@ -52,14 +68,15 @@ int flash_ext4_kernel(char* device, char* filename, off_t kernel_file_size, int
 		}
 		if (!no_write)
 		{
-			ret = fwrite(buffer, ret, 1, kernel_dev);
-			if (ret != 1)
+			if (fwrite(buffer, ret, 1, kernel_dev) != 1)
 			{
+				telemetry_add_error();
 				my_printf("Error writing kernel file to kernel device.\n");
 				fclose(kernel_file);
 				fclose(kernel_dev);
 				return 0;
 			}
+			telemetry_add_written(ret);
 		}
 	}
 
@@ -71,20 +88,10 @@ int flash_ext4_kernel(char* device, char* filename, off_t kernel_file_size, int
 
 int rm_rootfs(char* directory, int quiet, int no_write)
 {
-	optind = 0; // reset getopt_long
-	char* argv[] = {
-		"rm",		// program name
-		"-r",		// recursive
-		"-f",		// force
-		directory,	// directory
-		NULL
-	};
-	int argc = (int)(sizeof(argv) / sizeof(argv[0])) - 1;
-
 	if (!quiet)
 		my_printf("Delete rootfs: rm -r -f %s\n", directory);
 	if (!no_write)
-		if (rm_main(argc, argv) != 0)
+		if (rm_recursive(directory) != 0)
 			return 0;
 
 	return 1;
@@ -92,38 +99,26 @@ int rm_rootfs(char* directory, int quiet, int no_write)
 
 int untar_rootfs(char* filename, char* directory, int quiet, int no_write)
 {
-	optind = 0; // reset getopt_long
-	char* argv[] = {
-		"tar",		// program name
-		"-x",		// extract
-		"-f",
-		filename,	// file
-		"-C",
-		directory,	// untar to directory
-		NULL
-	};
-	int argc = (int)(sizeof(argv) / sizeof(argv[0])) - 1;
-
 	if (!quiet)
 		my_printf("Untar: tar xf %s\n", filename);
 	if (!no_write)
-		if (tar_main(argc, argv) != 0)
+		if (tar_extract(filename, directory) != 0)
 			return 0;
 
 	return 1;
 }
 
-int flash_ext4_rootfs(char* filename, int quiet, int no_write)
+int flash_ext4_rootfs(char* filename, const char* sub_dir, int quiet, int no_write)
 {
 	int ret;
-	char path[1000];
+	char path[1100];
 
 	// instead of creating new filesystem just delete whole content
 	set_step("Deleting ext4 rootfs");
 	strcpy(path, "/oldroot_remount/");
-	if (current_rootfs_sub_dir[0] != '\0' && rootsubdir_check == 0) // box with rootSubDir feature
+	if (sub_dir[0] != '\0') // box with rootSubDir feature
 	{
-		strcat(path, rootfs_sub_dir);
+		strcat(path, sub_dir);
 		strcat(path, "/");
 	}
 	if (!no_write)
@@ -133,7 +128,7 @@ int flash_ext4_rootfs(char* filename, int quiet, int no_write)
 
 	set_step("Writing ext4 rootfs");
 	set_step_progress(0);
-	if (!no_write && current_rootfs_sub_dir[0] != '\0' && rootsubdir_check == 0) // box with rootSubDir feature
+	if (!no_write && sub_dir[0] != '\0') // box with rootSubDir feature
 		mkdir(path, 777); // directory is maybe not present
 	if (!untar_rootfs(filename, path, quiet, no_write))
 	{
@@ -144,3 +139,53 @@ int flash_ext4_rootfs(char* filename, int quiet, int no_write)
 	ret = chdir("/"); // needed to be able to umount filesystem
 	return 1;
 }
+
+// writes one rootfs image into several multiboot slots, the image is
+// decompressed only once for all of them
+int flash_ext4_rootfs_targets(char* filename, struct flash_target* targets, int cnt, int quiet, int no_write)
+{
+	int ret, i, failed;
+	char paths[MAX_FLASH_TARGETS][1100];
+	const char* dirs[MAX_FLASH_TARGETS];
+	int results[MAX_FLASH_TARGETS];
+
+	set_step("Deleting ext4 rootfs");
+	for (i = 0; i < cnt; i++)
+	{
+		strcpy(paths[i], targets[i].mount_point);
+		strcat(paths[i], "/");
+		if (current_rootfs_sub_dir[0] != '\0' && rootsubdir_check == 0) // box with rootSubDir feature
+		{
+			strcat(paths[i], targets[i].rootfs_sub_dir);
+			strcat(paths[i], "/");
+		}
+		dirs[i] = paths[i];
+		if (!no_write)
+			ret = rm_rootfs(paths[i], quiet, no_write); // ignore return value, see flash_ext4_rootfs
+	}
+
+	set_step("Writing ext4 rootfs");
+	set_step_progress(0);
+	for (i = 0; i < cnt; i++)
+	{
+		if (!no_write && current_rootfs_sub_dir[0] != '\0' && rootsubdir_check == 0)
+			mkdir(paths[i], 777); // directory is maybe not present
+		if (!quiet)
+			my_printf("Untar: tar xf %s to %s\n", filename, paths[i]);
+		results[i] = 0;
+	}
+	if (!no_write)
+		tar_extract_multi(filename, dirs, results, cnt);
+
+	failed = 0;
+	for (i = 0; i < cnt; i++)
+	{
+		targets[i].rootfs_result = results[i] == 0;
+		my_printf("Multiboot slot %d: %s\n", targets[i].slot, targets[i].rootfs_result ? "rootfs written" : "error writing rootfs");
+		if (!targets[i].rootfs_result)
+			failed++;
+	}
+	sync();
+	ret = chdir("/"); // needed to be able to umount filesystem
+	return failed == 0;
+}
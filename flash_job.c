@@ -0,0 +1,138 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+// Flashes kernel and rootfs at the same time when they are on independent
+// devices, e.g. MTD kernel and eMMC rootfs. Every job runs in its own
+// thread with its own context, the step progress bar shows the progress
+// of all jobs weighted by their image size.
+//
+// Independent devices always mean different flash tools, so no tool runs
+// in two threads at once.
+
+static __thread struct flash_job* current_job;
+// shared with forked decompressors, which report progress, too
+static struct flash_job* running_jobs;
+static int running_cnt;
+
+// whole disk of a block device, e.g. mmcblk0 for /dev/mmcblk0p3
+static int disk_name(const char* device, char* disk, int size)
+{
+	char path[PATH_MAX];
+	char real[PATH_MAX];
+	const char* name = strrchr(device, '/') ? strrchr(device, '/') + 1 : device;
+
+	snprintf(path, sizeof(path), "/sys/class/block/%s", name);
+	if (realpath(path, real) == NULL)
+		return 0;
+	snprintf(path, sizeof(path), "/sys/class/block/%s/partition", name);
+	if (access(path, F_OK) == 0)
+		*strrchr(real, '/') = '\0';
+	snprintf(disk, size, "%s", strrchr(real, '/') + 1);
+	return 1;
+}
+
+int independent_devices(const char* dev1, const char* dev2)
+{
+	char disk1[NAME_MAX + 1];
+	char disk2[NAME_MAX + 1];
+	int mtd1 = strncmp(dev1, "/dev/mtd", 8) == 0;
+	int mtd2 = strncmp(dev2, "/dev/mtd", 8) == 0;
+
+	// all MTD partitions are on the same flash chip
+	if (mtd1 || mtd2)
+		return mtd1 != mtd2;
+	if (!disk_name(dev1, disk1, sizeof(disk1)) || !disk_name(dev2, disk2, sizeof(disk2)))
+		return 0;
+	return strcmp(disk1, disk2) != 0;
+}
+
+int flash_job_concurrent()
+{
+	return current_job != NULL && running_jobs != NULL;
+}
+
+int flash_job_progress(int percent)
+{
+	long long done = 0;
+	long long total = 0;
+	long long size;
+	int i;
+
+	if (!flash_job_concurrent())
+		return percent;
+
+	current_job->percent = percent;
+	for (i = 0; i < running_cnt; i++)
+	{
+		size = running_jobs[i].file_size > 0 ? running_jobs[i].file_size : 1;
+		done  += running_jobs[i].percent * size;
+		total += size;
+	}
+	return done / total;
+}
+
+static void* job_thread(void* arg)
+{
+	struct flash_job* job = arg;
+
+	current_job = job;
+	job->result = job->flash(job);
+	current_job = NULL;
+	return NULL;
+}
+
+int flash_jobs_concurrent(struct flash_job* jobs, int cnt)
+{
+	struct flash_job* shared;
+	pthread_t threads[cnt];
+	int started[cnt];
+	int ret = 1;
+	int i;
+
+	shared = mmap(NULL, cnt * sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+	{
+		my_printf("Error allocating flash jobs\n");
+		return 0;
+	}
+	memcpy(shared, jobs, cnt * sizeof(*shared));
+	running_jobs = shared;
+	running_cnt = cnt;
+
+	for (i = 0; i < cnt; i++)
+	{
+		shared[i].percent = 0;
+		started[i] = pthread_create(&threads[i], NULL, job_thread, &shared[i]) == 0;
+		if (!started[i])
+		{
+			my_printf("Error starting %s job, flashing it in sequence\n", shared[i].name);
+			job_thread(&shared[i]);
+		}
+	}
+
+	// a failed job never stops the other one, a half written partition
+	// is worse than a completely written one
+	for (i = 0; i < cnt; i++)
+	{
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		jobs[i].result = shared[i].result;
+		if (!jobs[i].result)
+		{
+			my_printf("Error flashing %s\n", jobs[i].name);
+			ret = 0;
+		}
+	}
+
+	running_jobs = NULL;
+	running_cnt = 0;
+	munmap(shared, cnt * sizeof(*shared));
+	return ret;
+}
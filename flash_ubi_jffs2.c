@@ -12,158 +12,60 @@
 #include <libmtd.h>
 #include <errno.h>
 #include <mtd/mtd-abi.h>
+#include <jffs2sum.h>
+#include <mtd_dev.h>
+#include <tune.h>
 
+#define JFFS2_SUMMARY_TMP_FILE "/tmp/ofgwrite_summary.jffs2"
 
-int getFlashType(char* device)
+int flash_write(struct mtd_dev_handle* dev, char* filename, char* context, int jffs2, int jffs2_summary, int quiet, int no_write)
 {
-	libmtd_t libmtd = libmtd_open();
-	if (libmtd == NULL)
-	{
-		if (errno == 0)
-			my_printf("MTD is not present in the system");
-		my_printf("cannot open libmtd %s", strerror(errno));
-		return -1;
-	}
-
-	struct mtd_dev_info mtd;
-	int err = mtd_get_dev_info(libmtd, device, &mtd);
-	if (err)
-	{
-		my_fprintf(stderr, "cannot get information about \"%s\"\n", device);
-		return -1;
-	}
-
-	libmtd_close(libmtd);
-
-	return mtd.type;
-}
-
-int flash_erase(char* device, char* context, int quiet, int no_write)
-{
-	optind = 0; // reset getopt_long
-	char* argv[] = {
-		"flash_erase",	// program name
-		device,			// device
-		"0",			// start offset
-		"0",			// block count
-		NULL
-	};
-	int argc = (int)(sizeof(argv) / sizeof(argv[0])) - 1;
-
-	if (!quiet)
-		my_printf("Erasing %s: flash_erase %s 0 0\n", context, device);
-	if (!no_write)
-		if (flash_erase_main(argc, argv) != 0)
-			return 0;
-
-	return 1;
-}
-
-int flash_erase_jffs2(char* device, char* context, int quiet, int no_write)
-{
-	optind = 0; // reset getopt_long
-	char* argv[] = {
-		"flash_erase",	// program name
-		"-j",			// format the device for jffs2
-		device,			// device
-		"0",			// start offset
-		"0",			// block count
-		NULL
-	};
-	int argc = (int)(sizeof(argv) / sizeof(argv[0])) - 1;
-
-	if (!quiet)
-		my_printf("Erasing %s: flash_erase -j %s 0 0\n", context, device);
-	if (!no_write)
-		if (flash_erase_main(argc, argv) != 0)
-			return 0;
-
-	return 1;
-}
-
-int flash_write(char* device, char* filename, int quiet, int no_write)
-{
-	optind = 0; // reset getopt_long
-	char opts[4];
-	strcpy(opts, "-pm");
-	char* argv[] = {
-		"nandwrite",	// program name
-		opts,			// options -p for pad and -m for mark bad blocks
-		device,			// device
-		filename,		// file to flash
-		NULL
-	};
-	int argc = (int)(sizeof(argv) / sizeof(argv[0])) - 1;
+	// pad, mark bad blocks and erase while writing
+	int flags = NANDWRITE_PAD | NANDWRITE_MARKBAD | NANDWRITE_ERASE;
+	if (jffs2)
+		flags |= NANDWRITE_JFFS2; // write JFFS2 cleanmarkers to erased blocks
+	if (jffs2_summary)
+		flags |= NANDWRITE_JFFS2_SUMMARY; // add JFFS2 erase block summary while writing
 
 	if (!quiet)
-		my_printf("Flashing kernel: nandwrite %s %s %s\n", opts, device, filename);
+		my_printf("Erasing and flashing %s: nandwrite %s %s%s%s\n", context, dev->node, filename,
+			jffs2 ? " (JFFS2)" : "", jffs2_summary ? " (summary)" : "");
 	if (!no_write)
-		if (nandwrite_main(argc, argv) != 0)
+		if (nandwrite_dev(dev, filename, flags) != 0)
 			return 0;
 
 	return 1;
 }
 
-int ubi_write(char* device, char* filename, int quiet, int no_write)
+int ubi_write(struct mtd_dev_handle* dev, char* filename, int quiet, int no_write)
 {
-	optind = 0; // reset getopt_long
-	char* argv[] = {
-		"ubiformat",	// program name
-		device,			// device
-		"-f",			// flash file
-		filename,		// file to flash
-		"-D",			// no detach check
-		NULL
-	};
-	int argc = (int)(sizeof(argv) / sizeof(argv[0])) - 1;
-
-	my_printf("Flashing rootfs: ubiformat %s -f %s\n", device, filename);
+	my_printf("Flashing rootfs: ubiformat %s -f %s\n", dev->node, filename);
 	if (!no_write)
-		if (ubiformat_main(argc, argv) != 0)
+		if (ubiformat_dev(dev, filename, tune_get()->erase_ahead, 0) != 0) // not quiet, progress is needed for the display
 			return 0;
 
 	return 1;
 }
 
-int ubi_detach_dev(char* device, int quiet, int no_write)
+int ubi_detach_dev(struct mtd_dev_handle* dev, int quiet, int no_write)
 {
-	optind = 0; // reset getopt_long
-	char* argv[] = {
-		"ubidetach",	// program name
-		"-p",			// path to device
-		device,			// device
-		NULL
-	};
-	int argc = (int)(sizeof(argv) / sizeof(argv[0])) - 1;
-
-	my_printf("Detach rootfs: ubidetach -p %s\n", device);
+	my_printf("Detach rootfs: ubidetach -p %s\n", dev->node);
 	if (!no_write)
-		if (ubidetach_main(argc, argv) != 0)
+		if (ubidetach_dev(dev) != 0)
 			return 0;
 
 	return 1;
 }
 
-int flashcp(char* device, char* filename, int reboot, int quiet, int no_write)
+int flashcp(struct mtd_dev_handle* dev, char* filename, int reboot, int quiet, int no_write)
 {
-	optind = 0; // reset getopt_long
-	char opts[4];
+	int flags = FLASHCP_VERBOSE;
 	if (reboot)
-		strcpy(opts, "-vr\0");
-	else
-		strcpy(opts, "-v\0");
-	char* argv[] = {
-		"flashcp",		// program name
-		opts,			// options -v verbose -r reboot immediately after flashing
-		filename,		// file to flash
-		device,			// device
-		NULL
-	};
-	int argc = (int)(sizeof(argv) / sizeof(argv[0])) - 1;
-
-	my_printf("Flashing rootfs: flashcp %s %s %s\n", opts, filename, device);
+		flags |= FLASHCP_REBOOT; // reboot immediately after flashing
+
+	my_printf("Flashing rootfs: flashcp %s %s %s\n", reboot ? "-vr" : "-v", filename, dev->node);
 	if (!no_write)
-		if (flashcp_main(argc, argv) != 0)
+		if (flashcp_dev(dev, filename, flags) != 0)
 			return 0;
 
 	return 1;
@@ -171,78 +73,95 @@ int flashcp(char* device, char* filename, int reboot, int quiet, int no_write)
 
 int flash_ubi_jffs2_kernel(char* device, char* filename, int quiet, int no_write)
 {
-	int type = getFlashType(device);
-	if (type == -1)
+	struct mtd_dev_handle dev;
+	int ret = 1;
+
+	if (mtd_dev_open(&dev, device) != 0)
 		return 0;
 
+	int type = dev.mtd.type;
 	if (type == MTD_NANDFLASH || type == MTD_MLCNANDFLASH)
 	{
 		my_printf("Found NAND flash\n");
-		// Erase
-		set_step("Erasing kernel");
-		if (!flash_erase(device, "kernel", quiet, no_write))
-		{
-			my_printf("Error erasing kernel! System might not boot. If you have problems please flash backup!\n");
-			return 0;
-		}
-
-		// Flash
+		// Erase and flash in one pass
 		set_step("Writing kernel");
-		if (!flash_write(device, filename, quiet, no_write))
+		if (!flash_write(&dev, filename, "kernel", 0, 0, quiet, no_write))
 		{
 			my_printf("Error flashing kernel! System won't boot. Please flash backup!\n");
-			return 0;
+			ret = 0;
 		}
 	}
 	else if (type == MTD_NORFLASH)
 	{
 		my_printf("Found NOR flash\n");
-		if (!flashcp(device, filename, 0, quiet, no_write))
+		if (!flashcp(&dev, filename, 0, quiet, no_write))
 		{
 			my_printf("Error flashing kernel! System won't boot. Please flash backup!\n");
-			return 0;
+			ret = 0;
 		}
 	}
 	else
 	{
 		my_fprintf(stderr, "Flash type \"%d\" not supported\n", type);
+		ret = 0;
+	}
+
+	mtd_dev_close(&dev);
+	return ret;
+}
+
+// NOR flash is written with flashcp, which needs the image size in advance -> write summarized image to tmpfs
+int flashcp_jffs2_summary(struct mtd_dev_handle* dev, char* filename, int quiet, int no_write)
+{
+	int ret;
+
+	my_printf("Adding JFFS2 erase block summary: %s -> %s\n", filename, JFFS2_SUMMARY_TMP_FILE);
+	if (jffs2_sum_convert(filename, JFFS2_SUMMARY_TMP_FILE, dev->mtd.eb_size, 1) != 0)
+	{
+		my_printf("Error adding JFFS2 erase block summary\n");
 		return 0;
 	}
 
-	return 1;
+	ret = flashcp(dev, JFFS2_SUMMARY_TMP_FILE, 1, quiet, no_write);
+	unlink(JFFS2_SUMMARY_TMP_FILE);
+	return ret;
 }
 
-int flash_ubi_jffs2_rootfs(char* device, char* filename, enum RootfsTypeEnum rootfs_type, int quiet, int no_write)
+int flash_ubi_jffs2_rootfs(char* device, char* filename, enum RootfsTypeEnum rootfs_type, int jffs2_summary, int quiet, int no_write)
 {
-	int type = getFlashType(device);
-	if (type == -1)
+	struct mtd_dev_handle dev;
+	int ret = 1;
+
+	if (mtd_dev_open(&dev, device) != 0)
 		return 0;
 
+	int type = dev.mtd.type;
 	if ((type == MTD_NANDFLASH || type == MTD_MLCNANDFLASH) && rootfs_type == UBIFS)
 	{
 		my_printf("Found NAND flash\n");
-		if (!ubi_write(device, filename, quiet, no_write))
-			return 0;
+		ret = ubi_write(&dev, filename, quiet, no_write);
 	}
 	else if ((type == MTD_NANDFLASH || type == MTD_MLCNANDFLASH) && rootfs_type == JFFS2)
 	{
 		my_printf("Found NAND flash\n");
-		if (!flash_erase_jffs2(device, "rootfs", quiet, no_write))
-			return 0;
-		if (!flash_write(device, filename, quiet, no_write))
-			return 0;
+		ret = flash_write(&dev, filename, "rootfs", 1, jffs2_summary, quiet, no_write);
+	}
+	else if (type == MTD_NORFLASH && rootfs_type == JFFS2 && jffs2_summary)
+	{
+		my_printf("Found NOR flash\n");
+		ret = flashcp_jffs2_summary(&dev, filename, quiet, no_write);
 	}
 	else if (type == MTD_NORFLASH && rootfs_type == JFFS2)
 	{
 		my_printf("Found NOR flash\n");
-		if (!flashcp(device, filename, 1, quiet, no_write))
-			return 0;
+		ret = flashcp(&dev, filename, 1, quiet, no_write);
 	}
 	else
 	{
 		my_fprintf(stderr, "Flash type \"%d\" in combination with rootfs type %d is not supported\n", type, rootfs_type);
-		return 0;
+		ret = 0;
 	}
 
-	return 1;
-}
\ No newline at end of file
+	mtd_dev_close(&dev);
+	return ret;
+}
@@ -44,6 +44,10 @@
 #include <getopt.h>
 #include <syslog.h>
 #include <linux/reboot.h>
+#include <mtd_dev.h>
+#include <telemetry.h>
+#include <tune.h>
+#include <logger.h>
 
 typedef int bool;
 #define true 1
@@ -64,8 +68,8 @@ typedef int bool;
 #define KB(x) ((x) / 1024)
 #define PERCENTAGE(x,total) (((x) * 100) / (total))
 
-/* size of read/write buffer */
-#define BUFSIZE (10 * 1024)
+/* size of read/write buffer, changed for ofgwrite: chosen by tune_probe () */
+#define BUFSIZE ((size_t) tune_get ()->write_buf)
 
 /* cmd-line flags */
 #define FLAG_NONE		0x00
@@ -174,6 +178,7 @@ static int safe_rewind (int fd,const char *filename)
 /******************************************************************************/
 
 static int dev_fd = -1,fil_fd = -1;
+static unsigned char *src;
 
 static void cleanup (void)
 {
@@ -181,87 +186,24 @@ static void cleanup (void)
 	if (fil_fd > 0) close (fil_fd);
 }
 
-int flashcp_main (int argc,char *argv[])
+/*
+ * Erase and write filename to the device opened as dev_fd. mtd only needs
+ * the size and erasesize fields.
+ */
+static int flashcp (const char *device,const char *filename,const struct mtd_info_user *mtd,int flags)
 {
-	const char *filename = NULL,*device = NULL;
-	int i,flags = FLAG_NONE;
+	int i;
 	ssize_t result;
 	size_t size,written;
-	struct mtd_info_user mtd;
 	struct erase_info_user erase;
 	struct stat filestat;
-	unsigned char src[BUFSIZE],dest[BUFSIZE];
 	int ret = 1;
 
-	/*********************
-	 * parse cmd-line
-	 *****************/
-
-	for (;;) {
-		int option_index = 0;
-		static const char *short_options = "hvr";
-		static const struct option long_options[] = {
-			{"help", no_argument, 0, 'h'},
-			{"verbose", no_argument, 0, 'v'},
-			{"reboot", no_argument, 0, 'r'},
-			{0, 0, 0, 0},
-		};
-
-		int c = getopt_long(argc, argv, short_options,
-				long_options, &option_index);
-		if (c == EOF) {
-			break;
-		}
-
-		switch (c) {
-			case 'h':
-				flags |= FLAG_HELP;
-				DEBUG("Got FLAG_HELP\n");
-				break;
-			case 'v':
-				flags |= FLAG_VERBOSE;
-				DEBUG("Got FLAG_VERBOSE\n");
-				break;
-			case 'r':
-				flags |= FLAG_REBOOT;
-				DEBUG("Got FLAG_REBOOT\n");
-				break;
-			default:
-				DEBUG("Unknown parameter: %s\n",argv[option_index]);
-				showusage(true);
-				return -1;
-		}
-	}
-	if (optind+2 == argc) {
-		flags |= FLAG_FILENAME;
-		filename = argv[optind];
-		DEBUG("Got filename: %s\n",filename);
-
-		flags |= FLAG_DEVICE;
-		device = argv[optind+1];
-		DEBUG("Got device: %s\n",device);
-	}
-
-	if (flags & FLAG_HELP || device == NULL)
-	{
-		showusage(flags != FLAG_HELP);
-		return -1;
-	}
-
-	//atexit (cleanup);
-
-	/* get some info about the flash device */
-	dev_fd = safe_open (device,O_SYNC | O_RDWR);
-	if (dev_fd < 0)
+	/* changed for ofgwrite: the buffer belongs to the arena of tune_probe () */
+	src = tune_buffer (TUNE_WRITE_BUF);
+	if (src == NULL)
 	{
-		return -1;
-	}
-	if (ioctl (dev_fd,MEMGETINFO,&mtd) < 0)
-	{
-		DEBUG("ioctl(): %m\n");
-		log_printf (LOG_ERROR,"This doesn't seem to be a valid MTD flash device!\n");
-		//exit (EXIT_FAILURE);
-		cleanup;
+		log_printf (LOG_ERROR,"Out of memory allocating a %lu bytes buffer\n",BUFSIZE);
 		return -1;
 	}
 
@@ -281,7 +223,7 @@ int flashcp_main (int argc,char *argv[])
 	}
 
 	/* does it fit into the device/partition? */
-	if (filestat.st_size > mtd.size)
+	if (filestat.st_size > mtd->size)
 	{
 		log_printf (LOG_ERROR,"%s won't fit into %s!\n",filename,device);
 		//exit (EXIT_FAILURE);
@@ -296,8 +238,8 @@ int flashcp_main (int argc,char *argv[])
 #warning "Check for smaller erase regions"
 
 	erase.start = 0;
-	erase.length = (filestat.st_size + mtd.erasesize - 1) / mtd.erasesize;
-	erase.length *= mtd.erasesize;
+	erase.length = (filestat.st_size + mtd->erasesize - 1) / mtd->erasesize;
+	erase.length *= mtd->erasesize;
 
 	if (flags & FLAG_REBOOT)
 		set_step("Erasing rootfs");
@@ -307,8 +249,8 @@ int flashcp_main (int argc,char *argv[])
 	if (flags & FLAG_VERBOSE)
 	{
 		/* if the user wants verbose output, erase 1 block at a time and show him/her what's going on */
-		int blocks = erase.length / mtd.erasesize;
-		erase.length = mtd.erasesize;
+		int blocks = erase.length / mtd->erasesize;
+		erase.length = mtd->erasesize;
 		log_printf (LOG_NORMAL,"Erasing blocks: 0/%d (0%%)",blocks);
 		for (i = 1; i <= blocks; i++)
 		{
@@ -317,6 +259,7 @@ int flashcp_main (int argc,char *argv[])
 				log_printf (LOG_NORMAL,"\rErasing blocks: %d/%d (%d%%)",i,blocks,PERCENTAGE (i,blocks));
 			if (ioctl (dev_fd,MEMERASE,&erase) < 0)
 			{
+				telemetry_add_error ();
 				log_printf (LOG_NORMAL,"\n");
 				log_printf (LOG_ERROR,
 						"While erasing blocks 0x%.8x-0x%.8x on %s: %m\n",
@@ -325,7 +268,8 @@ int flashcp_main (int argc,char *argv[])
 				cleanup;
 				return -1;
 			}
-			erase.start += mtd.erasesize;
+			telemetry_add_erase (1);
+			erase.start += mtd->erasesize;
 		}
 		log_printf (LOG_NORMAL,"\rErasing blocks: %d/%d (100%%)\n",blocks,blocks);
 	}
@@ -334,6 +278,7 @@ int flashcp_main (int argc,char *argv[])
 		/* if not, erase the whole chunk in one shot */
 		if (ioctl (dev_fd,MEMERASE,&erase) < 0)
 		{
+			telemetry_add_error ();
 			log_printf (LOG_ERROR,
 					"While erasing blocks from 0x%.8x-0x%.8x on %s: %m\n",
 					(unsigned int) erase.start,(unsigned int) (erase.start + erase.length),device);
@@ -341,7 +286,9 @@ int flashcp_main (int argc,char *argv[])
 			cleanup;
 			return -1;
 		}
+		telemetry_add_erase (erase.length / mtd->erasesize);
 	}
+	telemetry_device (device,mtd->size / mtd->erasesize,0,-1);
 	DEBUG("Erased %u / %luk bytes\n",erase.length,filestat.st_size);
 
 	/**********************************
@@ -376,11 +323,15 @@ int flashcp_main (int argc,char *argv[])
 			cleanup;
 			return -1;
 		}
+		telemetry_add_read (i);
 
 		/* write to device */
 		result = write (dev_fd,src,i);
+		if (result > 0)
+			telemetry_add_written (result);
 		if (i != result)
 		{
+			telemetry_add_error ();
 			if (flags & FLAG_VERBOSE) log_printf (LOG_NORMAL,"\n");
 			if (result < 0)
 			{
@@ -481,6 +432,7 @@ int flashcp_main (int argc,char *argv[])
 	if (flags & FLAG_REBOOT)
 	{
 		sleep(3);
+		log_flush ();
 		reboot(LINUX_REBOOT_CMD_RESTART);
 	}
 	//exit (EXIT_SUCCESS);
@@ -488,3 +440,101 @@ int flashcp_main (int argc,char *argv[])
 	return 0;
 }
 
+int flashcp_dev (struct mtd_dev_handle *dev,const char *filename,int flags)
+{
+	struct mtd_info_user mtd;
+	int ret;
+
+	mtd.size = dev->mtd.size;
+	mtd.erasesize = dev->mtd.eb_size;
+
+	dev_fd = dev->fd;
+	fil_fd = -1;
+	ret = flashcp (dev->node,filename,&mtd,flags);
+	if (fil_fd > 0) close (fil_fd);
+	dev_fd = fil_fd = -1;
+
+	return ret;
+}
+
+int flashcp_main (int argc,char *argv[])
+{
+	const char *filename = NULL,*device = NULL;
+	int flags = FLAG_NONE;
+	struct mtd_info_user mtd;
+
+	/*********************
+	 * parse cmd-line
+	 *****************/
+
+	for (;;) {
+		int option_index = 0;
+		static const char *short_options = "hvr";
+		static const struct option long_options[] = {
+			{"help", no_argument, 0, 'h'},
+			{"verbose", no_argument, 0, 'v'},
+			{"reboot", no_argument, 0, 'r'},
+			{0, 0, 0, 0},
+		};
+
+		int c = getopt_long(argc, argv, short_options,
+				long_options, &option_index);
+		if (c == EOF) {
+			break;
+		}
+
+		switch (c) {
+			case 'h':
+				flags |= FLAG_HELP;
+				DEBUG("Got FLAG_HELP\n");
+				break;
+			case 'v':
+				flags |= FLAG_VERBOSE;
+				DEBUG("Got FLAG_VERBOSE\n");
+				break;
+			case 'r':
+				flags |= FLAG_REBOOT;
+				DEBUG("Got FLAG_REBOOT\n");
+				break;
+			default:
+				DEBUG("Unknown parameter: %s\n",argv[option_index]);
+				showusage(true);
+				return -1;
+		}
+	}
+	if (optind+2 == argc) {
+		flags |= FLAG_FILENAME;
+		filename = argv[optind];
+		DEBUG("Got filename: %s\n",filename);
+
+		flags |= FLAG_DEVICE;
+		device = argv[optind+1];
+		DEBUG("Got device: %s\n",device);
+	}
+
+	if (flags & FLAG_HELP || device == NULL)
+	{
+		showusage(flags != FLAG_HELP);
+		return -1;
+	}
+
+	//atexit (cleanup);
+
+	/* get some info about the flash device */
+	dev_fd = safe_open (device,O_SYNC | O_RDWR);
+	if (dev_fd < 0)
+	{
+		return -1;
+	}
+	if (ioctl (dev_fd,MEMGETINFO,&mtd) < 0)
+	{
+		DEBUG("ioctl(): %m\n");
+		log_printf (LOG_ERROR,"This doesn't seem to be a valid MTD flash device!\n");
+		//exit (EXIT_FAILURE);
+		cleanup;
+		return -1;
+	}
+
+	return flashcp (device,filename,&mtd,flags);
+}
+
@@ -60,6 +60,10 @@ extern "C" {
 #define PRIdoff_t "l"PRId32
 #endif
 
+/* changed for ofgwrite: whether a console progress line is due, they are
+ * printed at the frame rate of the UI; @done forces the last line */
+int progress_due(int done);
+
 /* Verbose messages */
 #define bareverbose(verbose, fmt, ...) do {                        \
 	if (verbose)                                               \
@@ -0,0 +1,71 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * JFFS2 cleanmarker helpers shared by flash_erase and nandwrite.
+ */
+
+#ifndef __FLASH_ERASE_H__
+#define __FLASH_ERASE_H__
+
+#include <stdint.h>
+#include <libmtd.h>
+#include <mtd/jffs2-user.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * struct jffs2_cleanmarker - JFFS2 cleanmarker of an MTD device.
+ * @node: the cleanmarker node
+ * @pos: position of the cleanmarker in OOB (NAND only)
+ * @len: number of bytes written to OOB (NAND only)
+ * @isNAND: cleanmarker is written to OOB instead of the eraseblock data
+ */
+struct jffs2_cleanmarker
+{
+	struct jffs2_unknown_node node;
+	int pos;
+	int len;
+	int isNAND;
+};
+
+/**
+ * jffs2_cleanmarker_init - prepare the cleanmarker for an MTD device.
+ * @clm: cleanmarker to initialize
+ * @mtd: MTD device description object
+ * @fd: MTD device node file descriptor
+ * @mtd_device: MTD device node name (for error messages)
+ *
+ * Returns %0 in case of success and %-1 in case of failure.
+ */
+int jffs2_cleanmarker_init(struct jffs2_cleanmarker *clm,
+			   const struct mtd_dev_info *mtd, int fd,
+			   const char *mtd_device);
+
+/**
+ * jffs2_cleanmarker_write - write the cleanmarker to an erased eraseblock.
+ * @clm: cleanmarker
+ * @desc: MTD library descriptor
+ * @mtd: MTD device description object
+ * @fd: MTD device node file descriptor
+ * @eb: eraseblock to write the cleanmarker to
+ *
+ * Returns %0 in case of success and %-1 in case of failure.
+ */
+int jffs2_cleanmarker_write(const struct jffs2_cleanmarker *clm, libmtd_t desc,
+			    const struct mtd_dev_info *mtd, int fd, int eb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FLASH_ERASE_H__ */
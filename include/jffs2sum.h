@@ -0,0 +1,79 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * JFFS2 erase block summary generation while flashing (see sumtool from
+ * mtd-utils).
+ */
+
+#ifndef __JFFS2SUM_H__
+#define __JFFS2SUM_H__
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct jffs2_sum_stream;
+
+/**
+ * jffs2_sum_open - start summarizing a JFFS2 image.
+ * @fd: file descriptor of the input image
+ * @eb_size: eraseblock size of the target flash
+ * @cleanmarker: non-zero if cleanmarkers are stored inline (NOR flash)
+ *
+ * The input node stream is repacked into eraseblocks of @eb_size bytes and
+ * a summary node is appended to each of them. Returns %NULL on error.
+ */
+struct jffs2_sum_stream *jffs2_sum_open(int fd, int eb_size, int cleanmarker);
+
+/**
+ * jffs2_sum_read - read summarized image data.
+ * @s: summary stream
+ * @buf: buffer to store the data
+ * @len: how many bytes to read
+ *
+ * Returns the number of bytes read, %0 at the end of the image and %-1 if
+ * the input is not a valid JFFS2 image.
+ */
+ssize_t jffs2_sum_read(struct jffs2_sum_stream *s, void *buf, size_t len);
+
+/**
+ * jffs2_sum_consumed - get the number of input bytes processed so far.
+ * @s: summary stream
+ */
+long long jffs2_sum_consumed(const struct jffs2_sum_stream *s);
+
+/**
+ * jffs2_sum_close - free the summary stream.
+ * @s: summary stream
+ *
+ * The input file descriptor is not closed.
+ */
+void jffs2_sum_close(struct jffs2_sum_stream *s);
+
+/**
+ * jffs2_sum_convert - write a summarized copy of a JFFS2 image.
+ * @src: input image file name
+ * @dst: output image file name
+ * @eb_size: eraseblock size of the target flash
+ * @cleanmarker: non-zero if cleanmarkers are stored inline (NOR flash)
+ *
+ * Returns %0 in case of success and %-1 in case of failure.
+ */
+int jffs2_sum_convert(const char *src, const char *dst, int eb_size,
+		      int cleanmarker);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __JFFS2SUM_H__ */
@@ -0,0 +1,136 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * Library interface of ofgwrite, so E2 plugins can flash a not running
+ * image in their own process.
+ */
+
+#ifndef __LIBOFGWRITE_H__
+#define __LIBOFGWRITE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * struct ofgwrite_options - what to flash.
+ * @image_dir: directory containing the kernel and rootfs images
+ * @flash_kernel: flash the kernel
+ * @flash_rootfs: flash the rootfs, both %0 flashes kernel and rootfs
+ * @kernel_device: e.g. "mmcblk0p2", %NULL to find it like ofgwrite does
+ * @rootfs_device: e.g. "mmcblk0p3", %NULL to find it like ofgwrite does
+ * @multiboot_partition: multiboot slot 1-9, %-1 for the current one
+ * @no_write: only simulate flashing
+ * @quiet: less output
+ * @jffs2_summary: write the JFFS2 summary
+ * @parallel: flash kernel and rootfs concurrently on independent devices
+ * @progress: called with the current step and its progress in percent,
+ *	may be %NULL
+ * @log: called with every log message, may be %NULL
+ * @user: passed to @progress and @log
+ *
+ * The callbacks are called from the flashing threads of the process,
+ * never from forked children. They must not call the library.
+ */
+struct ofgwrite_options
+{
+	const char *image_dir;
+	int flash_kernel;
+	int flash_rootfs;
+	const char *kernel_device;
+	const char *rootfs_device;
+	int multiboot_partition;
+	int no_write;
+	int quiet;
+	int jffs2_summary;
+	int parallel;
+	void (*progress)(void *user, const char *step, int percent);
+	void (*log)(void *user, const char *msg);
+	void *user;
+};
+
+/**
+ * struct ofgwrite_plan - result of 'ofgwrite_plan()'.
+ * @kernel_file: kernel image, "" if the kernel isn't flashed
+ * @kernel_device: device the kernel is written to
+ * @rootfs_file: rootfs image, "" if the rootfs isn't flashed
+ * @rootfs_device: device the rootfs is written to
+ * @multiboot_partition: multiboot slot, %-1 if there is none
+ * @concurrent: kernel and rootfs are flashed at the same time
+ * @running_image: the running image would be flashed, which needs E2 to
+ *	be stopped. Only the ofgwrite command can do that.
+ *
+ * The strings belong to the context.
+ */
+struct ofgwrite_plan
+{
+	const char *kernel_file;
+	const char *kernel_device;
+	const char *rootfs_file;
+	const char *rootfs_device;
+	int multiboot_partition;
+	int concurrent;
+	int running_image;
+};
+
+struct ofgwrite_ctx;
+
+/**
+ * ofgwrite_new - create the context of a flash job.
+ * @opts: options, copied into the context
+ *
+ * Returns the context or %NULL if out of memory.
+ */
+struct ofgwrite_ctx *ofgwrite_new(const struct ofgwrite_options *opts);
+
+/**
+ * ofgwrite_plan - find the images and devices to flash.
+ * @ctx: context
+ * @plan: filled with the result, may be %NULL
+ *
+ * Nothing is written. Returns %1 on success, %0 on error.
+ */
+int ofgwrite_plan(struct ofgwrite_ctx *ctx, struct ofgwrite_plan *plan);
+
+/**
+ * ofgwrite_execute - flash the planned images.
+ * @ctx: context
+ *
+ * Plans first if 'ofgwrite_plan()' wasn't called. Contexts can be used from
+ * several threads, but flashing is serialized: the flash tools share
+ * process state. Refuses to flash the running image. Returns %1 on success,
+ * %0 on error.
+ *
+ * Fatal errors of the busybox code, e.g. a corrupt archive or no memory,
+ * make 'ofgwrite_plan()' and 'ofgwrite_execute()' fail, the process isn't
+ * ended. Memory and file descriptors of the aborted step may be leaked.
+ */
+int ofgwrite_execute(struct ofgwrite_ctx *ctx);
+
+/**
+ * ofgwrite_error - description of the last error.
+ * @ctx: context
+ *
+ * Returns "" if there was no error.
+ */
+const char *ofgwrite_error(const struct ofgwrite_ctx *ctx);
+
+/**
+ * ofgwrite_free - free a context.
+ * @ctx: context, may be %NULL
+ */
+void ofgwrite_free(struct ofgwrite_ctx *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBOFGWRITE_H__ */
@@ -0,0 +1,86 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * Asynchronous log output of my_printf() and my_fprintf().
+ */
+
+#ifndef __LOGGER_H__
+#define __LOGGER_H__
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LOG_FILE "ofgwrite.log"
+
+/**
+ * log_start - start the log thread.
+ * @dir: directory of the log file, %NULL for console and syslog only
+ *
+ * Messages are formatted into a ring buffer and written to the console,
+ * syslog and @dir/%LOG_FILE by a thread, so a blocking syslog can't stall
+ * flashing. Returns %1 on success, %0 if messages stay synchronous.
+ */
+int log_start(const char *dir);
+
+/**
+ * log_restart - start the log thread in a forked child.
+ *
+ * Threads don't survive 'fork()', so a child which goes on flashing, e.g.
+ * after daemonizing, restarts it. 'log_flush()' has to be called before
+ * forking. Returns %1 on success, %0 if messages stay synchronous.
+ */
+int log_restart(void);
+
+/**
+ * log_vprintf - log a message.
+ * @f: %stdout or %stderr, other files are written synchronously
+ * @fmt: format
+ * @ap: arguments
+ *
+ * Doesn't block on console or syslog while the log thread runs, only waits
+ * up to 50 ms if the ring buffer is full, then the message is dropped.
+ * Forked children and messages before 'log_start()' are written
+ * synchronously, to the log file, too.
+ */
+void log_vprintf(FILE *f, const char *fmt, va_list ap);
+
+/**
+ * log_flush - wait until all messages are written.
+ *
+ * Waits at most a few seconds, a hanging syslog must not prevent a reboot.
+ * The log file is synced to the media.
+ */
+void log_flush(void);
+
+/**
+ * log_stop - write all messages and end the log thread.
+ */
+void log_stop(void);
+
+/**
+ * log_set_callback - pass messages to a function, too.
+ * @func: called with every formatted message, %NULL to stop
+ * @user: passed to @func
+ *
+ * Only messages written synchronously, i.e. without log thread, are passed.
+ * Messages of forked children aren't.
+ */
+void log_set_callback(void (*func)(void *user, const char *msg), void *user);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LOGGER_H__ */
@@ -0,0 +1,112 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * In-process API of the flash tools. Each operation works on an already
+ * opened MTD device, so one device node, libmtd descriptor and device
+ * description can be shared by all steps of flashing a partition.
+ */
+
+#ifndef __MTD_DEV_H__
+#define __MTD_DEV_H__
+
+#include <libmtd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * struct mtd_dev_handle - an opened MTD device.
+ * @node: MTD device node file name
+ * @fd: MTD device node file descriptor (opened read-write)
+ * @libmtd: MTD library descriptor
+ * @mtd: MTD device description object
+ */
+struct mtd_dev_handle
+{
+	const char *node;
+	int fd;
+	libmtd_t libmtd;
+	struct mtd_dev_info mtd;
+};
+
+/**
+ * mtd_dev_open - open an MTD device.
+ * @dev: handle to initialize
+ * @node: MTD device node file name
+ *
+ * Returns %0 in case of success and %-1 in case of failure.
+ */
+int mtd_dev_open(struct mtd_dev_handle *dev, const char *node);
+
+/**
+ * mtd_dev_close - close an MTD device opened with mtd_dev_open().
+ * @dev: handle to close
+ */
+void mtd_dev_close(struct mtd_dev_handle *dev);
+
+/* nandwrite_dev() flags */
+#define NANDWRITE_PAD		0x01 /* pad writes to page size */
+#define NANDWRITE_MARKBAD	0x02 /* mark blocks bad if write fails */
+#define NANDWRITE_ERASE		0x04 /* erase each eraseblock before writing it */
+#define NANDWRITE_JFFS2		0x08 /* write JFFS2 cleanmarkers to erased blocks */
+#define NANDWRITE_JFFS2_SUMMARY	0x10 /* add JFFS2 erase block summary */
+#define NANDWRITE_QUIET		0x20 /* don't display progress messages */
+
+/**
+ * nandwrite_dev - write an image to a NAND device.
+ * @dev: MTD device
+ * @img: input image file name
+ * @flags: %NANDWRITE_* flags
+ *
+ * Returns %0 in case of success and %-1 in case of failure.
+ */
+int nandwrite_dev(struct mtd_dev_handle *dev, const char *img, int flags);
+
+/**
+ * ubiformat_dev - format an MTD device and flash a UBI image.
+ * @dev: MTD device
+ * @img: UBI image file name
+ * @erase_ahead: number of eraseblocks to erase ahead in a worker thread
+ * @quiet: don't display progress messages
+ *
+ * Returns %0 in case of success and %-1 in case of failure.
+ */
+int ubiformat_dev(struct mtd_dev_handle *dev, const char *img,
+		  int erase_ahead, int quiet);
+
+/* flashcp_dev() flags */
+#define FLASHCP_VERBOSE		0x01 /* show progress */
+#define FLASHCP_REBOOT		0x10 /* reboot after flashing */
+
+/**
+ * flashcp_dev - erase and write an image to a NOR device.
+ * @dev: MTD device
+ * @img: input image file name
+ * @flags: %FLASHCP_* flags
+ *
+ * Returns %0 in case of success and %-1 in case of failure.
+ */
+int flashcp_dev(struct mtd_dev_handle *dev, const char *img, int flags);
+
+/**
+ * ubidetach_dev - detach an MTD device from UBI.
+ * @dev: MTD device
+ *
+ * Returns %0 in case of success and %-1 in case of failure.
+ */
+int ubidetach_dev(struct mtd_dev_handle *dev);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __MTD_DEV_H__ */
@@ -0,0 +1,89 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * Per-step timing and throughput telemetry of a flash run.
+ */
+
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TELEMETRY_FILE "ofgwrite_telemetry.json"
+
+/**
+ * telemetry_step - start a new step.
+ * @name: step name as shown in the GUI
+ *
+ * Closes the previous step. Called by 'set_step()', so every step shown to
+ * the user is recorded.
+ */
+void telemetry_step(const char *name);
+
+/**
+ * telemetry_add_read - account bytes read from the image.
+ * @bytes: number of bytes
+ */
+void telemetry_add_read(long long bytes);
+
+/**
+ * telemetry_image_read - get the bytes read from the image so far.
+ *
+ * Includes the reads of forked decompressors.
+ */
+long long telemetry_image_read(void);
+
+/**
+ * telemetry_add_written - account bytes written without libmtd.
+ * @bytes: number of bytes
+ *
+ * Writes done by 'mtd_write()' are counted by libmtd already.
+ */
+void telemetry_add_written(long long bytes);
+
+/**
+ * telemetry_add_erase - account eraseblocks erased without libmtd.
+ * @cnt: number of eraseblocks
+ */
+void telemetry_add_erase(long long cnt);
+
+/**
+ * telemetry_add_error - account a failed operation.
+ */
+void telemetry_add_error(void);
+
+/**
+ * telemetry_device - record the state of a flashed MTD device.
+ * @device: device node
+ * @eb_cnt: count of eraseblocks
+ * @bad_cnt: count of bad eraseblocks
+ * @mean_ec: mean erase counter, %-1 if unknown
+ */
+void telemetry_device(const char *device, int eb_cnt, int bad_cnt,
+		      long long mean_ec);
+
+/**
+ * telemetry_write - write the telemetry of this run.
+ * @dir: directory to write %TELEMETRY_FILE to, normally the image directory
+ * @success: whether flashing was successful
+ *
+ * Also logs a one line summary to syslog. Returns %0 in case of success and
+ * %-1 if the file cannot be written.
+ */
+int telemetry_write(const char *dir, int success);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TELEMETRY_H__ */
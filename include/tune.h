@@ -0,0 +1,112 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * Buffer sizes and queue depths of the flash tools, chosen from a probe of
+ * the box.
+ */
+
+#ifndef __TUNE_H__
+#define __TUNE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * struct tune_params - probed box and chosen sizes.
+ * @cores: online CPUs
+ * @mem_total: RAM of the box in bytes
+ * @mem_avail: available RAM in bytes
+ * @low_ram: low RAM mode, small buffers and ofgwrite is locked in RAM
+ * @budget: bytes all stage buffers together may use
+ * @image_rate: read rate of the image source in bytes/s, %0 if not measured
+ * @target_rate: read rate of the target device in bytes/s, %0 if not measured
+ * @network: whether the image is on a network filesystem
+ * @image_buf: read size for the image
+ * @write_buf: write size for the target device
+ * @bunzip_buf: input buffer size of bunzip2
+ * @copy_buf: buffer size of 'bb_copyfd_eof()'
+ * @erase_ahead: eraseblocks ubiformat erases ahead of writing
+ */
+struct tune_params {
+	int cores;
+	long long mem_total;
+	long long mem_avail;
+	int low_ram;
+	int budget;
+	long long image_rate;
+	long long target_rate;
+	int network;
+	int image_buf;
+	int write_buf;
+	int bunzip_buf;
+	int copy_buf;
+	int erase_ahead;
+};
+
+/*
+ * stage buffers, all are slices of one arena: the image read buffer of
+ * nandwrite and the tar tee, the write buffer of flashcp, the buffer of
+ * 'bb_copyfd_eof()' and the write buffer of the ext4 kernel
+ */
+enum TuneBufferEnum {
+	TUNE_IMAGE_BUF,
+	TUNE_WRITE_BUF,
+	TUNE_COPY_BUF,
+	TUNE_KERNEL_BUF,
+	TUNE_BUF_CNT
+};
+
+/**
+ * tune_probe - probe the box and choose the sizes.
+ * @image: image file whose read rate is measured, may be %NULL
+ * @target: block device whose rate is measured, may be %NULL
+ * @low_ram: force the low RAM mode, otherwise used on boxes with up to
+ *	256 MB
+ *
+ * The target is only read, its first MB with O_DIRECT. Its read rate
+ * stands in for the write rate, nothing is written to measure it.
+ */
+void tune_probe(const char *image, const char *target, int low_ram);
+
+/**
+ * tune_buffer - get the buffer of a stage.
+ * @buf: stage
+ *
+ * The buffer has the size chosen for the stage, e.g. @image_buf for
+ * %TUNE_IMAGE_BUF, and must not be freed. It is valid until the next
+ * 'tune_probe()'. Every stage is used by one thread at a time. Concurrent
+ * flash jobs (kernel and rootfs on independent devices) use different
+ * stages: the ext4 kernel has its own, so it doesn't share flashcp's write
+ * buffer. Returns %NULL if out of memory.
+ */
+void *tune_buffer(enum TuneBufferEnum buf);
+
+/**
+ * tune_lock_memory - lock ofgwrite in RAM in low RAM mode.
+ *
+ * Called after pivot_root, the code must not be paged in again from the
+ * old rootfs while it is unmounted.
+ */
+void tune_lock_memory(void);
+
+/**
+ * tune_get - get the chosen sizes.
+ *
+ * Returns small default sizes if 'tune_probe()' wasn't called.
+ */
+const struct tune_params *tune_get(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TUNE_H__ */
@@ -0,0 +1,514 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * JFFS2 erase block summary generation while flashing.
+ *
+ * The node stream of the input image is repacked into eraseblocks the same
+ * way sumtool from mtd-utils does it: nodes are copied as long as they fit
+ * into the current eraseblock together with the summary node, which is
+ * placed at the end of the eraseblock. Padding nodes, old summary nodes and
+ * cleanmarkers of the input are dropped. On NOR flash a cleanmarker is
+ * written to the start of every eraseblock, on NAND flash cleanmarkers are
+ * written to OOB when the eraseblock is erased.
+ */
+
+#define PROGRAM_NAME "jffs2sum"
+
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <common.h>
+#include <crc32.h>
+#include <jffs2sum.h>
+#include <mtd/jffs2-user.h>
+
+#define PAD(x) (((x) + 3) & ~3)
+
+/* on-flash summary records, see fs/jffs2/summary.h */
+struct jffs2_sum_inode_flash
+{
+	jint16_t nodetype;
+	jint32_t inode;
+	jint32_t version;
+	jint32_t offset;
+	jint32_t totlen;
+} __attribute__((packed));
+
+struct jffs2_sum_dirent_flash
+{
+	jint16_t nodetype;
+	jint32_t totlen;
+	jint32_t offset;
+	jint32_t pino;
+	jint32_t version;
+	jint32_t ino;
+	uint8_t nsize;
+	uint8_t type;
+	uint8_t name[0];
+} __attribute__((packed));
+
+struct jffs2_sum_xattr_flash
+{
+	jint16_t nodetype;
+	jint32_t xid;
+	jint32_t version;
+	jint32_t offset;
+	jint32_t totlen;
+} __attribute__((packed));
+
+struct jffs2_sum_xref_flash
+{
+	jint16_t nodetype;
+	jint32_t offset;
+} __attribute__((packed));
+
+struct jffs2_sum_marker
+{
+	jint32_t offset;
+	jint32_t magic;
+};
+
+#define JFFS2_SUMMARY_FRAME_SIZE (sizeof(struct jffs2_raw_summary) + \
+				  sizeof(struct jffs2_sum_marker))
+
+/**
+ * struct jffs2_sum_stream - state of a summary stream.
+ * @fd: input file descriptor
+ * @eb_size: eraseblock size
+ * @cleanmarker: write inline cleanmarkers
+ * @found_cleanmarker: the input contains cleanmarkers
+ * @in: input window
+ * @in_len: number of valid bytes in @in
+ * @in_pos: current position in @in
+ * @in_eof: end of input was reached
+ * @consumed: number of input bytes processed
+ * @block: eraseblock being assembled
+ * @block_ofs: write position in @block
+ * @sum: summary records of @block
+ * @sum_size: size of the summary records
+ * @sum_num: number of summary records
+ * @out_len: number of bytes of a finished eraseblock in @block
+ * @out_pos: read position in the finished eraseblock
+ * @done: all eraseblocks are finished
+ */
+struct jffs2_sum_stream
+{
+	int fd;
+	int eb_size;
+	int cleanmarker;
+	int found_cleanmarker;
+	uint8_t *in;
+	int in_len;
+	int in_pos;
+	int in_eof;
+	long long consumed;
+	uint8_t *block;
+	int block_ofs;
+	uint8_t *sum;
+	int sum_size;
+	int sum_num;
+	int out_len;
+	int out_pos;
+	int done;
+};
+
+/* Make sure that at least @len bytes are available in the input window */
+static int fill_input(struct jffs2_sum_stream *s, int len)
+{
+	if (s->in_len - s->in_pos >= len)
+		return 1;
+
+	if (s->in_pos) {
+		memmove(s->in, s->in + s->in_pos, s->in_len - s->in_pos);
+		s->in_len -= s->in_pos;
+		s->in_pos = 0;
+	}
+
+	while (!s->in_eof && s->in_len < len) {
+		ssize_t ret = read(s->fd, s->in + s->in_len, 2 * s->eb_size - s->in_len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return sys_errmsg("cannot read image");
+		}
+		if (ret == 0)
+			s->in_eof = 1;
+		s->in_len += ret;
+	}
+
+	return s->in_len >= len;
+}
+
+static void skip_input(struct jffs2_sum_stream *s, int len)
+{
+	if (len > s->in_len - s->in_pos)
+		len = s->in_len - s->in_pos;
+	s->in_pos += len;
+	s->consumed += len;
+}
+
+/*
+ * Skip @len bytes of the input, reading as much of it as needed. Returns %1 on
+ * success, %0 if the input ended first and %-1 on error.
+ */
+static int discard_input(struct jffs2_sum_stream *s, unsigned long long len)
+{
+	for (;;) {
+		int avail = s->in_len - s->in_pos;
+		int ret;
+
+		if ((unsigned long long)avail >= len) {
+			skip_input(s, len);
+			return 1;
+		}
+		skip_input(s, avail);
+		len -= avail;
+
+		ret = fill_input(s, len < (unsigned long long)s->eb_size ? (int)len : s->eb_size);
+		if (ret < 0)
+			return -1;
+		if (s->in_len == s->in_pos)
+			return 0;
+	}
+}
+
+static void finish_block(struct jffs2_sum_stream *s)
+{
+	struct jffs2_raw_summary *isum;
+	struct jffs2_sum_marker *sm;
+	int datasize, infosize, padsize;
+
+	datasize = s->sum_size + sizeof(struct jffs2_sum_marker);
+	infosize = sizeof(struct jffs2_raw_summary) + datasize;
+	padsize = s->eb_size - s->block_ofs - infosize;
+	infosize += padsize;
+	datasize += padsize;
+
+	isum = (struct jffs2_raw_summary *)(s->block + s->block_ofs);
+	isum->magic = cpu_to_je16(JFFS2_MAGIC_BITMASK);
+	isum->nodetype = cpu_to_je16(JFFS2_NODETYPE_SUMMARY);
+	isum->totlen = cpu_to_je32(infosize);
+	isum->hdr_crc = cpu_to_je32(mtd_crc32(0, isum, sizeof(struct jffs2_unknown_node) - 4));
+	isum->sum_num = cpu_to_je32(s->sum_num);
+	if (s->cleanmarker && s->found_cleanmarker)
+		isum->cln_mkr = cpu_to_je32(sizeof(struct jffs2_unknown_node));
+	else
+		isum->cln_mkr = cpu_to_je32(0);
+	isum->padded = cpu_to_je32(0);
+
+	memcpy(isum->sum, s->sum, s->sum_size);
+	sm = (struct jffs2_sum_marker *)(s->block + s->eb_size - sizeof(struct jffs2_sum_marker));
+	sm->offset = cpu_to_je32(s->block_ofs);
+	sm->magic = cpu_to_je32(JFFS2_SUM_MAGIC);
+
+	isum->sum_crc = cpu_to_je32(mtd_crc32(0, isum->sum, datasize));
+	isum->node_crc = cpu_to_je32(mtd_crc32(0, isum, sizeof(struct jffs2_raw_summary) - 8));
+
+	s->out_len = s->eb_size;
+	s->out_pos = 0;
+	s->block_ofs = 0;
+	s->sum_size = 0;
+	s->sum_num = 0;
+}
+
+static int record_size(union jffs2_node_union *node)
+{
+	switch (je16_to_cpu(node->u.nodetype)) {
+	case JFFS2_NODETYPE_INODE:
+		return sizeof(struct jffs2_sum_inode_flash);
+	case JFFS2_NODETYPE_DIRENT:
+		return sizeof(struct jffs2_sum_dirent_flash) + node->d.nsize;
+	case JFFS2_NODETYPE_XATTR:
+		return sizeof(struct jffs2_sum_xattr_flash);
+	default:
+		return sizeof(struct jffs2_sum_xref_flash);
+	}
+}
+
+static void add_record(struct jffs2_sum_stream *s, union jffs2_node_union *node)
+{
+	uint8_t *rec = s->sum + s->sum_size;
+	jint32_t offset = cpu_to_je32(s->block_ofs);
+
+	switch (je16_to_cpu(node->u.nodetype)) {
+	case JFFS2_NODETYPE_INODE: {
+		struct jffs2_sum_inode_flash *i = (void *)rec;
+		i->nodetype = node->i.nodetype;
+		i->inode = node->i.ino;
+		i->version = node->i.version;
+		i->offset = offset;
+		i->totlen = node->i.totlen;
+		break;
+	}
+	case JFFS2_NODETYPE_DIRENT: {
+		struct jffs2_sum_dirent_flash *d = (void *)rec;
+		d->nodetype = node->d.nodetype;
+		d->totlen = node->d.totlen;
+		d->offset = offset;
+		d->pino = node->d.pino;
+		d->version = node->d.version;
+		d->ino = node->d.ino;
+		d->nsize = node->d.nsize;
+		d->type = node->d.type;
+		memcpy(d->name, node->d.name, node->d.nsize);
+		break;
+	}
+	case JFFS2_NODETYPE_XATTR: {
+		struct jffs2_sum_xattr_flash *x = (void *)rec;
+		x->nodetype = node->x.nodetype;
+		x->xid = node->x.xid;
+		x->version = node->x.version;
+		x->offset = offset;
+		x->totlen = node->x.totlen;
+		break;
+	}
+	default: {
+		struct jffs2_sum_xref_flash *r = (void *)rec;
+		r->nodetype = node->r.nodetype;
+		r->offset = offset;
+		break;
+	}
+	}
+
+	s->sum_size += record_size(node);
+	s->sum_num += 1;
+}
+
+/*
+ * Copy the next node(s) of the input to the current eraseblock until it is
+ * full. Returns %1 if an eraseblock was finished, %0 at the end of the input
+ * and %-1 on error.
+ */
+static int fill_block(struct jffs2_sum_stream *s)
+{
+	for (;;) {
+		union jffs2_node_union *node;
+		uint32_t totlen;
+		uint16_t magic, nodetype;
+		int ret;
+
+		ret = fill_input(s, sizeof(struct jffs2_unknown_node));
+		if (ret < 0)
+			return -1;
+		if (ret == 0) {
+			skip_input(s, s->in_len - s->in_pos);
+			if (s->block_ofs == 0)
+				return 0;
+			finish_block(s);
+			return 1;
+		}
+
+		node = (union jffs2_node_union *)(s->in + s->in_pos);
+		magic = je16_to_cpu(node->u.magic);
+		if (magic != JFFS2_MAGIC_BITMASK) {
+			if (magic == bswap_16(JFFS2_MAGIC_BITMASK))
+				return errmsg("image has wrong endianness at 0x%llx", s->consumed);
+			/* erased or dirty space */
+			skip_input(s, 4);
+			continue;
+		}
+
+		if (je32_to_cpu(node->u.hdr_crc) != mtd_crc32(0, node, sizeof(struct jffs2_unknown_node) - 4))
+			return errmsg("bad node header CRC at 0x%llx", s->consumed);
+
+		totlen = je32_to_cpu(node->u.totlen);
+		if (totlen < sizeof(struct jffs2_unknown_node))
+			return errmsg("bad node length %u at 0x%llx", totlen, s->consumed);
+
+		/*
+		 * Padding, cleanmarkers and old summaries are not copied, so they
+		 * may be bigger than our eraseblock (e.g. an image made for a
+		 * larger eraseblock size). Skip them without buffering.
+		 */
+		nodetype = je16_to_cpu(node->u.nodetype);
+		if (nodetype == JFFS2_NODETYPE_PADDING || nodetype == JFFS2_NODETYPE_CLEANMARKER
+				|| nodetype == JFFS2_NODETYPE_SUMMARY) {
+			if (nodetype == JFFS2_NODETYPE_CLEANMARKER)
+				s->found_cleanmarker = 1;
+			ret = discard_input(s, ((unsigned long long)totlen + 3) & ~3ULL);
+			if (ret < 0)
+				return -1;
+			continue;
+		}
+
+		if (totlen > (uint32_t)s->eb_size)
+			return errmsg("bad node length %u at 0x%llx", totlen, s->consumed);
+
+		ret = fill_input(s, totlen);
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			return errmsg("image ends inside of node at 0x%llx", s->consumed);
+		node = (union jffs2_node_union *)(s->in + s->in_pos);
+
+		switch (nodetype) {
+		case JFFS2_NODETYPE_INODE:
+		case JFFS2_NODETYPE_DIRENT:
+		case JFFS2_NODETYPE_XATTR:
+		case JFFS2_NODETYPE_XREF:
+			if (s->block_ofs == 0 && s->cleanmarker && s->found_cleanmarker) {
+				struct jffs2_unknown_node *clm = (void *)s->block;
+				clm->magic = cpu_to_je16(JFFS2_MAGIC_BITMASK);
+				clm->nodetype = cpu_to_je16(JFFS2_NODETYPE_CLEANMARKER);
+				clm->totlen = cpu_to_je32(sizeof(struct jffs2_unknown_node));
+				clm->hdr_crc = cpu_to_je32(mtd_crc32(0, clm, sizeof(struct jffs2_unknown_node) - 4));
+				s->block_ofs = PAD(sizeof(struct jffs2_unknown_node));
+			}
+			/* start a new eraseblock if the node and its summary don't fit anymore */
+			if (s->block_ofs + PAD(totlen) + s->sum_size + record_size(node)
+					+ JFFS2_SUMMARY_FRAME_SIZE > (uint32_t)s->eb_size) {
+				if (s->sum_num == 0)
+					return errmsg("node at 0x%llx too big for eraseblock", s->consumed);
+				finish_block(s);
+				return 1;
+			}
+			add_record(s, node);
+			memcpy(s->block + s->block_ofs, node, totlen);
+			s->block_ofs += PAD(totlen);
+			break;
+		default:
+			if ((nodetype & JFFS2_COMPAT_MASK) == JFFS2_FEATURE_INCOMPAT)
+				return errmsg("unknown incompatible node type 0x%04x at 0x%llx",
+					      nodetype, s->consumed);
+			warnmsg("dropping unknown node type 0x%04x at 0x%llx", nodetype, s->consumed);
+			break;
+		}
+		skip_input(s, PAD(totlen));
+	}
+}
+
+struct jffs2_sum_stream *jffs2_sum_open(int fd, int eb_size, int cleanmarker)
+{
+	struct jffs2_sum_stream *s;
+
+	if (eb_size <= 0 || eb_size % 4) {
+		errmsg("invalid eraseblock size %d", eb_size);
+		return NULL;
+	}
+
+	s = calloc(1, sizeof(struct jffs2_sum_stream));
+	if (!s) {
+		sys_errmsg("cannot allocate %zd bytes of memory", sizeof(struct jffs2_sum_stream));
+		return NULL;
+	}
+
+	s->fd = fd;
+	s->eb_size = eb_size;
+	s->cleanmarker = cleanmarker;
+	s->in = malloc(2 * eb_size);
+	s->block = malloc(eb_size);
+	s->sum = malloc(eb_size);
+	if (!s->in || !s->block || !s->sum) {
+		sys_errmsg("cannot allocate %d bytes of memory", 4 * eb_size);
+		jffs2_sum_close(s);
+		return NULL;
+	}
+	memset(s->block, 0xFF, eb_size);
+
+	return s;
+}
+
+ssize_t jffs2_sum_read(struct jffs2_sum_stream *s, void *buf, size_t len)
+{
+	size_t cnt = 0;
+
+	while (cnt < len) {
+		int avail;
+
+		if (s->out_pos == s->out_len) {
+			int ret;
+
+			if (s->done)
+				break;
+			if (s->out_len) {
+				memset(s->block, 0xFF, s->eb_size);
+				s->out_len = s->out_pos = 0;
+			}
+			ret = fill_block(s);
+			if (ret < 0)
+				return -1;
+			if (ret == 0) {
+				s->done = 1;
+				break;
+			}
+		}
+
+		avail = s->out_len - s->out_pos;
+		if ((size_t)avail > len - cnt)
+			avail = len - cnt;
+		memcpy((uint8_t *)buf + cnt, s->block + s->out_pos, avail);
+		s->out_pos += avail;
+		cnt += avail;
+	}
+
+	return cnt;
+}
+
+long long jffs2_sum_consumed(const struct jffs2_sum_stream *s)
+{
+	return s->consumed;
+}
+
+void jffs2_sum_close(struct jffs2_sum_stream *s)
+{
+	free(s->in);
+	free(s->block);
+	free(s->sum);
+	free(s);
+}
+
+int jffs2_sum_convert(const char *src, const char *dst, int eb_size,
+		      int cleanmarker)
+{
+	struct jffs2_sum_stream *s;
+	int ifd, ofd, ret = -1;
+	char *buf;
+
+	ifd = open(src, O_RDONLY);
+	if (ifd == -1)
+		return sys_errmsg("cannot open \"%s\"", src);
+
+	ofd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (ofd == -1) {
+		sys_errmsg("cannot create \"%s\"", dst);
+		close(ifd);
+		return -1;
+	}
+
+	s = jffs2_sum_open(ifd, eb_size, cleanmarker);
+	buf = malloc(eb_size);
+	if (!s || !buf)
+		goto out;
+
+	for (;;) {
+		ssize_t len = jffs2_sum_read(s, buf, eb_size);
+		if (len < 0)
+			goto out;
+		if (len == 0)
+			break;
+		if (write(ofd, buf, len) != len) {
+			sys_errmsg("cannot write \"%s\"", dst);
+			goto out;
+		}
+	}
+	ret = 0;
+
+out:
+	free(buf);
+	if (s)
+		jffs2_sum_close(s);
+	close(ofd);
+	close(ifd);
+	if (ret)
+		unlink(dst);
+	return ret;
+}
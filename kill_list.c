@@ -0,0 +1,326 @@
+#include "ofgwrite.h"
+
+#include "libbb.h"
+
+#include <regex.h>
+#include <poll.h>
+#include <sys/syscall.h>
+
+// Stops the services which prevent remounting the rootfs read-only.
+// All patterns are matched in a single walk over /proc, the matching
+// processes are signalled in one batch and then waited for.
+//
+// The list is read from KILL_LIST_FILE if present, one entry per line:
+//   exec <command>             run command, e.g. an init script
+//   comm <signal> <name>       process name, like killall
+//   cmd  <signal> <regex>      extended regex on the command line, like pkill -f
+//   icmd <signal> <regex>      same as cmd, but case insensitive
+// Empty lines and lines starting with '#' are ignored.
+//
+// find_process() and wait_process_exit() are used to wait for single
+// processes like enigma2 without rescanning /proc, kill_pids_and_wait()
+// for the processes found by fuser.
+
+#define KILL_LIST_FILE    "/etc/ofgwrite/kill_list"
+#define KILL_LIST_TIMEOUT 5000 // ms to wait for the processes to exit
+
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+static const char *const default_kill_list[] = {
+	"comm TERM nmbd",
+	"comm TERM smbd",
+	"comm TERM rpc.mountd",
+	"comm TERM rpc.statd",
+	"exec /etc/init.d/softcam stop",
+	"comm TERM CCcam",
+	"icmd KILL oscam",
+	"icmd KILL wicardd",
+	"comm TERM kodi.bin",
+	"comm TERM hddtemp",
+	"comm TERM transmission-daemon",
+	"comm TERM openvpn",
+	"exec /etc/init.d/sabnzbd stop",
+	"cmd KILL cihelper",
+	"cmd KILL ciplus_helper",
+	"cmd KILL ciplushelper",
+	// VMC
+	"cmd TERM vmc.sh",
+	"cmd TERM DBServer.py",
+	"exec /etc/init.d/autofs stop",
+	NULL
+};
+
+enum { MATCH_COMM, MATCH_CMD };
+
+struct kill_rule {
+	int type;
+	int sig;
+	char *name;
+	regex_t re;
+};
+
+struct kill_target {
+	pid_t pid;
+	int fd;
+	int sig;
+};
+
+static int parse_rule(char *line, struct kill_rule *rule)
+{
+	char *type, *sig, *pattern;
+	int cflags = REG_EXTENDED | REG_NOSUB;
+
+	type = strtok(line, " \t");
+	sig = strtok(NULL, " \t");
+	pattern = strtok(NULL, "\n");
+	if (!type || !sig || !pattern)
+		return -1;
+	pattern = skip_whitespace(pattern);
+
+	rule->sig = get_signum(sig);
+	if (rule->sig < 0)
+		return -1;
+
+	if (!strcmp(type, "comm")) {
+		rule->type = MATCH_COMM;
+		rule->name = strdup(pattern);
+		return 0;
+	}
+
+	if (!strcmp(type, "icmd"))
+		cflags |= REG_ICASE;
+	else if (strcmp(type, "cmd"))
+		return -1;
+	rule->type = MATCH_CMD;
+	rule->name = NULL;
+	return regcomp(&rule->re, pattern, cflags) ? -1 : 0;
+}
+
+// run exec entries immediately and collect the match rules
+static int add_line(const char *text, struct kill_rule **rules, int *cnt)
+{
+	char line[512];
+	char *p;
+
+	safe_strncpy(line, text, sizeof(line));
+	p = skip_whitespace(line);
+	p[strcspn(p, "\r\n")] = '\0';
+	if (*p == '\0' || *p == '#')
+		return 0;
+
+	if (!strncmp(p, "exec", 4) && isspace(p[4])) {
+		p = skip_whitespace(p + 4);
+		my_printf("Execute: %s\n", p);
+		system(p); // ignore return value, the service might not run
+		return 0;
+	}
+
+	*rules = realloc(*rules, (*cnt + 1) * sizeof(**rules));
+	if (parse_rule(p, &(*rules)[*cnt])) {
+		my_printf("Error: invalid kill list entry \"%s\"\n", text);
+		return -1;
+	}
+	(*cnt)++;
+	return 0;
+}
+
+static int rule_matches(const struct kill_rule *rule, const char *comm,
+		const char *argv0, const char *cmdline)
+{
+	if (rule->type == MATCH_COMM) {
+		// comm is truncated to 15 chars, argv0 catches longer names
+		if (!strcmp(comm, rule->name) || !strcmp(bb_basename(argv0), rule->name))
+			return 1;
+		return strlen(rule->name) >= COMM_LEN - 1
+			&& !strncmp(comm, rule->name, COMM_LEN - 1);
+	}
+	return cmdline[0] != '\0' && regexec(&rule->re, cmdline, 0, NULL, 0) == 0;
+}
+
+static int wait_for_targets(struct kill_target *targets, int cnt, int timeout)
+{
+	struct pollfd *fds = xzalloc(cnt * sizeof(*fds));
+	int remaining, i, waited = 0;
+
+	for (;;) {
+		remaining = 0;
+		for (i = 0; i < cnt; i++) {
+			if (targets[i].pid == 0)
+				continue;
+			// pidfds become readable when the process exits, without
+			// pidfd support the process is polled with signal 0
+			if (targets[i].fd < 0 ? kill(targets[i].pid, 0) < 0
+					: (fds[i].revents & POLLIN)) {
+				targets[i].pid = 0;
+				continue;
+			}
+			fds[i].fd = targets[i].fd;
+			fds[i].events = POLLIN;
+			remaining++;
+		}
+		if (!remaining || waited >= timeout)
+			break;
+
+		for (i = 0; i < cnt; i++) {
+			if (targets[i].pid == 0 || targets[i].fd < 0)
+				fds[i].fd = -1;
+			fds[i].revents = 0;
+		}
+		poll(fds, cnt, 50);
+		waited += 50;
+	}
+
+	free(fds);
+	return remaining;
+}
+
+static void signal_targets(struct kill_target *targets, int cnt)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		struct kill_target *t = &targets[i];
+		int ret;
+
+		if (t->fd >= 0)
+			ret = syscall(SYS_pidfd_send_signal, t->fd, t->sig, NULL, 0);
+		else
+			ret = kill(t->pid, t->sig);
+		if (ret)
+			t->pid = 0; // already gone
+	}
+}
+
+int kill_processes(void)
+{
+	struct kill_rule *rules = NULL;
+	struct kill_target *targets = NULL;
+	procps_status_t *p = NULL;
+	int rules_cnt = 0, targets_cnt = 0;
+	int i, remaining;
+	pid_t self = getpid();
+	FILE *f;
+
+	f = fopen(KILL_LIST_FILE, "r");
+	if (f) {
+		char line[512];
+
+		my_printf("Using kill list %s\n", KILL_LIST_FILE);
+		while (fgets(line, sizeof(line), f))
+			add_line(line, &rules, &rules_cnt);
+		fclose(f);
+	} else {
+		for (i = 0; default_kill_list[i]; i++)
+			add_line(default_kill_list[i], &rules, &rules_cnt);
+	}
+
+	while ((p = procps_scan(p, PSSCAN_PID | PSSCAN_COMM)) != NULL) {
+		char cmdline[1024];
+		char argv0[256];
+		ssize_t len;
+		int sig = 0;
+
+		if (p->pid == self)
+			continue;
+
+		sprintf(cmdline, "/proc/%u/cmdline", p->pid);
+		len = open_read_close(cmdline, cmdline, sizeof(cmdline) - 1);
+		if (len < 0)
+			len = 0;
+		cmdline[len] = '\0';
+		safe_strncpy(argv0, cmdline, sizeof(argv0));
+		while (--len >= 0)
+			if (cmdline[len] == '\0')
+				cmdline[len] = ' ';
+
+		// the first matching rule decides the signal
+		for (i = 0; i < rules_cnt && !sig; i++)
+			if (rule_matches(&rules[i], p->comm, argv0, cmdline))
+				sig = rules[i].sig;
+		if (!sig)
+			continue;
+
+		targets = realloc(targets, (targets_cnt + 1) * sizeof(*targets));
+		targets[targets_cnt].pid = p->pid;
+		targets[targets_cnt].sig = sig;
+		// open the pidfd before signalling, so the pid cannot be reused
+		targets[targets_cnt].fd = syscall(SYS_pidfd_open, p->pid, 0);
+		targets_cnt++;
+	}
+
+	signal_targets(targets, targets_cnt);
+	remaining = wait_for_targets(targets, targets_cnt, KILL_LIST_TIMEOUT);
+	if (remaining)
+		my_printf("%d of %d processes still running\n", remaining, targets_cnt);
+	else if (targets_cnt)
+		my_printf("%d processes stopped\n", targets_cnt);
+
+	for (i = 0; i < targets_cnt; i++)
+		if (targets[i].fd >= 0)
+			close(targets[i].fd);
+	for (i = 0; i < rules_cnt; i++) {
+		if (rules[i].type == MATCH_COMM)
+			free(rules[i].name);
+		else
+			regfree(&rules[i].re);
+	}
+	free(targets);
+	free(rules);
+
+	return remaining == 0;
+}
+
+pid_t find_process(const char *comm)
+{
+	procps_status_t *p = NULL;
+	pid_t pid = 0;
+
+	while ((p = procps_scan(p, PSSCAN_PID | PSSCAN_COMM)) != NULL) {
+		if (strcmp(p->comm, comm) == 0) {
+			pid = p->pid;
+			free_procps_scan(p);
+			break;
+		}
+	}
+	return pid;
+}
+
+int wait_process_exit(pid_t pid, int timeout)
+{
+	struct kill_target t;
+	int remaining;
+
+	t.pid = pid;
+	t.fd = syscall(SYS_pidfd_open, pid, 0);
+	if (t.fd < 0 && errno == ESRCH)
+		return 1;
+	remaining = wait_for_targets(&t, 1, timeout);
+	if (t.fd >= 0)
+		close(t.fd);
+	return remaining == 0;
+}
+
+int kill_pids_and_wait(const pid_t *pids, int cnt, int sig, int timeout)
+{
+	struct kill_target *targets = xzalloc((cnt + 1) * sizeof(*targets));
+	int i, remaining;
+
+	for (i = 0; i < cnt; i++) {
+		targets[i].pid = pids[i];
+		targets[i].sig = sig;
+		targets[i].fd = syscall(SYS_pidfd_open, pids[i], 0);
+	}
+	signal_targets(targets, cnt);
+	remaining = wait_for_targets(targets, cnt, timeout);
+
+	for (i = 0; i < cnt; i++)
+		if (targets[i].fd >= 0)
+			close(targets[i].fd);
+	free(targets);
+	return remaining;
+}
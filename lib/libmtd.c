@@ -423,6 +423,39 @@ static int type_str2int(const char *str)
 	return -1;
 }
 
+/*
+ * Device information is static while ofgwrite runs (partitions are not
+ * added or resized behind our back), so every MTD device is only looked up
+ * in sysfs once. Callers which change the partition layout must call
+ * 'mtd_cache_invalidate()'.
+ */
+#define MTD_CACHE_MAX 64
+
+static struct mtd_dev_info dev_info_cache[MTD_CACHE_MAX];
+static char dev_info_cached[MTD_CACHE_MAX];
+
+static int dev_info_cache_lookup(int mjr, int mnr)
+{
+	int i;
+
+	for (i = 0; i < MTD_CACHE_MAX; i++)
+		if (dev_info_cached[i] && dev_info_cache[i].major == mjr &&
+		    dev_info_cache[i].minor == mnr)
+			return i;
+	return -1;
+}
+
+void mtd_cache_invalidate(int mtd_num)
+{
+	if (mtd_num >= 0 && mtd_num < MTD_CACHE_MAX) {
+		dev_info_cached[mtd_num] = 0;
+		return;
+	}
+
+	memset(dev_info_cached, 0, sizeof(dev_info_cached));
+	legacy_proc_table_invalidate();
+}
+
 /**
  * dev_node2num - find UBI device number by its character device node.
  * @lib: MTD library descriptor
@@ -449,6 +482,12 @@ static int dev_node2num(struct libmtd *lib, const char *node, int *mtd_num)
 	mjr = major(st.st_rdev);
 	mnr = minor(st.st_rdev);
 
+	i = dev_info_cache_lookup(mjr, mnr);
+	if (i >= 0) {
+		*mtd_num = i;
+		return 0;
+	}
+
 	if (mtd_get_info((libmtd_t *)lib, &info))
 		return -1;
 
@@ -732,7 +771,7 @@ out_close:
 	return -1;
 }
 
-int mtd_get_dev_info1(libmtd_t desc, int mtd_num, struct mtd_dev_info *mtd)
+static int dev_info_read(libmtd_t desc, int mtd_num, struct mtd_dev_info *mtd)
 {
 	int ret;
 	struct libmtd *lib = (struct libmtd *)desc;
@@ -785,6 +824,25 @@ int mtd_get_dev_info1(libmtd_t desc, int mtd_num, struct mtd_dev_info *mtd)
 	return 0;
 }
 
+int mtd_get_dev_info1(libmtd_t desc, int mtd_num, struct mtd_dev_info *mtd)
+{
+	int cacheable = mtd_num >= 0 && mtd_num < MTD_CACHE_MAX;
+
+	if (cacheable && dev_info_cached[mtd_num]) {
+		memcpy(mtd, &dev_info_cache[mtd_num], sizeof(*mtd));
+		return 0;
+	}
+
+	if (dev_info_read(desc, mtd_num, mtd))
+		return -1;
+
+	if (cacheable) {
+		memcpy(&dev_info_cache[mtd_num], mtd, sizeof(*mtd));
+		dev_info_cached[mtd_num] = 1;
+	}
+	return 0;
+}
+
 int mtd_get_dev_info(libmtd_t desc, const char *node, struct mtd_dev_info *mtd)
 {
 	int mtd_num;
@@ -848,7 +906,23 @@ int mtd_unlock(const struct mtd_dev_info *mtd, int fd, int eb)
 	return mtd_xlock(mtd, fd, eb, MEMUNLOCK);
 }
 
-int mtd_erase(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb)
+static struct mtd_op_stats op_stats;
+
+/* The erase-ahead thread of ubiformat erases while the main thread writes */
+#define op_stats_add(field, val) __sync_fetch_and_add(&op_stats.field, (val))
+
+void mtd_get_op_stats(struct mtd_op_stats *stats)
+{
+	stats->erase_cnt = op_stats_add(erase_cnt, 0);
+	stats->read_cnt = op_stats_add(read_cnt, 0);
+	stats->write_cnt = op_stats_add(write_cnt, 0);
+	stats->bytes_read = op_stats_add(bytes_read, 0);
+	stats->bytes_written = op_stats_add(bytes_written, 0);
+	stats->errors = op_stats_add(errors, 0);
+}
+
+static int do_mtd_erase(libmtd_t desc, const struct mtd_dev_info *mtd, int fd,
+			int eb)
 {
 	int ret;
 	struct libmtd *lib = (struct libmtd *)desc;
@@ -895,6 +969,17 @@ int mtd_erase(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb)
 	return 0;
 }
 
+int mtd_erase(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb)
+{
+	int ret = do_mtd_erase(desc, mtd, fd, eb);
+
+	if (ret)
+		op_stats_add(errors, 1);
+	else
+		op_stats_add(erase_cnt, 1);
+	return ret;
+}
+
 int mtd_regioninfo(int fd, int regidx, struct region_info_user *reginfo)
 {
 	int ret;
@@ -1049,8 +1134,8 @@ int mtd_mark_bad(const struct mtd_dev_info *mtd, int fd, int eb)
 	return 0;
 }
 
-int mtd_read(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
-	     void *buf, int len)
+static int do_mtd_read(const struct mtd_dev_info *mtd, int fd, int eb,
+		       int offs, void *buf, int len)
 {
 	int ret, rd = 0;
 	off_t seek;
@@ -1083,6 +1168,20 @@ int mtd_read(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
 	return 0;
 }
 
+int mtd_read(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+	     void *buf, int len)
+{
+	int ret = do_mtd_read(mtd, fd, eb, offs, buf, len);
+
+	if (ret) {
+		op_stats_add(errors, 1);
+	} else {
+		op_stats_add(read_cnt, 1);
+		op_stats_add(bytes_read, len);
+	}
+	return ret;
+}
+
 static int legacy_auto_oob_layout(const struct mtd_dev_info *mtd, int fd,
 				  int ooblen, void *oob) {
 	struct nand_oobinfo old_oobinfo;
@@ -1119,9 +1218,9 @@ static int legacy_auto_oob_layout(const struct mtd_dev_info *mtd, int fd,
 	return 0;
 }
 
-int mtd_write(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb,
-	      int offs, void *data, int len, void *oob, int ooblen,
-	      uint8_t mode)
+static int do_mtd_write(libmtd_t desc, const struct mtd_dev_info *mtd, int fd,
+			int eb, int offs, void *data, int len, void *oob,
+			int ooblen, uint8_t mode)
 {
 	int ret;
 	off_t seek;
@@ -1189,6 +1288,22 @@ int mtd_write(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb,
 	return 0;
 }
 
+int mtd_write(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb,
+	      int offs, void *data, int len, void *oob, int ooblen,
+	      uint8_t mode)
+{
+	int ret = do_mtd_write(desc, mtd, fd, eb, offs, data, len, oob, ooblen,
+			       mode);
+
+	if (ret) {
+		op_stats_add(errors, 1);
+	} else {
+		op_stats_add(write_cnt, 1);
+		op_stats_add(bytes_written, len);
+	}
+	return ret;
+}
+
 int do_oob_op(libmtd_t desc, const struct mtd_dev_info *mtd, int fd,
 	      uint64_t start, uint64_t length, void *data, unsigned int cmd64,
 	      unsigned int cmd)
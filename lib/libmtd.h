@@ -345,6 +345,69 @@ int mtd_write_img(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
  */
 int mtd_probe_node(libmtd_t desc, const char *node);
 
+/**
+ * struct mtd_proc_entry - an entry of /proc/mtd.
+ * @mtd_num: MTD device number
+ * @size: device size
+ * @eb_size: eraseblock size
+ * @name: device name (without the quotes)
+ */
+struct mtd_proc_entry
+{
+	int mtd_num;
+	long long size;
+	int eb_size;
+	char name[MTD_NAME_MAX + 1];
+};
+
+/**
+ * mtd_get_proc_table - get the parsed contents of /proc/mtd.
+ * @file: file to parse, %NULL for /proc/mtd
+ * @table: the entries are returned here
+ *
+ * The file is read only once and then cached until 'mtd_cache_invalidate()'
+ * is called. Returns the number of entries in case of success and %-1 in case
+ * of failure. The returned table must not be freed by the caller.
+ */
+int mtd_get_proc_table(const char *file, const struct mtd_proc_entry **table);
+
+/**
+ * mtd_cache_invalidate - drop cached MTD device information.
+ * @mtd_num: MTD device number, or %-1 to drop everything including the
+ *           /proc/mtd table
+ *
+ * 'mtd_get_dev_info()' and 'mtd_get_dev_info1()' read the information of an
+ * MTD device from sysfs only once per process. This function has to be called
+ * when the MTD devices may have changed, e.g. after re-partitioning.
+ */
+void mtd_cache_invalidate(int mtd_num);
+
+/**
+ * struct mtd_op_stats - counters of the MTD operations done by libmtd.
+ * @erase_cnt: count of erased eraseblocks
+ * @read_cnt: count of successful 'mtd_read()' calls
+ * @write_cnt: count of successful 'mtd_write()' calls
+ * @bytes_read: bytes read by 'mtd_read()'
+ * @bytes_written: bytes written by 'mtd_write()'
+ * @errors: count of failed erase, read and write operations
+ */
+struct mtd_op_stats {
+	long long erase_cnt;
+	long long read_cnt;
+	long long write_cnt;
+	long long bytes_read;
+	long long bytes_written;
+	long long errors;
+};
+
+/**
+ * mtd_get_op_stats - get the MTD operation counters.
+ * @stats: the counters are returned here
+ *
+ * The counters are summed up over all MTD devices since the program start.
+ */
+void mtd_get_op_stats(struct mtd_op_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
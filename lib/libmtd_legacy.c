@@ -70,25 +70,30 @@ struct proc_parse_info
 	char *next;
 };
 
-static int proc_parse_start(struct proc_parse_info *pi)
+static int proc_parse_start_file(struct proc_parse_info *pi, const char *file)
 {
-	int fd, ret;
+	int fd, ret, len = 0;
 
-	fd = open(MTD_PROC_FILE, O_RDONLY);
+	fd = open(file, O_RDONLY);
 	if (fd == -1)
 		return -1;
 
 	pi->buf = xmalloc(PROC_MTD_MAX_LEN);
 
-	ret = read(fd, pi->buf, PROC_MTD_MAX_LEN);
-	if (ret == -1) {
-		sys_errmsg("cannot read \"%s\"", MTD_PROC_FILE);
-		goto out_free;
-	}
+	/* /proc files may return less than requested, read until EOF */
+	do {
+		ret = read(fd, pi->buf + len, PROC_MTD_MAX_LEN - len);
+		if (ret == -1) {
+			sys_errmsg("cannot read \"%s\"", file);
+			goto out_free;
+		}
+		len += ret;
+	} while (ret > 0 && len < PROC_MTD_MAX_LEN);
+	ret = len;
 
 	if (ret < PROC_MTD_FIRST_LEN ||
 	    memcmp(pi->buf, PROC_MTD_FIRST, PROC_MTD_FIRST_LEN)) {
-		errmsg("\"%s\" does not start with \"%s\"", MTD_PROC_FILE,
+		errmsg("\"%s\" does not start with \"%s\"", file,
 		       PROC_MTD_FIRST);
 		goto out_free;
 	}
@@ -105,6 +110,11 @@ out_free:
 	return -1;
 }
 
+static int proc_parse_start(struct proc_parse_info *pi)
+{
+	return proc_parse_start_file(pi, MTD_PROC_FILE);
+}
+
 static int proc_parse_next(struct proc_parse_info *pi)
 {
 	int ret, len, pos = pi->next - pi->buf;
@@ -148,6 +158,60 @@ static int proc_parse_next(struct proc_parse_info *pi)
 	return 1;
 }
 
+/* Cached contents of /proc/mtd, see 'mtd_get_proc_table()' */
+static struct mtd_proc_entry *proc_table;
+static int proc_table_cnt;
+static char *proc_table_file;
+
+int mtd_get_proc_table(const char *file, const struct mtd_proc_entry **table)
+{
+	struct proc_parse_info pi;
+	int ret, cnt = 0;
+
+	if (!file)
+		file = MTD_PROC_FILE;
+
+	if (proc_table_file && !strcmp(proc_table_file, file)) {
+		*table = proc_table;
+		return proc_table_cnt;
+	}
+	legacy_proc_table_invalidate();
+
+	if (proc_parse_start_file(&pi, file))
+		return -1;
+
+	while ((ret = proc_parse_next(&pi)) == 1) {
+		struct mtd_proc_entry *e;
+
+		proc_table = xrealloc(proc_table, (cnt + 1) * sizeof(*proc_table));
+		e = &proc_table[cnt++];
+		e->mtd_num = pi.mtd_num;
+		e->size = pi.size;
+		e->eb_size = pi.eb_size;
+		strcpy(e->name, pi.name);
+	}
+	if (ret < 0) {
+		free(pi.buf);
+		free(proc_table);
+		proc_table = NULL;
+		return -1;
+	}
+
+	proc_table_cnt = cnt;
+	proc_table_file = xstrdup(file);
+	*table = proc_table;
+	return cnt;
+}
+
+void legacy_proc_table_invalidate(void)
+{
+	free(proc_table);
+	free(proc_table_file);
+	proc_table = NULL;
+	proc_table_file = NULL;
+	proc_table_cnt = 0;
+}
+
 /**
  * legacy_libmtd_open - legacy version of 'libmtd_open()'.
  *
@@ -0,0 +1,408 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <sys/mount.h>
+#include <telemetry.h>
+#include <logger.h>
+#include <libofgwrite.h>
+
+// Library interface for E2 plugins. A context holds the options and the
+// plan of one job. The device search and the flash tools work on the
+// process wide state of ofgwrite, so the library lock serializes planning
+// and flashing, and the state of a context is loaded into the globals
+// while it is used.
+//
+// Only not running images are flashed. Flashing the running one needs E2
+// to be stopped, which the ofgwrite command does.
+
+#define LIB_MOUNT_POINT "/oldroot_remount"
+
+extern int flash_kernel;
+extern int flash_rootfs;
+extern int no_write;
+extern int force_e2_stop;
+extern int quiet;
+extern int jffs2_summary;
+extern int parallel_flash;
+extern int rehearse;
+extern int stop_e2_needed;
+extern char kernel_filename[1000];
+extern char rootfs_filename[1000];
+extern char image_dir[4097];
+extern enum RootfsTypeEnum rootfs_type;
+
+int find_image_files(char* p);
+int readProcMounts();
+int find_devices();
+void init_flash_jobs(struct flash_job* kernel, struct flash_job* rootfs);
+void tune_buffers();
+int mount_rootfs(const char* device, const char* dir);
+int kernel_flash(struct flash_job* job);
+int rootfs_flash(struct flash_job* job);
+void set_progress_callback(void (*func)(void* user, const char* step, int percent), void* user);
+
+struct ofgwrite_ctx
+{
+	struct ofgwrite_options opts;
+	char image_dir[4097];
+	char kernel_device_arg[1000];
+	char rootfs_device_arg[1000];
+	const char* error;
+
+	// result of planning
+	int planned;
+	int flash_kernel;
+	int flash_rootfs;
+	char kernel_filename[1000];
+	char rootfs_filename[1000];
+	struct stat kernel_file_stat;
+	struct stat rootfs_file_stat;
+	char kernel_device[1000];
+	char rootfs_device[1000];
+	char rootfs_sub_dir[1000];
+	enum FlashModeTypeEnum kernel_flash_mode;
+	enum FlashModeTypeEnum rootfs_flash_mode;
+	enum RootfsTypeEnum rootfs_type;
+	int multiboot_partition;
+	int running_image;
+	int concurrent;
+};
+
+static pthread_mutex_t lib_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Fatal busybox errors (xmalloc, rm, fdisk, ...) jump back to the library
+// call which is running, so it fails instead of ending the host process.
+static jmp_buf abort_jmp;
+static int abort_armed;
+static pid_t abort_pid;
+static pthread_t abort_thread;
+static int lib_mounted;
+
+static void abort_arm()
+{
+	abort_pid = getpid();
+	abort_thread = pthread_self();
+	abort_armed = 1;
+}
+
+void ofgwrite_lib_abort(void)
+{
+	// forked children of the library, e.g. a decompressor, end
+	if (getpid() != abort_pid)
+		_exit(EXIT_FAILURE);
+	if (abort_armed && pthread_equal(pthread_self(), abort_thread))
+	{
+		abort_armed = 0;
+		longjmp(abort_jmp, 1);
+	}
+	// a concurrent flash job fails, its result stays 0
+	if (flash_job_concurrent())
+		pthread_exit(NULL);
+}
+
+// same device names as the -k and -r options accept
+static int valid_device(const char* dev)
+{
+	return strncmp(dev, "mtd", 3) == 0 || strncmp(dev, "mmcblk", 6) == 0 || strncmp(dev, "sd", 2) == 0;
+}
+
+static void copy_string(char* dest, int size, const char* src)
+{
+	snprintf(dest, size, "%s", src != NULL ? src : "");
+}
+
+struct ofgwrite_ctx* ofgwrite_new(const struct ofgwrite_options* opts)
+{
+	struct ofgwrite_ctx* ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL)
+		return NULL;
+
+	ctx->opts = *opts;
+	copy_string(ctx->image_dir, sizeof(ctx->image_dir), opts->image_dir);
+	copy_string(ctx->kernel_device_arg, sizeof(ctx->kernel_device_arg), opts->kernel_device);
+	copy_string(ctx->rootfs_device_arg, sizeof(ctx->rootfs_device_arg), opts->rootfs_device);
+	// the strings of the caller may be gone later
+	ctx->opts.image_dir     = ctx->image_dir;
+	ctx->opts.kernel_device = ctx->kernel_device_arg[0] != '\0' ? ctx->kernel_device_arg : NULL;
+	ctx->opts.rootfs_device = ctx->rootfs_device_arg[0] != '\0' ? ctx->rootfs_device_arg : NULL;
+	if (ctx->opts.multiboot_partition < 1 || ctx->opts.multiboot_partition > 9)
+		ctx->opts.multiboot_partition = -1;
+	ctx->error = "";
+	return ctx;
+}
+
+void ofgwrite_free(struct ofgwrite_ctx* ctx)
+{
+	free(ctx);
+}
+
+const char* ofgwrite_error(const struct ofgwrite_ctx* ctx)
+{
+	return ctx->error;
+}
+
+static void set_callbacks(struct ofgwrite_ctx* ctx)
+{
+	set_progress_callback(ctx != NULL ? ctx->opts.progress : NULL, ctx != NULL ? ctx->opts.user : NULL);
+	log_set_callback(ctx != NULL ? ctx->opts.log : NULL, ctx != NULL ? ctx->opts.user : NULL);
+}
+
+static void save_state(struct ofgwrite_ctx* ctx)
+{
+	ctx->flash_kernel = flash_kernel;
+	ctx->flash_rootfs = flash_rootfs;
+	strcpy(ctx->kernel_filename, kernel_filename);
+	strcpy(ctx->rootfs_filename, rootfs_filename);
+	ctx->kernel_file_stat = kernel_file_stat;
+	ctx->rootfs_file_stat = rootfs_file_stat;
+	strcpy(ctx->kernel_device, kernel_device);
+	strcpy(ctx->rootfs_device, rootfs_device);
+	strcpy(ctx->rootfs_sub_dir, rootfs_sub_dir);
+	ctx->kernel_flash_mode   = kernel_flash_mode;
+	ctx->rootfs_flash_mode   = rootfs_flash_mode;
+	ctx->rootfs_type         = rootfs_type;
+	ctx->multiboot_partition = multiboot_partition;
+	ctx->running_image       = stop_e2_needed;
+}
+
+// another context may have been planned in between
+static void load_state(struct ofgwrite_ctx* ctx)
+{
+	flash_kernel   = ctx->flash_kernel;
+	flash_rootfs   = ctx->flash_rootfs;
+	no_write       = ctx->opts.no_write;
+	quiet          = ctx->opts.quiet;
+	jffs2_summary  = ctx->opts.jffs2_summary;
+	parallel_flash = ctx->opts.parallel;
+	strcpy(image_dir, ctx->image_dir);
+	strcpy(kernel_filename, ctx->kernel_filename);
+	strcpy(rootfs_filename, ctx->rootfs_filename);
+	kernel_file_stat = ctx->kernel_file_stat;
+	rootfs_file_stat = ctx->rootfs_file_stat;
+	strcpy(kernel_device, ctx->kernel_device);
+	strcpy(rootfs_device, ctx->rootfs_device);
+	strcpy(rootfs_sub_dir, ctx->rootfs_sub_dir);
+	kernel_flash_mode   = ctx->kernel_flash_mode;
+	rootfs_flash_mode   = ctx->rootfs_flash_mode;
+	rootfs_type         = ctx->rootfs_type;
+	multiboot_partition = ctx->multiboot_partition;
+	stop_e2_needed      = ctx->running_image;
+	rootsubdir_check    = 0;
+}
+
+static int plan_locked(struct ofgwrite_ctx* ctx)
+{
+	ctx->planned = 0;
+	if (ctx->image_dir[0] == '\0')
+	{
+		ctx->error = "No image directory given";
+		return 0;
+	}
+	if ((ctx->opts.kernel_device != NULL && !valid_device(ctx->opts.kernel_device))
+	 || (ctx->opts.rootfs_device != NULL && !valid_device(ctx->opts.rootfs_device)))
+	{
+		ctx->error = "Only mtd, mmcblk and sd devices can be flashed";
+		return 0;
+	}
+
+	// the state of a run of the ofgwrite command after reading the arguments
+	flash_kernel   = ctx->opts.flash_kernel;
+	flash_rootfs   = ctx->opts.flash_rootfs;
+	if (!flash_kernel && !flash_rootfs)
+	{
+		flash_kernel = 1;
+		flash_rootfs = 1;
+	}
+	no_write       = ctx->opts.no_write;
+	quiet          = ctx->opts.quiet;
+	jffs2_summary  = ctx->opts.jffs2_summary;
+	parallel_flash = ctx->opts.parallel;
+	force_e2_stop  = 0;
+	rehearse       = 0;
+	stop_e2_needed = 1;
+	found_kernel_device = 0;
+	found_rootfs_device = 0;
+	kernel_flash_mode = FLASH_MODE_UNKNOWN;
+	rootfs_flash_mode = FLASH_MODE_UNKNOWN;
+	kernel_device[0]  = '\0';
+	rootfs_device[0]  = '\0';
+	rootfs_sub_dir[0] = '\0';
+	multiboot_partition = ctx->opts.multiboot_partition;
+	rootsubdir_check  = 0;
+	flash_targets_cnt = 0;
+	user_kernel = ctx->opts.kernel_device != NULL;
+	user_rootfs = ctx->opts.rootfs_device != NULL;
+	strcpy(kernel_device_arg, ctx->kernel_device_arg);
+	strcpy(rootfs_device_arg, ctx->rootfs_device_arg);
+
+	if (!find_image_files(ctx->image_dir))
+	{
+		ctx->error = "Image directory not found";
+		return 0;
+	}
+	if (!readProcMounts())
+	{
+		ctx->error = "Error reading /proc/mounts";
+		return 0;
+	}
+	if (!find_devices())
+	{
+		ctx->error = "Image file or device not found";
+		return 0;
+	}
+
+	save_state(ctx);
+	ctx->concurrent = flash_kernel && flash_rootfs && parallel_flash && independent_devices(kernel_device, rootfs_device);
+	ctx->planned = 1;
+	return 1;
+}
+
+int ofgwrite_plan(struct ofgwrite_ctx* ctx, struct ofgwrite_plan* plan)
+{
+	int ret;
+
+	pthread_mutex_lock(&lib_lock);
+	ctx->error = "";
+	set_callbacks(ctx);
+	if (setjmp(abort_jmp) == 0)
+	{
+		abort_arm();
+		ret = plan_locked(ctx);
+	}
+	else
+	{
+		ctx->planned = 0;
+		ctx->error = "Fatal error while planning";
+		ret = 0;
+	}
+	abort_armed = 0;
+	set_callbacks(NULL);
+	pthread_mutex_unlock(&lib_lock);
+
+	if (ret && plan != NULL)
+	{
+		plan->kernel_file         = ctx->flash_kernel ? ctx->kernel_filename : "";
+		plan->kernel_device       = ctx->flash_kernel ? ctx->kernel_device : "";
+		plan->rootfs_file         = ctx->flash_rootfs ? ctx->rootfs_filename : "";
+		plan->rootfs_device       = ctx->flash_rootfs ? ctx->rootfs_device : "";
+		plan->multiboot_partition = ctx->multiboot_partition;
+		plan->concurrent          = ctx->concurrent;
+		plan->running_image       = ctx->running_image;
+	}
+	return ret;
+}
+
+static int flash_jobs(struct ofgwrite_ctx* ctx, struct flash_job* jobs)
+{
+	if (ctx->concurrent)
+	{
+		my_printf("Flashing kernel and rootfs concurrently ...\n");
+		set_step_without_incr("Writing kernel and rootfs");
+		if (!flash_jobs_concurrent(jobs, 2))
+		{
+			ctx->error = jobs[0].result ? "Error flashing rootfs" : "Error flashing kernel";
+			return 0;
+		}
+		return 1;
+	}
+
+	if (flash_kernel && !kernel_flash(&jobs[0]))
+	{
+		ctx->error = "Error flashing kernel";
+		return 0;
+	}
+	if (flash_rootfs && !rootfs_flash(&jobs[1]))
+	{
+		ctx->error = "Error flashing rootfs";
+		return 0;
+	}
+	return 1;
+}
+
+static int execute_locked(struct ofgwrite_ctx* ctx)
+{
+	struct flash_job jobs[2];
+	int ret;
+
+	if (!ctx->planned && !plan_locked(ctx))
+		return 0;
+
+	// same check as the ofgwrite command to protect the files of a PC
+#if defined(__i386) || defined(__x86_64__)
+	if (!ctx->opts.no_write)
+	{
+		ctx->error = "Flashing on a PC is not allowed";
+		return 0;
+	}
+#endif
+	if (ctx->running_image && !ctx->opts.no_write)
+	{
+		ctx->error = "The running image can only be flashed by the ofgwrite command";
+		return 0;
+	}
+
+	load_state(ctx);
+	init_flash_jobs(&jobs[0], &jobs[1]);
+	tune_buffers();
+
+	if (!no_write && flash_rootfs && rootfs_flash_mode == TARBZ2)
+	{
+		set_step("Mount rootfs");
+		if (!mount_rootfs(rootfs_device, LIB_MOUNT_POINT))
+		{
+			ctx->error = "Error mounting rootfs";
+			return 0;
+		}
+		lib_mounted = 1;
+	}
+
+	ret = flash_jobs(ctx, jobs);
+	if (lib_mounted)
+	{
+		umount(LIB_MOUNT_POINT);
+		rmdir(LIB_MOUNT_POINT);
+		lib_mounted = 0;
+	}
+	sync();
+	if (ret)
+		set_step("Successfully flashed!");
+	telemetry_write(image_dir, ret);
+	return ret;
+}
+
+int ofgwrite_execute(struct ofgwrite_ctx* ctx)
+{
+	int ret;
+
+	pthread_mutex_lock(&lib_lock);
+	ctx->error = "";
+	set_callbacks(ctx);
+	if (setjmp(abort_jmp) == 0)
+	{
+		abort_arm();
+		ret = execute_locked(ctx);
+	}
+	else
+	{
+		if (lib_mounted)
+		{
+			umount(LIB_MOUNT_POINT);
+			rmdir(LIB_MOUNT_POINT);
+			lib_mounted = 0;
+		}
+		ctx->error = "Fatal error while flashing";
+		telemetry_write(image_dir, 0);
+		ret = 0;
+	}
+	abort_armed = 0;
+	set_callbacks(NULL);
+	pthread_mutex_unlock(&lib_lock);
+	return ret;
+}
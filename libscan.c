@@ -80,7 +80,7 @@ int ubi_scan(struct mtd_dev_info *mtd, int fd, struct ubi_scan_info **info,
 			normsg_cont("scanning eraseblock %d", eb);
 			fflush(stdout);
 		}
-		if (pr) {
+		if (pr && progress_due(eb == mtd->eb_cnt - 1)) {
 			printf("\r" PROGRAM_NAME ": scanning eraseblock %d -- %2lld %% complete  ",
 			       eb, (long long)(eb + 1) * 100 / mtd->eb_cnt);
 			fflush(stdout);
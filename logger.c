@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <logger.h>
+
+// Bounded lock-free ring of formatted messages. Producers take a slot by
+// advancing head, the slot sequence tells the log thread when the message
+// is complete and the producers when the slot is free again.
+
+#define LOG_SLOTS      256
+#define LOG_MSG_SIZE   512
+#define LOG_IDLE_MS    10
+#define LOG_FLUSH_MS   3000
+#define LOG_FULL_MS    50
+
+enum LogStreamEnum
+{
+	LOG_STDOUT, LOG_STDERR
+};
+
+struct log_slot
+{
+	unsigned int seq;
+	unsigned char stream;
+	char msg[LOG_MSG_SIZE];
+};
+
+static struct log_slot ring[LOG_SLOTS];
+static unsigned int head;
+static unsigned int tail;
+static unsigned int dropped;
+
+static pthread_t log_thread;
+static pid_t log_pid;
+static int running;
+static int stop;
+static int log_fd = -1;
+
+// libofgwrite gets the messages by a callback
+static void (*log_func)(void* user, const char* msg);
+static void* log_user;
+static pid_t log_func_pid;
+
+static void sleep_ms(int ms)
+{
+	struct timespec ts = { 0, ms * 1000000 };
+
+	nanosleep(&ts, NULL);
+}
+
+static void log_sync(FILE* f, const char* fmt, va_list ap)
+{
+	void (*func)(void* user, const char* msg) = __atomic_load_n(&log_func, __ATOMIC_ACQUIRE);
+	char msg[LOG_MSG_SIZE];
+	va_list ap2;
+	ssize_t ret;
+	int len;
+
+	va_copy(ap2, ap);
+	len = vsnprintf(msg, sizeof(msg), fmt, ap2);
+	va_end(ap2);
+	if (len >= (int)sizeof(msg))
+		len = sizeof(msg) - 1;
+
+	if (func != NULL && log_func_pid == getpid())
+		func(log_user, msg);
+	// forked children write their messages to the log file, too
+	if (log_fd >= 0 && len > 0 && (f == stdout || f == stderr))
+	{
+		ret = write(log_fd, msg, len);
+		(void)ret;
+	}
+
+	va_copy(ap2, ap);
+	// print to file (normally stdout or stderr)
+	vfprintf(f, fmt, ap);
+	// print to syslog
+	vsyslog(LOG_INFO, fmt, ap2);
+	va_end(ap2);
+}
+
+static void write_message(struct log_slot* slot)
+{
+	FILE* f = slot->stream == LOG_STDERR ? stderr : stdout;
+	size_t len = strlen(slot->msg);
+
+	fputs(slot->msg, f);
+	syslog(LOG_INFO, "%s", slot->msg);
+	if (log_fd >= 0 && write(log_fd, slot->msg, len) != len)
+	{
+		close(log_fd);
+		log_fd = -1;
+	}
+}
+
+// writes all complete messages, returns the number written
+static int drain()
+{
+	struct log_slot* slot;
+	unsigned int lost;
+	int cnt = 0;
+
+	for (;;)
+	{
+		slot = &ring[tail % LOG_SLOTS];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail + 1)
+			break;
+		write_message(slot);
+		__atomic_store_n(&slot->seq, tail + LOG_SLOTS, __ATOMIC_RELEASE);
+		__atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+		cnt++;
+	}
+
+	lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+	if (lost)
+	{
+		fprintf(stderr, "%u log messages dropped, log buffer full\n", lost);
+		syslog(LOG_INFO, "%u log messages dropped, log buffer full", lost);
+	}
+	if (cnt)
+	{
+		fflush(stdout);
+		fflush(stderr);
+	}
+	return cnt;
+}
+
+static void* log_run(void* arg)
+{
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+		if (!drain())
+			sleep_ms(LOG_IDLE_MS);
+	drain();
+	return NULL;
+}
+
+void log_set_callback(void (*func)(void* user, const char* msg), void* user)
+{
+	log_user = user;
+	log_func_pid = getpid();
+	__atomic_store_n(&log_func, func, __ATOMIC_RELEASE);
+}
+
+static int start_thread()
+{
+	unsigned int i;
+
+	for (i = 0; i < LOG_SLOTS; i++)
+		ring[i].seq = i;
+	head = tail = dropped = 0;
+	stop = 0;
+
+	log_pid = getpid();
+	return pthread_create(&log_thread, NULL, log_run, NULL) == 0;
+}
+
+int log_start(const char* dir)
+{
+	char path[4200];
+
+	if (running)
+		return 1;
+
+	if (dir != NULL)
+	{
+		snprintf(path, sizeof(path), "%s/%s", dir, LOG_FILE);
+		log_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	}
+
+	if (!start_thread())
+	{
+		if (log_fd >= 0)
+			close(log_fd);
+		log_fd = -1;
+		return 0;
+	}
+	__atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+	atexit(log_stop);
+	return 1;
+}
+
+int log_restart()
+{
+	if (!running || log_pid == getpid())
+		return running;
+
+	// the parent wrote the ring before forking, the log file stays open
+	if (!start_thread())
+	{
+		__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+		return 0;
+	}
+	return 1;
+}
+
+void log_vprintf(FILE* f, const char* fmt, va_list ap)
+{
+	struct log_slot* slot;
+	unsigned int pos;
+	int waited = 0;
+	int diff;
+
+	// forked children don't have the log thread
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE) || log_pid != getpid() || (f != stdout && f != stderr))
+	{
+		log_sync(f, fmt, ap);
+		return;
+	}
+
+	pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		slot = &ring[pos % LOG_SLOTS];
+		diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff < 0)
+		{
+			// full, flashing waits only shortly for the log
+			if (waited++ >= LOG_FULL_MS)
+			{
+				__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+				return;
+			}
+			sleep_ms(1);
+			pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+		}
+		else
+			pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	}
+
+	vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap);
+	slot->stream = f == stderr ? LOG_STDERR : LOG_STDOUT;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+void log_flush()
+{
+	int waited = 0;
+
+	if (!running || log_pid != getpid())
+		return;
+	while (__atomic_load_n(&tail, __ATOMIC_ACQUIRE) != __atomic_load_n(&head, __ATOMIC_ACQUIRE)
+	 && waited < LOG_FLUSH_MS)
+	{
+		sleep_ms(1);
+		waited++;
+	}
+	if (log_fd >= 0)
+		fsync(log_fd);
+}
+
+void log_stop()
+{
+	int drained;
+
+	if (!running || log_pid != getpid())
+		return;
+	log_flush();
+	drained = __atomic_load_n(&tail, __ATOMIC_ACQUIRE) == __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	// a thread hanging in syslog is left behind
+	if (!drained)
+	{
+		pthread_detach(log_thread);
+		return;
+	}
+	pthread_join(log_thread, NULL);
+	if (log_fd >= 0)
+	{
+		close(log_fd);
+		log_fd = -1;
+	}
+}
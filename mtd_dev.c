@@ -0,0 +1,63 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * Opened MTD device shared by the in-process flash tool API.
+ */
+
+#define PROGRAM_NAME "mtd_dev"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <common.h>
+#include <mtd_dev.h>
+
+int mtd_dev_open(struct mtd_dev_handle *dev, const char *node)
+{
+	memset(dev, 0, sizeof(*dev));
+	dev->node = node;
+	dev->fd = -1;
+
+	dev->libmtd = libmtd_open();
+	if (!dev->libmtd) {
+		if (errno == 0)
+			return errmsg("MTD is not present in the system");
+		return sys_errmsg("cannot open libmtd");
+	}
+
+	if (mtd_get_dev_info(dev->libmtd, node, &dev->mtd)) {
+		sys_errmsg("cannot get information about \"%s\"", node);
+		goto out_close_mtd;
+	}
+
+	dev->fd = open(node, O_RDWR);
+	if (dev->fd == -1) {
+		sys_errmsg("cannot open \"%s\"", node);
+		goto out_close_mtd;
+	}
+
+	return 0;
+
+out_close_mtd:
+	libmtd_close(dev->libmtd);
+	dev->libmtd = NULL;
+	return -1;
+}
+
+void mtd_dev_close(struct mtd_dev_handle *dev)
+{
+	if (dev->fd != -1)
+		close(dev->fd);
+	if (dev->libmtd)
+		libmtd_close(dev->libmtd);
+	dev->fd = -1;
+	dev->libmtd = NULL;
+}
@@ -42,6 +42,11 @@
 #include "mtd/mtd-user.h"
 #include "common.h"
 #include <libmtd.h>
+#include <jffs2sum.h>
+#include <flash_erase.h>
+#include <mtd_dev.h>
+#include <telemetry.h>
+#include <tune.h>
 
 static void display_help(int status)
 {
@@ -57,6 +62,10 @@ static void display_help(int status)
 "  -O, --onlyoob           Input contains oob data and only write the oob part\n"
 "  -s addr, --start=addr   Set output start address (default is 0)\n"
 "  -p, --pad               Pad writes to page size\n"
+"  -J, --jffs2-summary     Input is a JFFS2 image, add erase block summary\n"
+"  -e, --erase             Erase each eraseblock right before writing it and\n"
+"                          erase the rest of the device after the image\n"
+"  -j, --jffs2             Write JFFS2 cleanmarkers to erased blocks (with -e)\n"
 "  -b, --blockalign=1|2|4  Set multiple of eraseblocks to align to\n"
 "      --input-skip=length Skip |length| bytes of the input file\n"
 "      --input-size=length Only read |length| bytes of the input file\n"
@@ -96,16 +105,22 @@ static bool		noecc = false;
 static bool		autoplace = false;
 static bool		noskipbad = false;
 static bool		pad = false;
+static bool		jffs2sum = false;
+static bool		erase = false;
+static bool		jffs2 = false;
 static int		blockalign = 1; /* default to using actual block size */
 
 static void process_options(int argc, char * const argv[])
 {
 	int error = 0;
 	mtdoffset = 0;
+	jffs2sum = false;
+	erase = false;
+	jffs2 = false;
 
 	for (;;) {
 		int option_index = 0;
-		static const char short_options[] = "hb:mnNoOpqs:a";
+		static const char short_options[] = "hb:mnNoOpqs:aJej";
 		static const struct option long_options[] = {
 			/* Order of these args with val==0 matters; see option_index. */
 			{"version", no_argument, 0, 0},
@@ -122,6 +137,9 @@ static void process_options(int argc, char * const argv[])
 			{"quiet", no_argument, 0, 'q'},
 			{"start", required_argument, 0, 's'},
 			{"autoplace", no_argument, 0, 'a'},
+			{"jffs2-summary", no_argument, 0, 'J'},
+			{"erase", no_argument, 0, 'e'},
+			{"jffs2", no_argument, 0, 'j'},
 			{0, 0, 0, 0},
 		};
 
@@ -175,6 +193,15 @@ static void process_options(int argc, char * const argv[])
 		case 'a':
 			autoplace = true;
 			break;
+		case 'J':
+			jffs2sum = true;
+			break;
+		case 'e':
+			erase = true;
+			break;
+		case 'j':
+			jffs2 = true;
+			break;
 		case 'h':
 			display_help(EXIT_SUCCESS);
 			break;
@@ -198,6 +225,15 @@ static void process_options(int argc, char * const argv[])
 	if (!onlyoob && (pad && writeoob))
 		errmsg_die("Can't pad when oob data is present");
 
+	if (jffs2sum && (writeoob || inputskip || inputsize))
+		errmsg_die("JFFS2 summary can't be used with oob data or input skip/size");
+
+	if (jffs2 && !erase)
+		errmsg_die("JFFS2 cleanmarkers can only be written in erase mode");
+
+	if (jffs2 && writeoob)
+		errmsg_die("JFFS2 cleanmarkers can't be written with oob data");
+
 	argc -= optind;
 	argv += optind;
 
@@ -220,6 +256,73 @@ static void process_options(int argc, char * const argv[])
 	img = ((argc == 2) ? argv[1] : standard_input);
 }
 
+/*
+ * The image is read in chunks of the tuned size instead of page by page,
+ * the pages are copied out of this buffer
+ */
+static unsigned char *inbuf;
+static size_t inbuf_size;
+static size_t inbuf_pos;
+static size_t inbuf_len;
+
+/* Read from the input image, through the JFFS2 summary stream if enabled */
+static ssize_t read_input(struct jffs2_sum_stream *sum, int ifd, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	if (inbuf && inbuf_pos == inbuf_len) {
+		if (sum)
+			ret = jffs2_sum_read(sum, inbuf, inbuf_size);
+		else
+			ret = read(ifd, inbuf, inbuf_size);
+		if (ret <= 0)
+			return ret;
+		telemetry_add_read(ret);
+		inbuf_pos = 0;
+		inbuf_len = ret;
+	}
+	if (inbuf) {
+		if (len > inbuf_len - inbuf_pos)
+			len = inbuf_len - inbuf_pos;
+		memcpy(buf, inbuf + inbuf_pos, len);
+		inbuf_pos += len;
+		return len;
+	}
+
+	if (sum)
+		ret = jffs2_sum_read(sum, buf, len);
+	else
+		ret = read(ifd, buf, len);
+	if (ret > 0)
+		telemetry_add_read(ret);
+	return ret;
+}
+
+/*
+ * Erase all eraseblocks of the (aligned) block at @blockstart and write the
+ * JFFS2 cleanmarker if requested. Returns %0 in case of success and the errno
+ * of the failed erase otherwise. A failed cleanmarker write is only reported,
+ * the block is erased and JFFS2 copes with a missing cleanmarker.
+ */
+static int erase_block(libmtd_t mtd_desc, const struct mtd_dev_info *mtd, int fd,
+		       long long blockstart, int ebsize_aligned,
+		       const struct jffs2_cleanmarker *clm)
+{
+	long long i;
+
+	for (i = blockstart; i < blockstart + ebsize_aligned; i += mtd->eb_size) {
+		if (mtd_erase(mtd_desc, mtd, fd, i / mtd->eb_size)) {
+			int errno_tmp = errno;
+			sys_errmsg("%s: MTD Erase failure", mtd_device);
+			return errno_tmp ? errno_tmp : EIO;
+		}
+		if (clm && jffs2_cleanmarker_write(clm, mtd_desc, mtd, fd, i / mtd->eb_size))
+			sys_errmsg("%s: MTD writeoob failure", mtd_device);
+	}
+
+	return 0;
+}
+
 static void erase_buffer(void *buffer, size_t size)
 {
 	const uint8_t kEraseByte = 0xff;
@@ -229,17 +332,16 @@ static void erase_buffer(void *buffer, size_t size)
 }
 
 /*
- * Main program
+ * Write the input image to the opened MTD device, options are taken from the
+ * static variables above
  */
-int nandwrite_main(int argc, char * const argv[])
+static int nandwrite(libmtd_t mtd_desc, const struct mtd_dev_info *mtd, int fd)
 {
-	int fd = -1;
 	int ifd = -1;
 	int pagelen;
 	long long imglen = 0;
 	bool baderaseblock = false;
 	long long blockstart = -1;
-	struct mtd_dev_info mtd;
 	long long offs;
 	int ret;
 	bool failed = true;
@@ -251,45 +353,27 @@ int nandwrite_main(int argc, char * const argv[])
 	unsigned char *writebuf = NULL;
 	/* points to the OOB for the current page in filebuf */
 	unsigned char *oobbuf = NULL;
-	libmtd_t mtd_desc;
 	int ebsize_aligned;
 	uint8_t write_mode;
 	long long ofg_imglen = 1;
-
-	process_options(argc, argv);
-
-	/* Open the device */
-	if ((fd = open(mtd_device, O_RDWR)) == -1)
-	{
-		sys_errmsg("%s", mtd_device);
-		return -1;
-	}
-
-	mtd_desc = libmtd_open();
-	if (!mtd_desc)
-	{
-		errmsg("can't initialize libmtd");
-		return -1;
-	}
-	/* Fill in MTD device capability structure */
-	if (mtd_get_dev_info(mtd_desc, mtd_device, &mtd) < 0)
-	{
-		errmsg("mtd_get_dev_info failed");
-		return -1;
-	}
+	struct jffs2_sum_stream *sum = NULL;
+	struct jffs2_cleanmarker clm;
+	int bad_cnt = 0;
+	/* last block erased in erase mode */
+	long long erasedstart = -1;
 
 	/*
 	 * Pretend erasesize is specified number of blocks - to match jffs2
 	 *   (virtual) block size
 	 * Use this value throughout unless otherwise necessary
 	 */
-	ebsize_aligned = mtd.eb_size * blockalign;
+	ebsize_aligned = mtd->eb_size * blockalign;
 
-	if (mtdoffset & (mtd.min_io_size - 1))
+	if (mtdoffset & (mtd->min_io_size - 1))
 	{
 		errmsg("The start address is not page-aligned !\n"
 			   "The pagesize of this NAND Flash is 0x%x.\n",
-			   mtd.min_io_size);
+			   mtd->min_io_size);
 		return -1;
 	}
 
@@ -315,6 +399,9 @@ int nandwrite_main(int argc, char * const argv[])
 		}
 	}
 
+	if (jffs2 && jffs2_cleanmarker_init(&clm, mtd, fd, mtd_device) != 0)
+		return -1;
+
 	/* Determine if we are reading from standard input or from a file. */
 	if (strcmp(img, standard_input) == 0)
 		ifd = STDIN_FILENO;
@@ -326,7 +413,7 @@ int nandwrite_main(int argc, char * const argv[])
 		goto closeall;
 	}
 
-	pagelen = mtd.min_io_size + ((writeoob) ? mtd.oob_size : 0);
+	pagelen = mtd->min_io_size + ((writeoob) ? mtd->oob_size : 0);
 
 	if (ifd == STDIN_FILENO) {
 		imglen = inputsize ? : pagelen;
@@ -352,6 +439,19 @@ int nandwrite_main(int argc, char * const argv[])
 		}
 	}
 
+	if (jffs2sum) {
+		sum = jffs2_sum_open(ifd, ebsize_aligned, 0);
+		if (!sum)
+			goto closeall;
+	}
+
+	/* stdin is read page by page, it may be shared with the caller */
+	inbuf_pos = inbuf_len = 0;
+	if (ifd != STDIN_FILENO) {
+		inbuf_size = tune_get()->image_buf;
+		inbuf = tune_buffer(TUNE_IMAGE_BUF);
+	}
+
 	/* Check, if file is page-aligned */
 	if (!pad && (imglen % pagelen) != 0) {
 		my_fprintf(stderr, "Input file is not page-aligned. Use the padding "
@@ -360,10 +460,10 @@ int nandwrite_main(int argc, char * const argv[])
 	}
 
 	/* Check, if length fits into device */
-	if ((imglen / pagelen) * mtd.min_io_size > mtd.size - mtdoffset) {
+	if ((imglen / pagelen) * mtd->min_io_size > mtd->size - mtdoffset) {
 		my_fprintf(stderr, "Image %lld bytes, NAND page %d bytes, OOB area %d"
 				" bytes, device size %lld bytes\n",
-				imglen, pagelen, mtd.oob_size, mtd.size);
+				imglen, pagelen, mtd->oob_size, mtd->size);
 		sys_errmsg("Input file does not fit into device");
 		goto closeall;
 	}
@@ -374,7 +474,7 @@ int nandwrite_main(int argc, char * const argv[])
 	 * and pagelen are large enough, then "ebsize_aligned * pagelen" could
 	 * overflow a 32-bit data type.
 	 */
-	filebuf_max = ebsize_aligned / mtd.min_io_size * pagelen;
+	filebuf_max = ebsize_aligned / mtd->min_io_size * pagelen;
 	filebuf = xmalloc(filebuf_max);
 	erase_buffer(filebuf, filebuf_max);
 
@@ -386,7 +486,7 @@ int nandwrite_main(int argc, char * const argv[])
 	 * length or zero.
 	 */
 	while ((imglen > 0 || writebuf < filebuf + filebuf_len)
-		&& mtdoffset < mtd.size) {
+		&& mtdoffset < mtd->size) {
 		/*
 		 * New eraseblock, check for bad block(s)
 		 * Stay in the loop to be sure that, if mtdoffset changes because
@@ -419,12 +519,13 @@ int nandwrite_main(int argc, char * const argv[])
 				continue;
 
 			do {
-				ret = mtd_is_bad(&mtd, fd, offs / ebsize_aligned);
+				ret = mtd_is_bad(mtd, fd, offs / ebsize_aligned);
 				if (ret < 0) {
 					sys_errmsg("%s: MTD get bad block failed", mtd_device);
 					goto closeall;
 				} else if (ret == 1) {
 					baderaseblock = true;
+					bad_cnt++;
 					if (!quiet)
 						my_fprintf(stderr, "Bad block at %llx, %u block(s) "
 								"from %llx will be skipped\n",
@@ -434,7 +535,7 @@ int nandwrite_main(int argc, char * const argv[])
 				if (baderaseblock) {
 					mtdoffset = blockstart + ebsize_aligned;
 
-					if (mtdoffset > mtd.size) {
+					if (mtdoffset > mtd->size) {
 						errmsg("too many bad blocks, cannot complete request");
 						goto closeall;
 					}
@@ -445,15 +546,37 @@ int nandwrite_main(int argc, char * const argv[])
 
 		}
 
+		/* Erase the block right before programming it */
+		if (erase && erasedstart != blockstart) {
+			erasedstart = blockstart;
+			ret = erase_block(mtd_desc, mtd, fd, blockstart, ebsize_aligned,
+					  jffs2 ? &clm : NULL);
+			if (ret) {
+				if (ret != EIO)
+					goto closeall;
+
+				if (markbad) {
+					my_fprintf(stderr, "Marking block at %08llx bad\n", blockstart);
+					if (mtd_mark_bad(mtd, fd, blockstart / mtd->eb_size)) {
+						sys_errmsg("%s: MTD Mark bad block failure", mtd_device);
+						goto closeall;
+					}
+				}
+				mtdoffset = blockstart + ebsize_aligned;
+
+				continue;
+			}
+		}
+
 		/* Read more data from the input if there isn't enough in the buffer */
-		if (writebuf + mtd.min_io_size > filebuf + filebuf_len) {
-			size_t readlen = mtd.min_io_size;
+		if (writebuf + mtd->min_io_size > filebuf + filebuf_len) {
+			size_t readlen = mtd->min_io_size;
 			size_t alreadyread = (filebuf + filebuf_len) - writebuf;
 			size_t tinycnt = alreadyread;
 			ssize_t cnt = 0;
 
 			while (tinycnt < readlen) {
-				cnt = read(ifd, writebuf + tinycnt, readlen - tinycnt);
+				cnt = read_input(sum, ifd, writebuf + tinycnt, readlen - tinycnt);
 				if (cnt == 0) { /* EOF */
 					break;
 				} else if (cnt < 0) {
@@ -470,7 +593,7 @@ int nandwrite_main(int argc, char * const argv[])
 				 * the end of the "file". For nonstandard input,
 				 * leave it as-is to detect an early EOF.
 				 */
-				if (ifd == STDIN_FILENO)
+				if (ifd == STDIN_FILENO || sum)
 					imglen = 0;
 
 				break;
@@ -488,7 +611,12 @@ int nandwrite_main(int argc, char * const argv[])
 			}
 
 			filebuf_len += readlen - alreadyread;
-			if (ifd != STDIN_FILENO) {
+			if (sum) {
+				/* summarized image size is unknown, imglen only signals end of input */
+				set_step_progress((int)(jffs2_sum_consumed(sum) * 100 / ofg_imglen));
+				if (cnt == 0)
+					imglen = 0;
+			} else if (ifd != STDIN_FILENO) {
 				imglen -= tinycnt - alreadyread;
 				set_step_progress((int)((long long)(ofg_imglen - imglen) * 100 / (ofg_imglen)));
 			} else if (cnt == 0) {
@@ -498,17 +626,17 @@ int nandwrite_main(int argc, char * const argv[])
 		}
 
 		if (writeoob) {
-			oobbuf = writebuf + mtd.min_io_size;
+			oobbuf = writebuf + mtd->min_io_size;
 
 			/* Read more data for the OOB from the input if there isn't enough in the buffer */
-			if (oobbuf + mtd.oob_size > filebuf + filebuf_len) {
-				size_t readlen = mtd.oob_size;
+			if (oobbuf + mtd->oob_size > filebuf + filebuf_len) {
+				size_t readlen = mtd->oob_size;
 				size_t alreadyread = (filebuf + filebuf_len) - oobbuf;
 				size_t tinycnt = alreadyread;
 				ssize_t cnt;
 
 				while (tinycnt < readlen) {
-					cnt = read(ifd, oobbuf + tinycnt, readlen - tinycnt);
+					cnt = read_input(sum, ifd, oobbuf + tinycnt, readlen - tinycnt);
 					if (cnt == 0) { /* EOF */
 						break;
 					} else if (cnt < 0) {
@@ -535,12 +663,12 @@ int nandwrite_main(int argc, char * const argv[])
 		}
 
 		/* Write out data */
-		ret = mtd_write(mtd_desc, &mtd, fd, mtdoffset / mtd.eb_size,
-				mtdoffset % mtd.eb_size,
+		ret = mtd_write(mtd_desc, mtd, fd, mtdoffset / mtd->eb_size,
+				mtdoffset % mtd->eb_size,
 				onlyoob ? NULL : writebuf,
-				onlyoob ? 0 : mtd.min_io_size,
+				onlyoob ? 0 : mtd->min_io_size,
 				writeoob ? oobbuf : NULL,
-				writeoob ? mtd.oob_size : 0,
+				writeoob ? mtd->oob_size : 0,
 				write_mode);
 		if (ret) {
 			long long i;
@@ -554,8 +682,8 @@ int nandwrite_main(int argc, char * const argv[])
 
 			my_fprintf(stderr, "Erasing failed write from %#08llx to %#08llx\n",
 				blockstart, blockstart + ebsize_aligned - 1);
-			for (i = blockstart; i < blockstart + ebsize_aligned; i += mtd.eb_size) {
-				if (mtd_erase(mtd_desc, &mtd, fd, i / mtd.eb_size)) {
+			for (i = blockstart; i < blockstart + ebsize_aligned; i += mtd->eb_size) {
+				if (mtd_erase(mtd_desc, mtd, fd, i / mtd->eb_size)) {
 					int errno_tmp = errno;
 					sys_errmsg("%s: MTD Erase failure", mtd_device);
 					if (errno_tmp != EIO)
@@ -565,8 +693,8 @@ int nandwrite_main(int argc, char * const argv[])
 
 			if (markbad) {
 				my_fprintf(stderr, "Marking block at %08llx bad\n",
-						mtdoffset & (~mtd.eb_size + 1));
-				if (mtd_mark_bad(&mtd, fd, mtdoffset / mtd.eb_size)) {
+						mtdoffset & (~mtd->eb_size + 1));
+				if (mtd_mark_bad(mtd, fd, mtdoffset / mtd->eb_size)) {
 					sys_errmsg("%s: MTD Mark bad block failure", mtd_device);
 					goto closeall;
 				}
@@ -575,21 +703,119 @@ int nandwrite_main(int argc, char * const argv[])
 
 			continue;
 		}
-		mtdoffset += mtd.min_io_size;
+		mtdoffset += mtd->min_io_size;
 		writebuf += pagelen;
 	}
 
+	/* Erase the unused rest of the device, no need to program it */
+	if (erase && (ifd == STDIN_FILENO || imglen == 0)
+		&& writebuf >= filebuf + filebuf_len) {
+		if (erasedstart >= 0)
+			offs = erasedstart + ebsize_aligned;
+		else
+			offs = mtdoffset & (~ebsize_aligned + 1);
+
+		if (!quiet && offs < mtd->size)
+			my_fprintf(stdout, "Erasing unused blocks from offset 0x%llx\n", offs);
+
+		for (; offs < mtd->size; offs += ebsize_aligned) {
+			if (!noskipbad) {
+				ret = mtd_is_bad(mtd, fd, offs / mtd->eb_size);
+				if (ret < 0) {
+					sys_errmsg("%s: MTD get bad block failed", mtd_device);
+					goto closeall;
+				} else if (ret == 1) {
+					bad_cnt++;
+					if (!quiet)
+						my_fprintf(stderr, "Skipping bad block at %llx\n", offs);
+					continue;
+				}
+			}
+			/* like flash_erase, failures of single blocks are not fatal here */
+			erase_block(mtd_desc, mtd, fd, offs, ebsize_aligned, jffs2 ? &clm : NULL);
+		}
+	}
+
 	failed = false;
 
 closeall:
-	close(ifd);
-	libmtd_close(mtd_desc);
+	telemetry_device(mtd_device, mtd->eb_cnt, bad_cnt, -1);
+	if (sum)
+		jffs2_sum_close(sum);
+	if (ifd != STDIN_FILENO)
+		close(ifd);
 	free(filebuf);
-	close(fd);
+	inbuf = NULL;
 
 	if (failed || (ifd != STDIN_FILENO && imglen > 0)
-		   || (writebuf < filebuf + filebuf_len))
+		   || (writebuf < filebuf + filebuf_len)) {
 		sys_errmsg("Data was only partially written due to error");
+		return -1;
+	}
+
+	return 0;
+}
+
+int nandwrite_dev(struct mtd_dev_handle *dev, const char *img_file, int flags)
+{
+	/* reset all options which might have been set by an earlier call */
+	mtdoffset = 0;
+	inputskip = 0;
+	inputsize = 0;
+	writeoob = false;
+	onlyoob = false;
+	noecc = false;
+	autoplace = false;
+	noskipbad = false;
+	blockalign = 1;
+
+	mtd_device = dev->node;
+	img = img_file;
+	pad = flags & NANDWRITE_PAD;
+	markbad = flags & NANDWRITE_MARKBAD;
+	erase = flags & NANDWRITE_ERASE;
+	jffs2 = flags & NANDWRITE_JFFS2;
+	jffs2sum = flags & NANDWRITE_JFFS2_SUMMARY;
+	quiet = flags & NANDWRITE_QUIET;
+
+	return nandwrite(dev->libmtd, &dev->mtd, dev->fd);
+}
+
+/*
+ * Main program
+ */
+int nandwrite_main(int argc, char * const argv[])
+{
+	int fd;
+	struct mtd_dev_info mtd;
+	libmtd_t mtd_desc;
+
+	process_options(argc, argv);
+
+	/* Open the device */
+	if ((fd = open(mtd_device, O_RDWR)) == -1)
+	{
+		sys_errmsg("%s", mtd_device);
+		return -1;
+	}
+
+	mtd_desc = libmtd_open();
+	if (!mtd_desc)
+	{
+		errmsg("can't initialize libmtd");
+		return -1;
+	}
+	/* Fill in MTD device capability structure */
+	if (mtd_get_dev_info(mtd_desc, mtd_device, &mtd) < 0)
+	{
+		errmsg("mtd_get_dev_info failed");
+		return -1;
+	}
+
+	nandwrite(mtd_desc, &mtd, fd);
+
+	libmtd_close(mtd_desc);
+	close(fd);
 
 	/* Return happy */
 	return EXIT_SUCCESS;
@@ -0,0 +1,557 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <glob.h>
+#include <limits.h>
+#include <pthread.h>
+#include <elf.h>
+#include <endian.h>
+#include <byteswap.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+#include <linux/fs.h>
+
+// Builds the minimal root filesystem in /newroot which is needed after
+// pivot_root: the binaries listed below plus all shared libraries they
+// need according to their ELF headers.
+
+#define NEWROOT_REQUIRED 0x01 // failing to copy it aborts flashing
+#define NEWROOT_TO_BIN   0x02 // copy to /bin instead of the source dir
+
+#define NEWROOT_THREADS  4
+
+struct newroot_entry
+{
+	const char* pattern; // %s is replaced by "lib" or "lib64"
+	int flags;
+};
+
+static const struct newroot_entry newroot_entries[] =
+{
+	// we need init and a shell to be able to exec init u later,
+	// symlinks like /sbin/init -> init.sysvinit are followed
+	{ "/bin/busybox*",        NEWROOT_REQUIRED },
+	{ "/bin/sh",              NEWROOT_REQUIRED },
+	{ "/bin/bash",            0 },
+	{ "/sbin/init",           NEWROOT_REQUIRED },
+	// automount, ignore errors as autofs is maybe not installed
+	{ "/usr/sbin/autom*",     NEWROOT_TO_BIN },
+	{ "/usr/%s/autofs/*",     0 },
+	{ "/etc/auto*",           0 },
+	{ "/etc/nsswitch*",       0 },
+	{ "/etc/resolv*",         0 },
+	// loaded by libc at runtime and therefore not found as dependency
+	{ "/%s/libnss_files*",    0 },
+	{ "/%s/libnss_dns*",      0 },
+	{ NULL,                   0 }
+};
+
+struct newroot_file
+{
+	char* src;
+	char* dst;
+	int required;
+};
+
+struct newroot
+{
+	const char* root;
+	const char* libdir;
+	struct newroot_file* files;
+	int files_cnt;
+	int next;
+	int failed;
+	pthread_mutex_t lock;
+};
+
+static int newroot_add_path(struct newroot* nr, const char* src, const char* dst_dir, int required);
+
+static int mkdir_parents(const char* path)
+{
+	char dir[PATH_MAX];
+	char* p;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	for (p = dir + 1; *p; p++)
+	{
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(dir, 0755) && errno != EEXIST)
+			return -1;
+		*p = '/';
+	}
+	return 0;
+}
+
+int mkdir_recursive(const char* path)
+{
+	char dir[PATH_MAX];
+
+	if (snprintf(dir, sizeof(dir), "%s/", path) >= (int)sizeof(dir))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return mkdir_parents(dir);
+}
+
+static int newroot_known(const struct newroot* nr, const char* src)
+{
+	int i;
+
+	for (i = 0; i < nr->files_cnt; i++)
+		if (!strcmp(nr->files[i].src, src))
+			return 1;
+	return 0;
+}
+
+static void newroot_queue(struct newroot* nr, const char* src, const char* dst, int required)
+{
+	nr->files = realloc(nr->files, (nr->files_cnt + 1) * sizeof(*nr->files));
+	nr->files[nr->files_cnt].src = strdup(src);
+	nr->files[nr->files_cnt].dst = strdup(dst);
+	nr->files[nr->files_cnt].required = required;
+	nr->files_cnt++;
+}
+
+// ELF files may be of either endianness and word size, depending on the box
+struct elf_file
+{
+	int fd;
+	int is64;
+	int swap;
+};
+
+static uint64_t elf_val(const struct elf_file* ef, const void* p, int size)
+{
+	switch (size)
+	{
+		case 2:
+		{
+			uint16_t v = *(const uint16_t*)p;
+			return ef->swap ? bswap_16(v) : v;
+		}
+		case 4:
+		{
+			uint32_t v = *(const uint32_t*)p;
+			return ef->swap ? bswap_32(v) : v;
+		}
+		default:
+		{
+			uint64_t v = *(const uint64_t*)p;
+			return ef->swap ? bswap_64(v) : v;
+		}
+	}
+}
+
+#define ELF_FIELD(ef, ptr, type, field) \
+	((ef)->is64 ? elf_val(ef, &((const Elf64_##type*)(ptr))->field, sizeof(((Elf64_##type*)0)->field)) \
+	            : elf_val(ef, &((const Elf32_##type*)(ptr))->field, sizeof(((Elf32_##type*)0)->field)))
+
+// translate a virtual address of a loaded segment to a file offset
+static int elf_vaddr2off(const struct elf_file* ef, const char* phdrs, int phnum, int phentsize, uint64_t vaddr, uint64_t* off)
+{
+	int i;
+
+	for (i = 0; i < phnum; i++)
+	{
+		const char* ph = phdrs + i * phentsize;
+		uint64_t start, filesz;
+
+		if (ELF_FIELD(ef, ph, Phdr, p_type) != PT_LOAD)
+			continue;
+		start  = ELF_FIELD(ef, ph, Phdr, p_vaddr);
+		filesz = ELF_FIELD(ef, ph, Phdr, p_filesz);
+		if (vaddr >= start && vaddr < start + filesz)
+		{
+			*off = vaddr - start + ELF_FIELD(ef, ph, Phdr, p_offset);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int newroot_find_lib(const struct newroot* nr, const char* name, char* path, size_t len)
+{
+	const char* dirs[] = { "/%s", "/usr/%s" };
+	char dir[32];
+	int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		snprintf(dir, sizeof(dir), dirs[i], nr->libdir);
+		snprintf(path, len, "%s/%s", dir, name);
+		if (access(path, F_OK) == 0)
+			return 0;
+	}
+	return -1;
+}
+
+// queue the program interpreter and all DT_NEEDED libraries of an ELF file
+static int newroot_add_deps(struct newroot* nr, const char* src, int required)
+{
+	unsigned char ehdr[sizeof(Elf64_Ehdr)];
+	struct elf_file ef;
+	char* phdrs = NULL;
+	char* dyn = NULL;
+	char* strtab = NULL;
+	int phnum, phentsize, i, ret = 0;
+	uint64_t dyn_off = 0, dyn_size = 0, strtab_addr = 0, strtab_size = 0, strtab_off;
+
+	ef.fd = open(src, O_RDONLY);
+	if (ef.fd < 0)
+		return 0;
+	if (pread(ef.fd, ehdr, sizeof(ehdr), 0) < (ssize_t)sizeof(Elf32_Ehdr)
+	 || memcmp(ehdr, ELFMAG, SELFMAG) != 0)
+	{
+		// no ELF file, nothing to resolve
+		close(ef.fd);
+		return 0;
+	}
+	ef.is64 = ehdr[EI_CLASS] == ELFCLASS64;
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	ef.swap = ehdr[EI_DATA] != ELFDATA2LSB;
+#else
+	ef.swap = ehdr[EI_DATA] != ELFDATA2MSB;
+#endif
+
+	phnum     = ELF_FIELD(&ef, ehdr, Ehdr, e_phnum);
+	phentsize = ELF_FIELD(&ef, ehdr, Ehdr, e_phentsize);
+	phdrs = malloc(phnum * phentsize);
+	if (!phdrs || pread(ef.fd, phdrs, phnum * phentsize, ELF_FIELD(&ef, ehdr, Ehdr, e_phoff)) != phnum * phentsize)
+		goto out;
+
+	for (i = 0; i < phnum; i++)
+	{
+		const char* ph = phdrs + i * phentsize;
+		uint64_t type = ELF_FIELD(&ef, ph, Phdr, p_type);
+
+		if (type == PT_INTERP)
+		{
+			char interp[PATH_MAX];
+			uint64_t size = ELF_FIELD(&ef, ph, Phdr, p_filesz);
+
+			if (size == 0 || size >= sizeof(interp)
+			 || pread(ef.fd, interp, size, ELF_FIELD(&ef, ph, Phdr, p_offset)) != (ssize_t)size)
+				continue;
+			interp[size] = '\0';
+			ret += newroot_add_path(nr, interp, NULL, required);
+		}
+		else if (type == PT_DYNAMIC)
+		{
+			dyn_off  = ELF_FIELD(&ef, ph, Phdr, p_offset);
+			dyn_size = ELF_FIELD(&ef, ph, Phdr, p_filesz);
+		}
+	}
+
+	if (!dyn_size)
+		goto out; // statically linked
+
+	dyn = malloc(dyn_size);
+	if (!dyn || pread(ef.fd, dyn, dyn_size, dyn_off) != (ssize_t)dyn_size)
+		goto out;
+
+	int dynentsize = ef.is64 ? sizeof(Elf64_Dyn) : sizeof(Elf32_Dyn);
+	for (i = 0; (i + 1) * dynentsize <= dyn_size; i++)
+	{
+		const char* d = dyn + i * dynentsize;
+		uint64_t tag = ELF_FIELD(&ef, d, Dyn, d_tag);
+
+		if (tag == DT_NULL)
+			break;
+		if (tag == DT_STRTAB)
+			strtab_addr = ELF_FIELD(&ef, d, Dyn, d_un.d_ptr);
+		else if (tag == DT_STRSZ)
+			strtab_size = ELF_FIELD(&ef, d, Dyn, d_un.d_val);
+	}
+
+	if (!strtab_addr || !strtab_size
+	 || elf_vaddr2off(&ef, phdrs, phnum, phentsize, strtab_addr, &strtab_off))
+		goto out;
+
+	strtab = malloc(strtab_size + 1);
+	if (!strtab || pread(ef.fd, strtab, strtab_size, strtab_off) != (ssize_t)strtab_size)
+		goto out;
+	strtab[strtab_size] = '\0';
+
+	for (i = 0; (i + 1) * dynentsize <= dyn_size; i++)
+	{
+		const char* d = dyn + i * dynentsize;
+		uint64_t tag = ELF_FIELD(&ef, d, Dyn, d_tag);
+		uint64_t name;
+		char path[PATH_MAX];
+
+		if (tag == DT_NULL)
+			break;
+		if (tag != DT_NEEDED)
+			continue;
+		name = ELF_FIELD(&ef, d, Dyn, d_un.d_val);
+		if (name >= strtab_size)
+			continue;
+		if (newroot_find_lib(nr, strtab + name, path, sizeof(path)))
+		{
+			my_printf("Warning: library %s needed by %s not found\n", strtab + name, src);
+			ret += required;
+			continue;
+		}
+		ret += newroot_add_path(nr, path, NULL, required);
+	}
+
+out:
+	free(strtab);
+	free(dyn);
+	free(phdrs);
+	close(ef.fd);
+	return ret;
+}
+
+// queue a file, symlink or directory and everything it depends on
+static int newroot_add_path(struct newroot* nr, const char* src, const char* dst_dir, int required)
+{
+	char dst[PATH_MAX];
+	struct stat st;
+	const char* base;
+	int ret = 0;
+
+	if (newroot_known(nr, src))
+		return 0;
+
+	base = strrchr(src, '/');
+	base = base ? base + 1 : src;
+	if (dst_dir)
+		snprintf(dst, sizeof(dst), "%s%s/%s", nr->root, dst_dir, base);
+	else
+		snprintf(dst, sizeof(dst), "%s%s", nr->root, src);
+
+	if (lstat(src, &st))
+	{
+		my_printf("Error: cannot stat %s\n", src);
+		return required;
+	}
+
+	if (S_ISLNK(st.st_mode))
+	{
+		char target[PATH_MAX];
+		char resolved[PATH_MAX];
+		ssize_t len;
+
+		len = readlink(src, target, sizeof(target) - 1);
+		if (len < 0)
+			return required;
+		target[len] = '\0';
+
+		// only remember the link, the target is queued below
+		newroot_queue(nr, src, "", 0);
+		mkdir_parents(dst);
+		unlink(dst);
+		if (symlink(target, dst))
+		{
+			my_printf("Error: cannot create symlink %s\n", dst);
+			return required;
+		}
+
+		if (target[0] == '/')
+			len = snprintf(resolved, sizeof(resolved), "%s", target);
+		else
+			len = snprintf(resolved, sizeof(resolved), "%.*s%s", (int)(base - src), src, target);
+		if (len >= (ssize_t)sizeof(resolved))
+		{
+			my_printf("Error: symlink target of %s too long\n", src);
+			return required;
+		}
+		return newroot_add_path(nr, resolved, dst_dir, required);
+	}
+
+	if (S_ISDIR(st.st_mode))
+	{
+		DIR* dir;
+		struct dirent* entry;
+		char sub_dst[PATH_MAX];
+
+		newroot_queue(nr, src, "", 0);
+		if (mkdir_recursive(dst))
+			return required;
+		dir = opendir(src);
+		if (!dir)
+			return required;
+		snprintf(sub_dst, sizeof(sub_dst), "%s", dst + strlen(nr->root));
+		while ((entry = readdir(dir)) != NULL)
+		{
+			char sub_src[PATH_MAX];
+
+			if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+				continue;
+			snprintf(sub_src, sizeof(sub_src), "%s/%s", src, entry->d_name);
+			ret += newroot_add_path(nr, sub_src, sub_dst, required);
+		}
+		closedir(dir);
+		return ret;
+	}
+
+	newroot_queue(nr, src, dst, required);
+	if (S_ISREG(st.st_mode))
+		ret += newroot_add_deps(nr, src, required);
+	return ret;
+}
+
+static int copy_file_data(int in, int out, off_t size)
+{
+	off_t done = 0;
+	ssize_t len;
+	char buf[16384];
+
+	// same filesystem: share the blocks
+	if (ioctl(out, FICLONE, in) == 0)
+		return 0;
+
+	while (done < size)
+	{
+		len = sendfile(out, in, NULL, size - done);
+		if (len <= 0)
+			break;
+		done += len;
+	}
+	if (done == size)
+		return 0;
+
+	// sendfile not supported: plain copy of the rest
+	while ((len = read(in, buf, sizeof(buf))) > 0)
+		if (write(out, buf, len) != len)
+			return -1;
+	return len;
+}
+
+static int newroot_copy_file(const struct newroot_file* f)
+{
+	struct stat st;
+	struct timeval times[2];
+	int in, out, ret;
+
+	in = open(f->src, O_RDONLY);
+	if (in < 0)
+		return -1;
+	if (fstat(in, &st) || mkdir_parents(f->dst))
+	{
+		close(in);
+		return -1;
+	}
+
+	unlink(f->dst);
+	out = open(f->dst, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+	if (out < 0)
+	{
+		close(in);
+		return -1;
+	}
+
+	ret = copy_file_data(in, out, st.st_size);
+
+	// preserve attributes like cp -a
+	if (fchown(out, st.st_uid, st.st_gid) || fchmod(out, st.st_mode & 07777))
+		ret = -1;
+	times[0].tv_sec  = st.st_atime;
+	times[0].tv_usec = 0;
+	times[1].tv_sec  = st.st_mtime;
+	times[1].tv_usec = 0;
+	futimes(out, times);
+
+	close(in);
+	if (close(out))
+		ret = -1;
+	return ret;
+}
+
+static void* newroot_copy_thread(void* arg)
+{
+	struct newroot* nr = arg;
+	int i;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&nr->lock);
+		i = nr->next++;
+		pthread_mutex_unlock(&nr->lock);
+		if (i >= nr->files_cnt)
+			break;
+
+		struct newroot_file* f = &nr->files[i];
+		if (f->dst[0] == '\0') // symlink or directory, already created
+			continue;
+		if (newroot_copy_file(f))
+		{
+			my_printf("Error copying %s: %s\n", f->src, strerror(errno));
+			pthread_mutex_lock(&nr->lock);
+			nr->failed += f->required;
+			pthread_mutex_unlock(&nr->lock);
+		}
+	}
+	return NULL;
+}
+
+int copy_newroot(const char* root, int multilib)
+{
+	struct newroot nr;
+	pthread_t threads[NEWROOT_THREADS];
+	int threads_cnt = 0;
+	int i, ret = 0;
+
+	memset(&nr, 0, sizeof(nr));
+	nr.root = root;
+	nr.libdir = multilib ? "lib64" : "lib";
+	pthread_mutex_init(&nr.lock, NULL);
+
+	// collect the files first: resolving is cheap, copying is not
+	for (i = 0; newroot_entries[i].pattern; i++)
+	{
+		const struct newroot_entry* e = &newroot_entries[i];
+		int required = !!(e->flags & NEWROOT_REQUIRED);
+		char pattern[PATH_MAX];
+		glob_t g;
+		size_t j;
+
+		snprintf(pattern, sizeof(pattern), e->pattern, nr.libdir);
+		if (glob(pattern, 0, NULL, &g))
+		{
+			if (required)
+			{
+				my_printf("Error: %s not found\n", pattern);
+				ret++;
+			}
+			continue;
+		}
+		for (j = 0; j < g.gl_pathc; j++)
+			ret += newroot_add_path(&nr, g.gl_pathv[j], e->flags & NEWROOT_TO_BIN ? "/bin" : NULL, required);
+		globfree(&g);
+	}
+
+	for (i = 0; i < NEWROOT_THREADS && i < nr.files_cnt; i++)
+	{
+		if (pthread_create(&threads[threads_cnt], NULL, newroot_copy_thread, &nr) == 0)
+			threads_cnt++;
+	}
+	// copy the remaining files in this thread if no worker could be started
+	newroot_copy_thread(&nr);
+	for (i = 0; i < threads_cnt; i++)
+		pthread_join(threads[i], NULL);
+	ret += nr.failed;
+
+	my_printf("Copied %d files to %s\n", nr.files_cnt, root);
+
+	for (i = 0; i < nr.files_cnt; i++)
+	{
+		free(nr.files[i].src);
+		free(nr.files[i].dst);
+	}
+	free(nr.files);
+	pthread_mutex_destroy(&nr.lock);
+
+	return ret == 0;
+}
@@ -13,6 +13,12 @@
 #include <mntent.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <libmtd.h>
+#include <telemetry.h>
+#include <tune.h>
+#include <logger.h>
 
 const char ofgwrite_version[] = "4.5.7";
 int flash_kernel  = 0;
@@ -20,10 +26,15 @@ int flash_rootfs  = 0;
 int no_write      = 0;
 int force_e2_stop = 0;
 int quiet         = 0;
+int jffs2_summary = 0;
+int parallel_flash = 0;
+int rehearse      = 0;
+int low_ram       = 0;
 int show_help     = 0;
 int newroot_mounted = 0;
 char kernel_filename[1000];
 char rootfs_filename[1000];
+char image_dir[4097];
 char rootfs_mount_point[1000];
 enum RootfsTypeEnum rootfs_type;
 int stop_e2_needed = 1;
@@ -34,32 +45,34 @@ struct struct_mountlist
 } *mountlist, *mountlist_entry;
 
 
+// print to console and syslog, done by the log thread
 void my_printf(char const *fmt, ...)
 {
-	va_list ap, ap2;
+	va_list ap;
 	va_start(ap, fmt);
-	va_copy(ap2, ap);
-	// print to console
-	vprintf(fmt, ap);
+	log_vprintf(stdout, fmt, ap);
 	va_end(ap);
-
-	// print to syslog
-	vsyslog(LOG_INFO, fmt, ap2);
-	va_end(ap2);
 }
 
 void my_fprintf(FILE * f, char const *fmt, ...)
 {
-	va_list ap, ap2;
+	va_list ap;
 	va_start(ap, fmt);
-	va_copy(ap2, ap);
-	// print to file (normally stdout or stderr)
-	vfprintf(f, fmt, ap);
+	log_vprintf(f, fmt, ap);
 	va_end(ap);
+}
+
+void close_log()
+{
+	log_stop();
+	closelog();
+}
 
-	// print to syslog
-	vsyslog(LOG_INFO, fmt, ap2);
-	va_end(ap2);
+// the log thread may still hold messages
+void reboot_box()
+{
+	log_flush();
+	reboot(LINUX_REBOOT_CMD_RESTART);
 }
 
 void printUsage()
@@ -73,8 +86,13 @@ void printUsage()
 	my_printf("   -rmtdy --rootfs=mtdy  use mtdy device for rootfs flashing\n");
 	my_printf("   -rmmcblkxpx --rootfs=mmcblkxpx  use mmcblkxpx device for rootfs flashing\n");
 	my_printf("   -mx --multi=x         flash multiboot partition x (x= 1, 2, 3,...). Only supported by some boxes.\n");
+	my_printf("   -mx,y,.. --multi=x,y  flash the image into several multiboot partitions (ext4 only)\n");
 	my_printf("   -n --nowrite          show only found image and mtd partitions (no write)\n");
+	my_printf("   -e --estimate         read and check the images without writing and estimate the flash time\n");
 	my_printf("   -f --force            force kill e2\n");
+	my_printf("   -s --summary          add erase block summary while flashing JFFS2 rootfs (faster first boot)\n");
+	my_printf("   -p --parallel         flash kernel and rootfs concurrently if they are on different devices\n");
+	my_printf("   -l --lowram           use small buffers and lock ofgwrite in RAM (automatic up to 256 MB RAM)\n");
 	my_printf("   -q --quiet            show less output\n");
 	my_printf("   -h --help             show help\n");
 }
@@ -100,6 +118,7 @@ int find_image_files(char* p)
 		path[strlen(path)+1] = '\0';
 		path[strlen(path)] = '/';
 	}
+	strcpy(image_dir, path);
 
 	d = opendir(path);
 
@@ -145,17 +164,56 @@ int find_image_files(char* p)
 	return 1;
 }
 
+// -m with a list of slots, e.g. -m2,3,4
+int read_multiboot_list(const char* list)
+{
+	const char* pos;
+	int i, slot;
+
+	flash_targets_cnt = 0;
+	for (pos = list; *pos != '\0'; pos++)
+	{
+		if (*pos == ',')
+			continue;
+		if (*pos < '1' || *pos > '9' || (pos[1] != ',' && pos[1] != '\0'))
+		{
+			my_printf("Error: Wrong multiboot partition list %s. Only values between 1 and 9 are allowed!\n", list);
+			return 0;
+		}
+		slot = *pos - '0';
+		for (i = 0; i < flash_targets_cnt; i++)
+			if (flash_targets[i].slot == slot)
+				break;
+		if (i < flash_targets_cnt)
+			continue;
+		memset(&flash_targets[flash_targets_cnt], 0, sizeof(flash_targets[0]));
+		flash_targets[flash_targets_cnt++].slot = slot;
+		my_printf("Flashing multiboot partition %d\n", slot);
+	}
+	if (flash_targets_cnt == 0)
+	{
+		my_printf("Error: Wrong multiboot partition list %s. Only values between 1 and 9 are allowed!\n", list);
+		return 0;
+	}
+	multiboot_partition = flash_targets[0].slot;
+	return 1;
+}
+
 int read_args(int argc, char *argv[])
 {
 	int option_index = 0;
 	int opt;
-	static const char *short_options = "k::r::nm:fqh";
+	static const char *short_options = "k::r::nem:fsplqh";
 	static const struct option long_options[] = {
 												{"kernel" , optional_argument, NULL, 'k'},
 												{"rootfs" , optional_argument, NULL, 'r'},
 												{"nowrite", no_argument      , NULL, 'n'},
+												{"estimate", no_argument     , NULL, 'e'},
 												{"multi"  , required_argument, NULL, 'm'},
 												{"force"  , no_argument      , NULL, 'f'},
+												{"summary", no_argument      , NULL, 's'},
+												{"parallel", no_argument     , NULL, 'p'},
+												{"lowram" , no_argument      , NULL, 'l'},
 												{"quiet"  , no_argument      , NULL, 'q'},
 												{"help"   , no_argument      , NULL, 'h'},
 												{NULL     , no_argument      , NULL,  0} };
@@ -198,7 +256,15 @@ int read_args(int argc, char *argv[])
 					my_printf("Flashing rootfs\n");
 				break;
 			case 'm':
-				if (optarg)
+				if (optarg && strchr(optarg, ',') != NULL)
+				{
+					if (!read_multiboot_list(optarg))
+					{
+						show_help = 1;
+						return 0;
+					}
+				}
+				else if (optarg)
 					if (strlen(optarg) == 1 && ((int)optarg[0] >= 49) && ((int)optarg[0] <= 57))
 					{
 						multiboot_partition = strtol(optarg, NULL, 10);
@@ -219,9 +285,22 @@ int read_args(int argc, char *argv[])
 			case 'n':
 				no_write = 1;
 				break;
+			case 'e':
+				no_write = 1;
+				rehearse = 1;
+				break;
 			case 'f':
 				force_e2_stop = 1;
 				break;
+			case 's':
+				jffs2_summary = 1;
+				break;
+			case 'p':
+				parallel_flash = 1;
+				break;
+			case 'l':
+				low_ram = 1;
+				break;
 			case 'q':
 				quiet = 1;
 				break;
@@ -267,179 +346,164 @@ int read_args(int argc, char *argv[])
 
 int read_mtd_file()
 {
-	FILE* f;
+	const struct mtd_proc_entry *mtd_table;
+	int mtd_cnt, i;
 
-	f = fopen("/proc/mtd", "r");
-	if (f == NULL)
-	{ 
-		perror("Error while opening /proc/mtd");
+	// /proc/mtd is parsed once by libmtd and cached for later lookups
+	mtd_cnt = mtd_get_proc_table(NULL, &mtd_table);
+	if (mtd_cnt < 0)
+	{
+		perror("Error while reading /proc/mtd");
 		// for testing try to open local mtd file
-		f = fopen("./mtd", "r");
-		if (f == NULL)
+		mtd_cnt = mtd_get_proc_table("./mtd", &mtd_table);
+		if (mtd_cnt < 0)
+		{
+			my_printf("Error: /proc/mtd has an invalid format\n");
 			return 0;
+		}
 	}
 
-	char line [1000];
 	char dev  [1000];
 	char size [1000];
 	char esize[1000];
 	char name [1000];
 	char dev_path[] = "/dev/";
-	int line_nr = 0;
 	unsigned long devsize;
 	int wrong_user_mtd = 0;
 
 	my_printf("Found /proc/mtd entries:\n");
 	my_printf("Device:   Size:     Erasesize:  Name:                   Image:\n");
-	while (fgets(line, 1000, f) != NULL)
+	for (i = 0; i < mtd_cnt; i++)
 	{
-		line_nr++;
-		if (line_nr == 1) // check header
+		sprintf(dev, "mtd%d", mtd_table[i].mtd_num);
+		sprintf(size, "%08llx", mtd_table[i].size);
+		sprintf(esize, "%08x", mtd_table[i].eb_size);
+		sprintf(name, "\"%s\"", mtd_table[i].name);
+		my_printf("%s: %12s %9s    %-18s", dev, size, esize, name);
+		devsize = mtd_table[i].size;
+		// user selected kernel
+		if (user_kernel && !strcmp(dev, kernel_device_arg))
 		{
-			sscanf(line, "%s%s%s%s", dev, size, esize, name);
-			if (strcmp(dev  , "dev:") != 0
-			 || strcmp(size , "size") != 0
-			 || strcmp(esize, "erasesize") != 0
-			 || strcmp(name , "name") != 0)
+			strcpy(&kernel_device[0], dev_path);
+			strcpy(&kernel_device[5], kernel_device_arg);
+			if (kernel_file_stat.st_size <= devsize)
 			{
-				my_printf("Error: /proc/mtd has an invalid format\n");
-				fclose(f);
-				return 0;
-			}
-		}
-		else
-		{
-			sscanf(line, "%s%s%s%s", dev, size, esize, name);
-			my_printf("%s %12s %9s    %-18s", dev, size, esize, name);
-			devsize = strtoul(size, 0, 16);
-			if (dev[strlen(dev)-1] == ':') // cut ':'
-				dev[strlen(dev)-1] = '\0';
-			// user selected kernel
-			if (user_kernel && !strcmp(dev, kernel_device_arg))
-			{
-				strcpy(&kernel_device[0], dev_path);
-				strcpy(&kernel_device[5], kernel_device_arg);
-				if (kernel_file_stat.st_size <= devsize)
+				if ((strcmp(name, "\"kernel\"") == 0
+					|| strcmp(name, "\"nkernel\"") == 0
+					|| strcmp(name, "\"kernel2\"") == 0))
 				{
-					if ((strcmp(name, "\"kernel\"") == 0
-						|| strcmp(name, "\"nkernel\"") == 0
-						|| strcmp(name, "\"kernel2\"") == 0))
-					{
-						if (kernel_filename[0] != '\0')
-							my_printf("  ->  %s <- User selected!!\n", kernel_filename);
-						else
-							my_printf("  <-  User selected!!\n");
-						found_kernel_device = 1;
-						kernel_flash_mode = MTD;
-					}
+					if (kernel_filename[0] != '\0')
+						my_printf("  ->  %s <- User selected!!\n", kernel_filename);
 					else
-					{
-						my_printf("  <-  Error: Selected by user is not a kernel mtd!!\n");
-						wrong_user_mtd = 1;
-					}
+						my_printf("  <-  User selected!!\n");
+					found_kernel_device = 1;
+					kernel_flash_mode = MTD;
 				}
 				else
 				{
-					my_printf("  <-  Error: Kernel file is bigger than device size!!\n");
+					my_printf("  <-  Error: Selected by user is not a kernel mtd!!\n");
 					wrong_user_mtd = 1;
 				}
 			}
-			// user selected rootfs
-			else if (user_rootfs && !strcmp(dev, rootfs_device_arg))
+			else
+			{
+				my_printf("  <-  Error: Kernel file is bigger than device size!!\n");
+				wrong_user_mtd = 1;
+			}
+		}
+		// user selected rootfs
+		else if (user_rootfs && !strcmp(dev, rootfs_device_arg))
+		{
+			strcpy(&rootfs_device[0], dev_path);
+			strcpy(&rootfs_device[5], rootfs_device_arg);
+			if (rootfs_file_stat.st_size <= devsize
+				&& strcmp(esize, "0001f000") != 0)
 			{
-				strcpy(&rootfs_device[0], dev_path);
-				strcpy(&rootfs_device[5], rootfs_device_arg);
-				if (rootfs_file_stat.st_size <= devsize
-					&& strcmp(esize, "0001f000") != 0)
+				if (strcmp(name, "\"rootfs\"") == 0
+					|| strcmp(name, "\"rootfs2\"") == 0)
 				{
-					if (strcmp(name, "\"rootfs\"") == 0
-						|| strcmp(name, "\"rootfs2\"") == 0)
-					{
-						if (rootfs_filename[0] != '\0')
-							my_printf("  ->  %s <- User selected!!\n", rootfs_filename);
-						else
-							my_printf("  <-  User selected!!\n");
-						found_rootfs_device = 1;
-						rootfs_flash_mode = MTD;
-					}
+					if (rootfs_filename[0] != '\0')
+						my_printf("  ->  %s <- User selected!!\n", rootfs_filename);
 					else
-					{
-						my_printf("  <-  Error: Selected by user is not a rootfs mtd!!\n");
-						wrong_user_mtd = 1;
-					}
-				}
-				else if (strcmp(esize, "0001f000") == 0)
-				{
-					my_printf("  <-  Error: Invalid erasesize\n");
-					wrong_user_mtd = 1;
+						my_printf("  <-  User selected!!\n");
+					found_rootfs_device = 1;
+					rootfs_flash_mode = MTD;
 				}
 				else
 				{
-					my_printf("  <-  Error: Rootfs file is bigger than device size!!\n");
+					my_printf("  <-  Error: Selected by user is not a rootfs mtd!!\n");
 					wrong_user_mtd = 1;
 				}
 			}
-			// auto kernel
-			else if (!user_kernel
-					&& (strcmp(name, "\"kernel\"") == 0
-						|| strcmp(name, "\"nkernel\"") == 0))
+			else if (strcmp(esize, "0001f000") == 0)
 			{
-				if (found_kernel_device)
-				{
-					my_printf("\n");
-					continue;
-				}
-				strcpy(&kernel_device[0], dev_path);
-				strcpy(&kernel_device[5], dev);
-				if (kernel_file_stat.st_size <= devsize)
-				{
-					if (kernel_filename[0] != '\0')
-						my_printf("  ->  %s\n", kernel_filename);
-					else
-						my_printf("\n");
-					found_kernel_device = 1;
-					kernel_flash_mode = MTD;
-				}
-				else
-					my_printf("  <-  Error: Kernel file is bigger than device size!!\n");
+				my_printf("  <-  Error: Invalid erasesize\n");
+				wrong_user_mtd = 1;
 			}
-			// auto rootfs
-			else if (!user_rootfs && strcmp(name, "\"rootfs\"") == 0)
+			else
 			{
-				if (found_rootfs_device)
-				{
-					my_printf("\n");
-					continue;
-				}
-				strcpy(&rootfs_device[0], dev_path);
-				strcpy(&rootfs_device[5], dev);
-				unsigned long devsize;
-				devsize = strtoul(size, 0, 16);
-				if (rootfs_file_stat.st_size <= devsize
-					&& strcmp(esize, "0001f000") != 0)
-				{
-					if (rootfs_filename[0] != '\0')
-						my_printf("  ->  %s\n", rootfs_filename);
-					else
-						my_printf("\n");
-					found_rootfs_device = 1;
-					rootfs_flash_mode = MTD;
-				}
-				else if (strcmp(esize, "0001f000") == 0)
-					my_printf("  <-  Error: Invalid erasesize\n");
+				my_printf("  <-  Error: Rootfs file is bigger than device size!!\n");
+				wrong_user_mtd = 1;
+			}
+		}
+		// auto kernel
+		else if (!user_kernel
+				&& (strcmp(name, "\"kernel\"") == 0
+					|| strcmp(name, "\"nkernel\"") == 0))
+		{
+			if (found_kernel_device)
+			{
+				my_printf("\n");
+				continue;
+			}
+			strcpy(&kernel_device[0], dev_path);
+			strcpy(&kernel_device[5], dev);
+			if (kernel_file_stat.st_size <= devsize)
+			{
+				if (kernel_filename[0] != '\0')
+					my_printf("  ->  %s\n", kernel_filename);
 				else
-					my_printf("  <-  Error: Rootfs file is bigger than device size!!\n");
+					my_printf("\n");
+				found_kernel_device = 1;
+				kernel_flash_mode = MTD;
 			}
 			else
+				my_printf("  <-  Error: Kernel file is bigger than device size!!\n");
+		}
+		// auto rootfs
+		else if (!user_rootfs && strcmp(name, "\"rootfs\"") == 0)
+		{
+			if (found_rootfs_device)
+			{
 				my_printf("\n");
+				continue;
+			}
+			strcpy(&rootfs_device[0], dev_path);
+			strcpy(&rootfs_device[5], dev);
+			unsigned long devsize;
+			devsize = strtoul(size, 0, 16);
+			if (rootfs_file_stat.st_size <= devsize
+				&& strcmp(esize, "0001f000") != 0)
+			{
+				if (rootfs_filename[0] != '\0')
+					my_printf("  ->  %s\n", rootfs_filename);
+				else
+					my_printf("\n");
+				found_rootfs_device = 1;
+				rootfs_flash_mode = MTD;
+			}
+			else if (strcmp(esize, "0001f000") == 0)
+				my_printf("  <-  Error: Invalid erasesize\n");
+			else
+				my_printf("  <-  Error: Rootfs file is bigger than device size!!\n");
 		}
+		else
+			my_printf("\n");
 	}
 
 	my_printf("Using kernel mtd device: %s\n", kernel_device);
 	my_printf("Using rootfs mtd device: %s\n", rootfs_device);
 
-	fclose(f);
-
 	if (wrong_user_mtd)
 	{
 		my_printf("Error: User selected mtd device cannot be used!\n");
@@ -449,24 +513,67 @@ int read_mtd_file()
 	return 1;
 }
 
-int kernel_flash(char* device, char* filename)
+int kernel_flash(struct flash_job* job)
 {
-	if (kernel_flash_mode == TARBZ2)
-		return flash_ext4_kernel(device, filename, kernel_file_stat.st_size, quiet, no_write);
-	else if (kernel_flash_mode == MTD)
-		return flash_ubi_jffs2_kernel(device, filename, quiet, no_write);
+	if (job->flash_mode == TARBZ2)
+		return flash_ext4_kernel(job->device, job->filename, job->file_size, job->quiet, job->no_write);
+	else if (job->flash_mode == MTD)
+		return flash_ubi_jffs2_kernel(job->device, job->filename, job->quiet, job->no_write);
+	return 0;
 }
 
-int rootfs_flash(char* device, char* filename)
+int rootfs_flash(struct flash_job* job)
 {
-	if (rootfs_flash_mode == TARBZ2)
-		return flash_ext4_rootfs(filename, quiet, no_write);
-	else if (rootfs_flash_mode == MTD)
+	if (job->flash_mode == TARBZ2)
+		return flash_ext4_rootfs(job->filename, job->rootfs_sub_dir, job->quiet, job->no_write);
+	else if (job->flash_mode == MTD)
 	{
-		if (rootfs_type == EXT4) // MTD rootfs with unknown format -> expect ubifs as only ubifs boxes support this
-			rootfs_type = UBIFS;
-		return flash_ubi_jffs2_rootfs(device, filename, rootfs_type, quiet, no_write);
+		if (job->rootfs_type == EXT4) // MTD rootfs with unknown format -> expect ubifs as only ubifs boxes support this
+			job->rootfs_type = UBIFS;
+		return flash_ubi_jffs2_rootfs(job->device, job->filename, job->rootfs_type, job->jffs2_summary, job->quiet, job->no_write);
 	}
+	return 0;
+}
+
+void init_flash_jobs(struct flash_job* kernel, struct flash_job* rootfs)
+{
+	memset(kernel, 0, sizeof(*kernel));
+	kernel->name       = "kernel";
+	kernel->device     = kernel_device;
+	kernel->filename   = kernel_filename;
+	kernel->file_size  = kernel_file_stat.st_size;
+	kernel->flash_mode = kernel_flash_mode;
+	kernel->quiet      = quiet;
+	kernel->no_write   = no_write;
+	kernel->flash      = kernel_flash;
+
+	memset(rootfs, 0, sizeof(*rootfs));
+	rootfs->name          = "rootfs";
+	rootfs->device        = rootfs_device;
+	rootfs->filename      = rootfs_filename;
+	rootfs->file_size     = rootfs_file_stat.st_size;
+	rootfs->flash_mode    = rootfs_flash_mode;
+	rootfs->rootfs_type   = rootfs_type;
+	rootfs->jffs2_summary = jffs2_summary;
+	// box with rootSubDir feature
+	rootfs->rootfs_sub_dir = current_rootfs_sub_dir[0] != '\0' && rootsubdir_check == 0 ? rootfs_sub_dir : "";
+	rootfs->quiet         = quiet;
+	rootfs->no_write      = no_write;
+	rootfs->flash         = rootfs_flash;
+}
+
+// Chooses the buffer sizes from the image with the most data and the eMMC
+// the images are written to
+void tune_buffers()
+{
+	char* image  = flash_rootfs ? rootfs_filename : kernel_filename;
+	char* target = NULL;
+
+	if (flash_kernel && kernel_flash_mode == TARBZ2)
+		target = kernel_device;
+	else if (flash_rootfs && rootfs_flash_mode == TARBZ2)
+		target = rootfs_device;
+	tune_probe(image, target, low_ram);
 }
 
 /* detect rootfs type
@@ -482,7 +589,14 @@ int readProcMounts()
 	int subdir_too = 1;
 	struct stat dummy_stat;
 
-	mountlist = NULL;
+	// libofgwrite reads the mounts for every job
+	while (mountlist != NULL)
+	{
+		mountlist_entry = mountlist->next;
+		free(mountlist->dir);
+		free(mountlist);
+		mountlist = mountlist_entry;
+	}
 	rootfs_type = UNKNOWN;
 	rootfs_mount_point[0] = '\0';
 
@@ -575,82 +689,105 @@ int readProcMounts()
 	return 1;
 }
 
-int exec_ps()
-{
-	// call ps
-	optind = 0; // reset getopt_long
-	char* argv[] = {
-		"ps",		// program name
-		NULL
-	};
-	int argc = (int)(sizeof(argv) / sizeof(argv[0])) - 1;
-
-	my_printf("Execute: ps\n");
-	if (ps_main(argc, argv) == 9999)
-	{
-		return 1; // e2 found
-	}
-	return 0; // e2 not found
-}
-
 int check_e2_stopped()
 {
 	int time = 0;
 	int max_time = 70;
-	int e2_found = 1;
+	pid_t e2_pid;
 
 	set_step_progress(0);
 	if (!quiet)
 		my_printf("Checking E2 is running...\n");
-	while (time < max_time && e2_found)
+	e2_pid = find_process("enigma2");
+	while (time < max_time && e2_pid)
 	{
-		e2_found = exec_ps();
-
-		if (!e2_found)
+		// returns as soon as E2 has exited, otherwise after one second
+		if (wait_process_exit(e2_pid, 1000))
 		{
-			if (!quiet)
-				my_printf("E2 is stopped\n");
-		}
-		else
-		{
-			sleep(2);
-			time += 2;
-			if (!quiet)
-				my_printf("E2 still running\n");
+			// E2 might have been restarted in the meantime, a restart
+			// counts against the timeout so a restart loop can't hang us
+			e2_pid = find_process("enigma2");
+			time++;
+			continue;
 		}
+		time++;
+		if (!quiet)
+			my_printf("E2 still running\n");
 		set_step_progress(time * 100 / max_time);
 	}
 
-	if (e2_found)
+	if (e2_pid)
 		return 0;
 
+	if (!quiet)
+		my_printf("E2 is stopped\n");
+	set_step_progress(100);
 	return 1;
 }
 
 int exec_fuser_kill()
 {
-	optind = 0; // reset getopt_long
-	char* argv[] = {
-		"fuser",		// program name
-		"-k",			// kill
-		"-m",			// mount point
-		"/oldroot/",	// rootfs
-		NULL
-	};
-	int argc = (int)(sizeof(argv) / sizeof(argv[0])) - 1;
+	pid_t* pids;
+	int cnt, remaining;
 
 	my_printf("Execute: fuser -k -m /oldroot/\n");
-	if (!no_write)
-		if (fuser_main(argc, argv) != 0)
-			return 0;
+	if (no_write)
+		return 1;
 
-	return 1;
+	cnt = fuser_mount_pids("/oldroot/", &pids);
+	if (cnt < 0)
+		return 0;
+	// SIGKILL is immediate, wait only until the processes are really gone
+	remaining = kill_pids_and_wait(pids, cnt, SIGKILL, 3000);
+	free(pids);
+	my_printf("fuser killed %d processes\n", cnt - remaining);
+
+	return remaining == 0;
+}
+
+// init u re-executes init from the new root, until then pid 1 keeps /oldroot busy
+int init_reexecuted(void* arg)
+{
+	const struct stat* oldroot_stat = arg;
+	struct stat init_stat;
+
+	return stat("/proc/1/exe", &init_stat) == 0 && init_stat.st_dev != oldroot_stat->st_dev;
+}
+
+extern int g_fbFd;
+
+// some boxes don't allow to open framebuffer while e2 is running
+int framebuffer_available(void* arg)
+{
+	if (g_fbFd >= 0)
+		close_framebuffer();
+	return init_framebuffer(*(int*)arg);
+}
+
+int umount_oldroot()
+{
+	int attempt;
+
+	umount("/oldroot/newroot");
+	for (attempt = 0; attempt < 3; attempt++)
+	{
+		// kill all remaining open processes which prevent umounting rootfs
+		if (exec_fuser_kill())
+			my_printf("fuser successful\n");
+		if (umount("/oldroot/") == 0)
+			return 0;
+		if (errno != EBUSY)
+			break;
+		my_printf("/oldroot still busy\n");
+	}
+	return -1;
 }
 
 int daemonize()
 {
 	// Prevents that ofgwrite will be killed when init 1 is performed
 	my_printf("daemonize\n");
+	log_flush();
 
 	pid_t pid = fork();
 	if (pid < 0)
@@ -683,6 +820,8 @@ int daemonize()
 	}
 
 	umask(0);
+	// the log thread of the parent is gone
+	log_restart();
 	my_printf(" successful\n");
 	return 1;
 }
@@ -728,9 +867,9 @@ int umount_rootfs(int steps)
 	}
 
 	// create maybe needed directory for image files mountpoint
-	char path[1000];
-	snprintf(path, sizeof(path), "mkdir -p /newroot/%s", rootfs_mount_point);
-	ret += system(path);
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "/newroot/%s", rootfs_mount_point);
+	ret += mkdir_recursive(path);
 
 	if (ret != 0)
 	{
@@ -738,93 +877,15 @@ int umount_rootfs(int steps)
 		return 0;
 	}
 
-	// we need init and libs to be able to exec init u later
-	if (multilib)
-	{
-		ret =  system("cp -arf /bin/busybox*     /newroot/bin");
-		ret += system("cp -arf /bin/sh*          /newroot/bin");
-		ret += system("cp -arf /bin/bash*        /newroot/bin");
-		ret += system("cp -arf /sbin/init*       /newroot/sbin");
-		ret += system("cp -arf /lib64/libc*        /newroot/lib64");
-		ret += system("cp -arf /lib64/ld*          /newroot/lib64");
-		ret += system("cp -arf /lib64/libtinfo*    /newroot/lib64");
-		ret += system("cp -arf /lib64/libdl*       /newroot/lib64");
-	}
-	else
-	{
-		ret =  system("cp -arf /bin/busybox*     /newroot/bin");
-		ret += system("cp -arf /bin/sh*          /newroot/bin");
-		ret += system("cp -arf /bin/bash*        /newroot/bin");
-		ret += system("cp -arf /sbin/init*       /newroot/sbin");
-		ret += system("cp -arf /lib/libc*        /newroot/lib");
-		ret += system("cp -arf /lib/ld*          /newroot/lib");
-		ret += system("cp -arf /lib/libtinfo*    /newroot/lib");
-		ret += system("cp -arf /lib/libdl*       /newroot/lib");
-	}
-
-	if (ret != 0)
+	// copy init, shell, autofs and all libs they need
+	if (!copy_newroot("/newroot", multilib))
 	{
 		my_printf("Error copying binary and libs\n");
 		return 0;
 	}
 
-	// libcrypt is moved from /lib to /usr/libX in new OE versions
-	if (multilib)
-	{
-		ret = system("cp -arf /lib64/libcrypt*    /newroot/lib64");
-		if (ret != 0)
-		{
-			ret = system("cp -arf /usr/lib64/libcrypt*    /newroot/usr/lib64");
-			if (ret != 0)
-			{
-				my_printf("Error copying libcrypto lib\n");
-				return 0;
-			}
-		}
-	}
-	else
-	{
-		ret = system("cp -arf /lib/libcrypt*    /newroot/lib");
-		if (ret != 0)
-		{
-			ret = system("cp -arf /usr/lib/libcrypt*    /newroot/usr/lib");
-			if (ret != 0)
-			{
-				my_printf("Error copying libcrypto lib\n");
-				return 0;
-			}
-		}
-	}
-
-	// copy for automount ignore errors as autofs is maybe not installed
-	if (multilib)
-	{
-		ret = system("cp -arf /usr/sbin/autom*  /newroot/bin");
-		ret += system("cp -arf /etc/auto*        /newroot/etc");
-		ret += system("cp -arf /lib64/libpthread*  /newroot/lib64");
-		ret += system("cp -arf /lib64/libnss*      /newroot/lib64");
-		ret += system("cp -arf /lib64/libnsl*      /newroot/lib64");
-		ret += system("cp -arf /lib64/libresolv*   /newroot/lib64");
-		ret += system("cp -arf /lib64/librt*       /newroot/lib64");
-		ret += system("cp -arf /usr/lib64/libtirp* /newroot/usr/lib64");
-		ret += system("cp -arf /usr/lib64/autofs/* /newroot/usr/lib64/autofs");
-		ret += system("cp -arf /etc/nsswitch*    /newroot/etc");
-		ret += system("cp -arf /etc/resolv*      /newroot/etc");
-	}
-	else
-	{
-		ret = system("cp -arf /usr/sbin/autom*  /newroot/bin");
-		ret += system("cp -arf /etc/auto*        /newroot/etc");
-		ret += system("cp -arf /lib/libpthread*  /newroot/lib");
-		ret += system("cp -arf /lib/libnss*      /newroot/lib");
-		ret += system("cp -arf /lib/libnsl*      /newroot/lib");
-		ret += system("cp -arf /lib/libresolv*   /newroot/lib");
-		ret += system("cp -arf /lib/librt*       /newroot/lib");
-		ret += system("cp -arf /usr/lib/libtirp* /newroot/usr/lib");
-		ret += system("cp -arf /usr/lib/autofs/* /newroot/usr/lib/autofs");
-		ret += system("cp -arf /etc/nsswitch*    /newroot/etc");
-		ret += system("cp -arf /etc/resolv*      /newroot/etc");
-	}
+	// decompress and validate the image while E2 shuts down
+	prefetch_start(rootfs_filename, "/newroot", rootfs_flash_mode == TARBZ2);
 
 	// Switch to user mode 1
 	my_printf("Switching to user mode 2\n");
@@ -840,7 +901,10 @@ int umount_rootfs(int steps)
 	// it can take several seconds until E2 is shut down
 	// wait because otherwise remounting read only is not possible
 	set_step("Wait until E2 is stopped");
-	if (!check_e2_stopped())
+	phase_begin("Stop E2");
+	ret = check_e2_stopped();
+	phase_end(ret);
+	if (!ret)
 	{
 		my_printf("Error E2 can't be stopped! Abort flashing.\n");
 		set_error_text("Error E2 can't be stopped! Abort flashing.");
@@ -848,14 +912,11 @@ int umount_rootfs(int steps)
 		return 0;
 	}
 
-	// some boxes don't allow to open framebuffer while e2 is running
 	// reopen framebuffer to show the GUI
-	close_framebuffer();
-	init_framebuffer(steps);
+	phase_wait("Framebuffer", framebuffer_available, &steps, 2000);
 	show_main_window(1, ofgwrite_version);
 	set_overall_text("Flashing image");
 	set_step_without_incr("Wait until E2 is stopped");
-	sleep(2);
 
 	ret = pivot_root("/newroot/", "oldroot");
 	if (ret)
@@ -867,6 +928,9 @@ int umount_rootfs(int steps)
 		return 0;
 	}
 
+	// the old rootfs is unmounted now, code must not be paged in from it
+	tune_lock_memory();
+
 	ret = chdir("/");
 	// move mounts to new root
 	ret =  mount("/oldroot/dev/", "dev/", NULL, MS_MOVE, NULL);
@@ -881,7 +945,7 @@ int umount_rootfs(int steps)
 		set_error_text1("Error move mounts to newroot. Abort flashing!");
 		set_error_text2("Rebooting in 30 seconds!");
 		sleep(30);
-		reboot(LINUX_REBOOT_CMD_RESTART);
+		reboot_box();
 		return 0;
 	}
 	ret = mount("/oldroot/media/", "media/", NULL, MS_MOVE, NULL);  // ignore return value
@@ -923,17 +987,14 @@ int umount_rootfs(int steps)
 	}
 
 	// restart init process
+	struct stat oldroot_stat;
 	ret = system("exec init u");
-	sleep(3);
-
-	// kill all remaining open processes which prevent umounting rootfs
-	ret = exec_fuser_kill();
-	if (!ret)
-		my_printf("fuser successful\n");
-	sleep(3);
+	if (stat("/oldroot/", &oldroot_stat) == 0)
+		phase_wait("init u", init_reexecuted, &oldroot_stat, 3000);
 
-	ret = umount("/oldroot/newroot");
-	ret = umount("/oldroot/");
+	phase_begin("Umount rootfs");
+	ret = umount_oldroot();
+	phase_end(ret == 0);
 	if (!ret)
 		my_printf("umount successful\n");
 	else
@@ -951,7 +1012,7 @@ int umount_rootfs(int steps)
 			set_error_text1("Error remounting root! Abort flashing.");
 			set_error_text2("Rebooting in 30 seconds");
 			sleep(30);
-			reboot(LINUX_REBOOT_CMD_RESTART);
+			reboot_box();
 			return 0;
 		}
 	}
@@ -964,7 +1025,7 @@ int umount_rootfs(int steps)
 			set_error_text1("Error remounting root ro! Abort flashing.");
 			set_error_text2("Rebooting in 30 seconds");
 			sleep(30);
-			reboot(LINUX_REBOOT_CMD_RESTART);
+			reboot_box();
 			return 0;
 		}
 	}
@@ -1074,19 +1135,23 @@ void find_kernel_rootfs_device()
 	{
 		found_kernel_device = 0;
 		found_rootfs_device = 0;
-		// get kernel/rootfs from fdisk
-		// call fdisk -l
-		optind = 0; // reset getopt_long
-		char* argv[] = {
-			"fdisk",		// program name
-			"-l",			// list
-			NULL
-		};
-		int argc = (int)(sizeof(argv) / sizeof(argv[0])) - 1;
-
-		my_printf("Execute: fdisk -l\n");
-		if (fdisk_main(argc, argv) != 0)
-			return;
+		// get kernel/rootfs from partition names in sysfs
+		if (!find_named_partitions())
+		{
+			// kernel doesn't export partition names -> read partition tables
+			// call fdisk -l
+			optind = 0; // reset getopt_long
+			char* argv[] = {
+				"fdisk",		// program name
+				"-l",			// list
+				NULL
+			};
+			int argc = (int)(sizeof(argv) / sizeof(argv[0])) - 1;
+
+			my_printf("Execute: fdisk -l\n");
+			if (fdisk_main(argc, argv) != 0)
+				return;
+		}
 	}
 
 	if (!found_kernel_device && mtd_kernel_found)
@@ -1179,6 +1244,211 @@ int check_device_size()
 	return 1;
 }
 
+// finds kernel and rootfs device of the selected multiboot partition
+int find_devices()
+{
+	read_mtd_file();
+	if (!found_kernel_device || !found_rootfs_device)
+		find_kernel_rootfs_device();
+
+	if (flash_kernel && (!found_kernel_device || kernel_filename[0] == '\0'))
+	{
+		my_printf("Error: Cannot flash kernel");
+		if (!found_kernel_device)
+			my_printf(", because no kernel device was found\n");
+		else
+			my_printf(", because no kernel file was found\n");
+		return 0;
+	}
+
+	if (flash_rootfs && (!found_rootfs_device || rootfs_filename[0] == '\0' || rootfs_type == UNKNOWN))
+	{
+		my_printf("Error: Cannot flash rootfs");
+		if (!found_rootfs_device)
+			my_printf(", because no rootfs device was found\n");
+		else if (rootfs_filename[0] == '\0')
+			my_printf(", because no rootfs file was found\n");
+		else
+			my_printf(", because rootfs type is unknown\n");
+		return 0;
+	}
+
+	return check_device_size();
+}
+
+// makes the devices of a multiboot target the current ones
+void select_target(struct flash_target* target)
+{
+	multiboot_partition = target->slot;
+	strcpy(kernel_device, target->kernel_device);
+	strcpy(rootfs_device, target->rootfs_device);
+	strcpy(rootfs_sub_dir, target->rootfs_sub_dir);
+	kernel_flash_mode = target->kernel_flash_mode;
+	rootfs_flash_mode = target->rootfs_flash_mode;
+}
+
+// finds the devices of every multiboot partition given by -m
+int find_target_devices()
+{
+	struct flash_target* t;
+	struct flash_target* primary = &flash_targets[0];
+	int running = 0;
+	int i, j;
+
+	for (i = 0; i < flash_targets_cnt; i++)
+	{
+		t = &flash_targets[i];
+		my_printf("Searching devices of multiboot partition %d\n", t->slot);
+		multiboot_partition = t->slot;
+		found_kernel_device = 0;
+		found_rootfs_device = 0;
+		kernel_flash_mode = FLASH_MODE_UNKNOWN;
+		rootfs_flash_mode = FLASH_MODE_UNKNOWN;
+		rootfs_sub_dir[0] = '\0';
+		stop_e2_needed = 1;
+		if (!find_devices())
+			return 0;
+		if (flash_rootfs && rootfs_flash_mode != TARBZ2)
+		{
+			my_printf("Error: Several multiboot partitions can only be flashed with ext4 rootfs\n");
+			return 0;
+		}
+
+		strcpy(t->kernel_device, kernel_device);
+		strcpy(t->rootfs_device, rootfs_device);
+		strcpy(t->rootfs_sub_dir, rootfs_sub_dir);
+		t->kernel_flash_mode = kernel_flash_mode;
+		t->rootfs_flash_mode = rootfs_flash_mode;
+		t->running = stop_e2_needed;
+		if (t->running && !primary->running)
+			primary = t;
+		running |= t->running;
+
+		for (j = 0; j < i; j++)
+		{
+			if ((flash_kernel && strcmp(flash_targets[j].kernel_device, t->kernel_device) == 0)
+			 || (flash_rootfs && strcmp(flash_targets[j].rootfs_device, t->rootfs_device) == 0
+			                  && strcmp(flash_targets[j].rootfs_sub_dir, t->rootfs_sub_dir) == 0))
+			{
+				my_printf("Error: Multiboot partitions %d and %d use the same device\n", flash_targets[j].slot, t->slot);
+				return 0;
+			}
+		}
+	}
+
+	// the running (or first) partition is mounted like a single one, the
+	// others need an own mount point unless they share its device
+	for (i = 0; i < flash_targets_cnt; i++)
+	{
+		t = &flash_targets[i];
+		if (strcmp(t->rootfs_device, primary->rootfs_device) == 0)
+			strcpy(t->mount_point, "/oldroot_remount");
+		else
+			sprintf(t->mount_point, "/oldroot_remount%d", t->slot);
+	}
+
+	stop_e2_needed = running;
+	select_target(primary);
+	return 1;
+}
+
+// mounts an ext4 rootfs device, formats it if it isn't formatted yet
+int mount_rootfs(const char* device, const char* dir)
+{
+	int ret;
+
+	mkdir(dir, 777);
+	ret = mount(device, dir, "ext4", 0, NULL);
+	if (!ret)
+		my_printf("Mount to %s successful\n", dir);
+	else if (errno == EINVAL)
+	{
+		// most likely partition is not formatted -> format it
+		char mkfs_cmd[100];
+		sprintf(mkfs_cmd, "mkfs.ext4 %s", device);
+		my_printf("Formatting %s\n", device);
+		ret = system(mkfs_cmd);
+		if (!ret)
+		{ // try to mount it again
+			ret = mount(device, dir, "ext4", 0, NULL);
+			if (!ret)
+				my_printf("Mount to %s successful\n", dir);
+		}
+	}
+	return ret == 0;
+}
+
+// mounts the multiboot partitions which don't use /oldroot_remount
+int mount_targets()
+{
+	int i;
+
+	for (i = 0; i < flash_targets_cnt; i++)
+		if (strcmp(flash_targets[i].mount_point, "/oldroot_remount") != 0
+		 && !mount_rootfs(flash_targets[i].rootfs_device, flash_targets[i].mount_point))
+			return 0;
+	return 1;
+}
+
+void umount_targets()
+{
+	int i;
+
+	for (i = 0; i < flash_targets_cnt; i++)
+		if (strcmp(flash_targets[i].mount_point, "/oldroot_remount") != 0)
+		{
+			umount(flash_targets[i].mount_point);
+			rmdir(flash_targets[i].mount_point);
+		}
+}
+
+// flashes kernel and rootfs into every multiboot partition given by -m,
+// a failing partition doesn't stop the others
+int flash_targets_all()
+{
+	struct flash_job jobs[2];
+	int ret = 1;
+	int i;
+
+	if (flash_kernel)
+	{
+		for (i = 0; i < flash_targets_cnt; i++)
+		{
+			select_target(&flash_targets[i]);
+			init_flash_jobs(&jobs[0], &jobs[1]);
+			my_printf("Flashing kernel of multiboot partition %d ...\n", flash_targets[i].slot);
+			flash_targets[i].kernel_result = kernel_flash(&jobs[0]);
+			if (!flash_targets[i].kernel_result)
+			{
+				my_printf("Error flashing kernel of multiboot partition %d\n", flash_targets[i].slot);
+				ret = 0;
+			}
+		}
+		sync();
+	}
+
+	if (flash_rootfs && !flash_ext4_rootfs_targets(rootfs_filename, flash_targets, flash_targets_cnt, quiet, no_write))
+		ret = 0;
+
+	for (i = 0; i < flash_targets_cnt; i++)
+		my_printf("Multiboot partition %d: kernel %s, rootfs %s\n", flash_targets[i].slot,
+			!flash_kernel ? "skipped" : flash_targets[i].kernel_result ? "ok" : "failed",
+			!flash_rootfs ? "skipped" : flash_targets[i].rootfs_result ? "ok" : "failed");
+	return ret;
+}
+
+#ifdef OFGWRITE_LIB
+// The host process must survive fatal busybox errors: tar_extract() or the
+// library call fails instead. Forked children of the library end.
+void handle_busybox_fatal_error()
+{
+	my_printf("Error: fatal error in busybox code!\n");
+	set_error_text1("Fatal error. Abort flashing.");
+	tar_extract_abort();
+	ofgwrite_lib_abort();
+	_exit(EXIT_FAILURE);
+}
+#else
 void handle_busybox_fatal_error()
 {
 	my_printf("Error flashing rootfs! System won't boot. Please flash backup! System will reboot in 60 seconds\n");
@@ -1187,13 +1457,16 @@ void handle_busybox_fatal_error()
 	if (stop_e2_needed)
 	{
 		sleep(60);
-		reboot(LINUX_REBOOT_CMD_RESTART);
+		reboot_box();
 	}
 	sleep(30);
 	close_framebuffer();
 	exit(EXIT_FAILURE);
 }
+#endif
 
+// libofgwrite is built from the same file without main()
+#ifndef OFGWRITE_LIB
 int main(int argc, char *argv[])
 {
 	// Check if running on a box or on a PC. Stop working on PC to prevent overwriting important files
@@ -1212,6 +1485,7 @@ int main(int argc, char *argv[])
 	my_printf("Don't use it if you use multiple ubi volumes in ubi layer!\n\n");
 
 	int ret;
+	struct flash_job jobs[2];
 	found_kernel_device = 0;
 	found_rootfs_device = 0;
 	kernel_flash_mode = FLASH_MODE_UNKNOWN;
@@ -1225,42 +1499,33 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	// the log file is written next to the images
+	log_start(image_dir);
+
 	// set rootfs type and more
 	if (!readProcMounts())
 		return EXIT_FAILURE;
 
 	// find kernel and rootfs devices
 	my_printf("\n");
-	read_mtd_file();
-	if (!found_kernel_device || !found_rootfs_device)
-		find_kernel_rootfs_device();
-
-	if (flash_kernel && (!found_kernel_device || kernel_filename[0] == '\0'))
+	if (flash_targets_cnt > 1)
 	{
-		my_printf("Error: Cannot flash kernel");
-		if (!found_kernel_device)
-			my_printf(", because no kernel device was found\n");
-		else
-			my_printf(", because no kernel file was found\n");
-		return EXIT_FAILURE;
-	}
-
-	if (flash_rootfs && (!found_rootfs_device || rootfs_filename[0] == '\0' || rootfs_type == UNKNOWN))
-	{
-		my_printf("Error: Cannot flash rootfs");
-		if (!found_rootfs_device)
-			my_printf(", because no rootfs device was found\n");
-		else if (rootfs_filename[0] == '\0')
-			my_printf(", because no rootfs file was found\n");
-		else
-			my_printf(", because rootfs type is unknown\n");
-		return EXIT_FAILURE;
+		if (!find_target_devices())
+			return EXIT_FAILURE;
 	}
-
-	if (!check_device_size())
+	else if (!find_devices())
 		return EXIT_FAILURE;
 
 	my_printf("\n");
+	tune_buffers();
+
+	if (rehearse)
+	{
+		init_flash_jobs(&jobs[0], &jobs[1]);
+		ret = rehearse_flash(flash_kernel ? &jobs[0] : NULL, flash_rootfs ? &jobs[1] : NULL, flash_targets_cnt > 1 ? flash_targets_cnt : 1);
+		close_log();
+		return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
 
 	if (flash_kernel && !flash_rootfs) // flash only kernel
 	{
@@ -1271,7 +1536,10 @@ int main(int argc, char *argv[])
 		show_main_window(0, ofgwrite_version);
 		set_overall_text("Flashing kernel");
 
-		if (!kernel_flash(kernel_device, kernel_filename))
+		init_flash_jobs(&jobs[0], &jobs[1]);
+		if (flash_targets_cnt > 1 && !flash_targets_all())
+			ret = EXIT_FAILURE;
+		else if (flash_targets_cnt <= 1 && !kernel_flash(&jobs[0]))
 			ret = EXIT_FAILURE;
 		else
 			ret = EXIT_SUCCESS;
@@ -1280,6 +1548,7 @@ int main(int argc, char *argv[])
 		{
 			my_printf("done\n");
 			set_step("Successfully flashed kernel!");
+			telemetry_write(image_dir, 1);
 			sleep(5);
 		}
 		else if (ret == EXIT_FAILURE)
@@ -1287,9 +1556,10 @@ int main(int argc, char *argv[])
 			my_printf("failed. System won't boot. Please flash backup!\n");
 			set_error_text1("Error flashing kernel. System won't boot!");
 			set_error_text2("Please flash backup! Go back to E2 in 60 sec");
+			telemetry_write(image_dir, 0);
 			sleep(60);
 		}
-		closelog();
+		close_log();
 		close_framebuffer();
 		return ret;
 	}
@@ -1301,7 +1571,7 @@ int main(int argc, char *argv[])
 		// Check whether /newroot exists and is mounted as tmpfs
 		if (!check_env())
 		{
-			closelog();
+			close_log();
 			return EXIT_FAILURE;
 		}
 
@@ -1310,6 +1580,8 @@ int main(int argc, char *argv[])
 			steps+= 2;
 		else if (flash_kernel && rootfs_flash_mode == TARBZ2)
 			steps+= 1;
+		if (flash_kernel && flash_targets_cnt > 1)
+			steps+= flash_targets_cnt - 1;
 		init_framebuffer(steps);
 		show_main_window(0, ofgwrite_version);
 		set_overall_text("Flashing image");
@@ -1318,102 +1590,139 @@ int main(int argc, char *argv[])
 		// kill nmbd, smbd, rpc.mountd and rpc.statd -> otherwise remounting root read-only is not possible
 		if (!no_write && stop_e2_needed)
 		{
-			ret = system("killall nmbd");
-			ret = system("killall smbd");
-			ret = system("killall rpc.mountd");
-			ret = system("killall rpc.statd");
-			ret = system("/etc/init.d/softcam stop");
-			ret = system("killall CCcam");
-			ret = system("pkill -9 -f '[Oo][Ss][Cc][Aa][Mm]'");
-			ret = system("ps w | grep -i oscam | grep -v grep | awk '{print $1}'| xargs kill -9");
-			ret = system("pkill -9 -f '[Ww][Ii][Cc][Aa][Rr][Dd][Dd]'");
-			ret = system("ps w | grep -i wicardd | grep -v grep | awk '{print $1}'| xargs kill -9");
-			ret = system("killall kodi.bin");
-			ret = system("killall hddtemp");
-			ret = system("killall transmission-daemon");
-			ret = system("killall openvpn");
-			ret = system("/etc/init.d/sabnzbd stop");
-			ret = system("pkill -9 -f cihelper");
-			ret = system("pkill -9 -f ciplus_helper");
-			ret = system("pkill -9 -f ciplushelper");
-			// kill VMC
-			ret = system("pkill -f vmc.sh");
-			ret = system("pkill -f DBServer.py");
-			// stop autofs
-			ret = system("/etc/init.d/autofs stop");
-			// ignore return values, because the processes might not run
+			phase_begin("Kill processes");
+			phase_end(kill_processes());
 		}
 
 		// sync filesystem
 		my_printf("Syncing filesystem\n");
 		set_step("Syncing filesystem");
 		sync();
-		sleep(1);
+		phase_wait("Sync", writeback_done, NULL, 1000);
 
 		set_step("init 2");
 		if (!no_write && stop_e2_needed)
 		{
 			if (!daemonize())
 			{
-				closelog();
+				close_log();
 				close_framebuffer();
 				return EXIT_FAILURE;
 			}
 			if (!umount_rootfs(steps))
 			{
-				closelog();
+				close_log();
 				close_framebuffer();
 				return EXIT_FAILURE;
 			}
+			// umount_rootfs() started the prefetch, after pivot_root the
+			// staged image is in /
+			if (prefetch_finish("/", rootfs_filename, sizeof(rootfs_filename)) == PREFETCH_INVALID)
+			{
+				my_printf("Error rootfs image is corrupt! Nothing was flashed. System will reboot in 60 seconds\n");
+				set_error_text1("Image is corrupt. Nothing was flashed!");
+				set_error_text2("Please check image! Rebooting in 60 sec");
+				telemetry_write(image_dir, 0);
+				sleep(60);
+				reboot_box();
+				return EXIT_FAILURE;
+			}
 		}
 		// if not running rootfs is flashed then we need to mount it before start flashing
 		if (!no_write && !stop_e2_needed && rootfs_flash_mode == TARBZ2)
 		{
 			set_step("Mount rootfs");
-			mkdir("/oldroot_remount", 777);
 			// mount rootfs device
-			ret = mount(rootfs_device, "/oldroot_remount/", "ext4", 0, NULL);
-			if (!ret)
-				my_printf("Mount to /oldroot_remount/ successful\n");
-			else if (errno == EINVAL)
+			if (!mount_rootfs(rootfs_device, "/oldroot_remount"))
 			{
-				// most likely partition is not formatted -> format it
-				char mkfs_cmd[100];
-				sprintf(mkfs_cmd, "mkfs.ext4 %s", rootfs_device);
-				my_printf("Formatting %s\n", rootfs_device);
-				ret = system(mkfs_cmd);
-				if (!ret)
-				{ // try to mount it again
-					ret = mount(rootfs_device, "/oldroot_remount/", "ext4", 0, NULL);
-					if (!ret)
-						my_printf("Mount to /oldroot_remount/ successful\n");
+				my_printf("Error remounting root! Abort flashing.\n");
+				set_error_text1("Error mounting root! Abort flashing.");
+				sleep(3);
+				close_framebuffer();
+				return EXIT_FAILURE;
+			}
+		}
+
+		// further multiboot partitions on other devices
+		if (!no_write && flash_targets_cnt > 1 && !mount_targets())
+		{
+			my_printf("Error mounting multiboot partitions! Abort flashing.\n");
+			set_error_text1("Error mounting root! Abort flashing.");
+			telemetry_write(image_dir, 0);
+			if (stop_e2_needed)
+			{
+				sleep(60);
+				reboot_box();
+			}
+			sleep(3);
+			close_framebuffer();
+			return EXIT_FAILURE;
+		}
+
+		init_flash_jobs(&jobs[0], &jobs[1]);
+		if (flash_targets_cnt > 1)
+		{
+			if (!flash_targets_all())
+			{
+				my_printf("Error flashing multiboot partitions! Please flash backup! System will reboot in 60 seconds\n");
+				set_error_text1("Error flashing multiboot partitions!");
+				set_error_text2("Please flash backup! Rebooting in 60 sec");
+				telemetry_write(image_dir, 0);
+				umount_targets();
+				if (stop_e2_needed)
+				{
+					sleep(60);
+					reboot_box();
 				}
+				sleep(3);
+				close_framebuffer();
+				return EXIT_FAILURE;
 			}
-			if (ret)
+			jobs[0].result = 1;
+			jobs[1].result = 1;
+		}
+		else if (flash_kernel && parallel_flash && independent_devices(kernel_device, rootfs_device))
+		{
+			my_printf("Flashing kernel and rootfs concurrently ...\n");
+			telemetry_step("Writing kernel and rootfs");
+			set_step_without_incr("Writing kernel and rootfs");
+			if (!flash_jobs_concurrent(jobs, 2))
 			{
-				my_printf("Error remounting root! Abort flashing.\n");
-				set_error_text1("Error mounting root! Abort flashing.");
+				my_printf("Error flashing %s! System won't boot. Please flash backup! System will reboot in 60 seconds\n", jobs[0].result ? "rootfs" : "kernel");
+				set_error_text1(jobs[0].result ? "Error flashing rootfs. System won't boot!" : "Error flashing kernel. System won't boot!");
+				set_error_text2("Please flash backup! Rebooting in 60 sec");
+				telemetry_write(image_dir, 0);
+				if (stop_e2_needed)
+				{
+					sleep(60);
+					reboot_box();
+				}
 				sleep(3);
 				close_framebuffer();
 				return EXIT_FAILURE;
 			}
+			sync();
+			my_printf("Successfully flashed kernel!\n");
 		}
+		else if (parallel_flash && flash_kernel)
+			my_printf("Kernel and rootfs share a device, flashing them in sequence\n");
 
 		//Flash kernel
-		if (flash_kernel)
+		if (flash_kernel && !jobs[0].result)
 		{
 			if (!quiet)
 				my_printf("Flashing kernel ...\n");
 
-			if (!kernel_flash(kernel_device, kernel_filename))
+			if (!kernel_flash(&jobs[0]))
 			{
 				my_printf("Error flashing kernel. System won't boot. Please flash backup! Starting E2 in 60 seconds\n");
 				set_error_text1("Error flashing kernel. System won't boot!");
 				set_error_text2("Please flash backup! Starting E2 in 60 sec");
+				telemetry_write(image_dir, 0);
 				if (stop_e2_needed)
 				{
 					sleep(60);
-					reboot(LINUX_REBOOT_CMD_RESTART);
+					reboot_box();
 				}
 				sleep(3);
 				close_framebuffer();
@@ -1424,22 +1733,24 @@ int main(int argc, char *argv[])
 		}
 
 		// Flash rootfs
-		if (!rootfs_flash(rootfs_device, rootfs_filename))
+		if (!jobs[1].result && !rootfs_flash(&jobs[1]))
 		{
 			my_printf("Error flashing rootfs! System won't boot. Please flash backup! System will reboot in 60 seconds\n");
 			set_error_text1("Error flashing rootfs. System won't boot!");
 			set_error_text2("Please flash backup! Rebooting in 60 sec");
+			telemetry_write(image_dir, 0);
 			if (stop_e2_needed)
 			{
 				sleep(60);
-				reboot(LINUX_REBOOT_CMD_RESTART);
+				reboot_box();
 			}
 			sleep(3);
 			close_framebuffer();
 			return EXIT_FAILURE;
 		}
 
-		my_printf("Successfully flashed rootfs! Rebooting in 3 seconds...\n");
+		my_printf("Successfully flashed rootfs! Rebooting...\n");
+		umount_targets();
 		if (!stop_e2_needed)
 		{
 			ret = umount("/oldroot_remount/");
@@ -1451,19 +1762,23 @@ int main(int argc, char *argv[])
 		else
 		{
 			ret = umount("/oldroot_remount/");
-			set_step("Successfully flashed! Rebooting in 3 seconds");
+			set_step("Successfully flashed! Rebooting...");
 		}
 		fflush(stdout);
 		fflush(stderr);
-		sleep(3);
+		sync();
+		phase_wait("Sync before reboot", writeback_done, NULL, 3000);
+		phase_report();
+		telemetry_write(image_dir, 1);
 		if (!no_write && stop_e2_needed)
 		{
-			reboot(LINUX_REBOOT_CMD_RESTART);
+			reboot_box();
 		}
 	}
 
-	closelog();
+	close_log();
 	close_framebuffer();
 
 	return EXIT_SUCCESS;
 }
+#endif
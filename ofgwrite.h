@@ -1,4 +1,15 @@
+#include <stdio.h>
 #include <sys/stat.h>
+#include <sys/types.h>
+
+// console, syslog and log file output, see logger.h
+void my_printf(char const *fmt, ...);
+void my_fprintf(FILE * f, char const *fmt, ...);
+
+// step and progress display of fb.c
+void set_step(char* str);
+void set_step_without_incr(char* str);
+void set_step_progress(int percent);
 
 struct stat kernel_file_stat;
 struct stat rootfs_file_stat;
@@ -19,7 +30,50 @@ char current_rootfs_device[1000];
 char current_kernel_device[1000];
 char current_rootfs_sub_dir[1000];
 
+// block device partition found in /sys/class/block
+struct partition_info
+{
+	char name[32];      // e.g. mmcblk0p3
+	char disk[32];      // e.g. mmcblk0
+	char partname[72];  // GPT or blkdevparts name
+	int partn;
+	unsigned long long size;
+};
+
+int partitions_scan();
+const struct partition_info* partition_by_name(const char* name);
+const struct partition_info* partition_by_partname(const char* partname, const char* disk);
+int partitions_named();
+int find_named_partitions();
+
 void handle_busybox_fatal_error();
+void ofgwrite_lib_abort(void);
+int tar_extract(const char *tar_filename, const char *base_dir);
+void tar_extract_abort(void);
+int tar_extract_multi(const char *tar_filename, const char *const *base_dirs, int *results, int cnt);
+int tar_test(const char *tar_filename, long long *size);
+int rm_recursive(const char *path);
+int mkdir_recursive(const char* path);
+int copy_newroot(const char* root, int multilib);
+int kill_processes(void);
+pid_t find_process(const char* comm);
+int wait_process_exit(pid_t pid, int timeout);
+int kill_pids_and_wait(const pid_t* pids, int cnt, int sig, int timeout);
+int fuser_mount_pids(const char* mount_point, pid_t** pids);
+
+struct phase_record
+{
+	const char* name;
+	long long ms;
+	int ready;
+};
+
+void phase_begin(const char* name);
+void phase_end(int ready);
+int phase_wait(const char* name, int (*ready)(void* arg), void* arg, int timeout);
+const struct phase_record* phase_records(int* cnt);
+void phase_report();
+int writeback_done(void* arg);
 
 enum RootfsTypeEnum
 {
@@ -31,5 +85,61 @@ enum FlashModeTypeEnum
 	FLASH_MODE_UNKNOWN, MTD, TARBZ2
 };
 
+enum PrefetchResultEnum
+{
+	PREFETCH_UNKNOWN, PREFETCH_VALID, PREFETCH_INVALID
+};
+
+int prefetch_start(const char* filename, const char* dir, int is_tar);
+enum PrefetchResultEnum prefetch_finish(const char* root, char* filename, int size);
+
 enum FlashModeTypeEnum kernel_flash_mode;
 enum FlashModeTypeEnum rootfs_flash_mode;
+
+// context of flashing one image, independent of the globals
+struct flash_job
+{
+	const char* name;
+	char* device;
+	char* filename;
+	off_t file_size;
+	enum FlashModeTypeEnum flash_mode;
+	enum RootfsTypeEnum rootfs_type;
+	int jffs2_summary;
+	const char* rootfs_sub_dir; // ext4 rootfs in a sub dir of the partition, "" if not
+	int quiet;
+	int no_write;
+	int (*flash)(struct flash_job* job);
+	int percent;
+	int result;
+};
+
+int independent_devices(const char* dev1, const char* dev2);
+int flash_job_concurrent();
+int flash_job_progress(int percent);
+int flash_jobs_concurrent(struct flash_job* jobs, int cnt);
+int rehearse_flash(struct flash_job* kernel, struct flash_job* rootfs, int copies);
+
+// one multiboot slot of a fan-out run (-m with several slots)
+#define MAX_FLASH_TARGETS 9
+
+struct flash_target
+{
+	int slot;
+	char kernel_device[1000];
+	char rootfs_device[1000];
+	char rootfs_sub_dir[1000];
+	char mount_point[100];
+	enum FlashModeTypeEnum kernel_flash_mode;
+	enum FlashModeTypeEnum rootfs_flash_mode;
+	int running;
+	int kernel_result;
+	int rootfs_result;
+};
+
+struct flash_target flash_targets[MAX_FLASH_TARGETS];
+int flash_targets_cnt;
+
+int flash_ext4_kernel(char* device, char* filename, off_t kernel_file_size, int quiet, int no_write);
+int flash_ext4_rootfs(char* filename, const char* sub_dir, int quiet, int no_write);
+int flash_ext4_rootfs_targets(char* filename, struct flash_target* targets, int cnt, int quiet, int no_write);
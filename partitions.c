@@ -0,0 +1,277 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+
+// Model of all block device partitions built once from /sys/class/block.
+// The kernel exports the GPT (and blkdevparts) partition names as PARTNAME
+// in uevent, so finding the kernel and rootfs partitions is a lookup and
+// no disk needs to be opened to read its partition table.
+
+void ext4_kernel_dev_found(const char* dev, int partition_number);
+void ext4_rootfs_dev_found(const char* dev, int partition_number);
+
+#ifndef SYS_CLASS_BLOCK
+#define SYS_CLASS_BLOCK "/sys/class/block"
+#endif
+
+static struct partition_info* partitions;
+static int partitions_cnt = -1;
+
+static void read_uevent(const char* name, struct partition_info* part)
+{
+	char path[PATH_MAX];
+	char line[200];
+	FILE* f;
+
+	snprintf(path, sizeof(path), SYS_CLASS_BLOCK "/%s/uevent", name);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return;
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		line[strcspn(line, "\n")] = '\0';
+		if (strncmp(line, "PARTN=", 6) == 0)
+			part->partn = atoi(line + 6);
+		else if (strncmp(line, "PARTNAME=", 9) == 0)
+			snprintf(part->partname, sizeof(part->partname), "%.*s",
+				 (int)sizeof(part->partname) - 1, line + 9);
+	}
+	fclose(f);
+}
+
+static void read_parent(const char* name, struct partition_info* part)
+{
+	char path[PATH_MAX];
+	char real[PATH_MAX];
+	char* pos;
+	FILE* f;
+
+	snprintf(path, sizeof(path), SYS_CLASS_BLOCK "/%s/size", name);
+	f = fopen(path, "r");
+	if (f != NULL)
+	{
+		if (fscanf(f, "%llu", &part->size) == 1)
+			part->size *= 512;
+		fclose(f);
+	}
+
+	// .../block/mmcblk0/mmcblk0p3 -> mmcblk0
+	snprintf(path, sizeof(path), SYS_CLASS_BLOCK "/%s", name);
+	if (realpath(path, real) == NULL || (pos = strrchr(real, '/')) == NULL)
+		return;
+	*pos = '\0';
+	if ((pos = strrchr(real, '/')) != NULL)
+		snprintf(part->disk, sizeof(part->disk), "%s", pos + 1);
+}
+
+int partitions_scan()
+{
+	struct partition_info* part;
+	struct dirent* entry;
+	DIR* dir;
+	int named = 0;
+
+	if (partitions_cnt >= 0)
+		return partitions_cnt;
+
+	partitions_cnt = 0;
+	dir = opendir(SYS_CLASS_BLOCK);
+	if (dir == NULL)
+	{
+		my_printf("Error opening %s\n", SYS_CLASS_BLOCK);
+		return 0;
+	}
+	while ((entry = readdir(dir)) != NULL)
+	{
+		// a truncated name would be a different device
+		if (entry->d_name[0] == '.' || strlen(entry->d_name) >= sizeof(part->name))
+			continue;
+		part = realloc(partitions, (partitions_cnt + 1) * sizeof(*partitions));
+		if (part == NULL)
+			break;
+		partitions = part;
+		part = &partitions[partitions_cnt];
+		memset(part, 0, sizeof(*part));
+		snprintf(part->name, sizeof(part->name), "%.*s", (int)sizeof(part->name) - 1, entry->d_name);
+		read_uevent(part->name, part);
+		if (part->partn == 0) // whole disk
+			continue;
+		read_parent(part->name, part);
+		if (part->partname[0] != '\0')
+			named++;
+		partitions_cnt++;
+	}
+	closedir(dir);
+
+	my_printf("Found %d partitions, %d with name\n", partitions_cnt, named);
+	return partitions_cnt;
+}
+
+// partition by kernel name, e.g. mmcblk0p3 or /dev/mmcblk0p3
+const struct partition_info* partition_by_name(const char* name)
+{
+	int i;
+
+	if (strncmp(name, "/dev/", 5) == 0)
+		name += 5;
+	for (i = 0; i < partitions_scan(); i++)
+		if (strcmp(partitions[i].name, name) == 0)
+			return &partitions[i];
+	return NULL;
+}
+
+// partition by partition name, one on disk is preferred if given
+const struct partition_info* partition_by_partname(const char* partname, const char* disk)
+{
+	const struct partition_info* found = NULL;
+	int i;
+
+	for (i = 0; i < partitions_scan(); i++)
+	{
+		if (strcmp(partitions[i].partname, partname) != 0)
+			continue;
+		if (disk == NULL || strcmp(partitions[i].disk, disk) == 0)
+			return &partitions[i];
+		if (found == NULL)
+			found = &partitions[i];
+	}
+	return found;
+}
+
+// whether any partition has a name, otherwise the kernel doesn't export them
+int partitions_named()
+{
+	int i;
+
+	for (i = 0; i < partitions_scan(); i++)
+		if (partitions[i].partname[0] != '\0')
+			return 1;
+	return 0;
+}
+
+static void set_part_names(char* kernel_name, char* rootfs_name)
+{
+	if (multiboot_partition != -1 && current_rootfs_sub_dir[0] == '\0')
+	{
+		sprintf(kernel_name, "kernel%d", multiboot_partition);
+		sprintf(rootfs_name, "rootfs%d", multiboot_partition);
+	}
+	else if (multiboot_partition != -1 && current_rootfs_sub_dir[0] != '\0') // box with rootSubDir feature
+	{
+		if (multiboot_partition == 1)
+		{
+			strcpy(kernel_name, "linuxkernel");
+			strcpy(rootfs_name, "linuxrootfs");
+		}
+		else
+		{
+			sprintf(kernel_name, "linuxkernel%d", multiboot_partition);
+			strcpy(rootfs_name, "userdata");
+		}
+		sprintf(rootfs_sub_dir, "linuxrootfs%d", multiboot_partition);
+	}
+	else
+	{
+		strcpy(kernel_name, "kernel");
+		strcpy(rootfs_name, "rootfs");
+	}
+}
+
+// bp30/bp31 contain the bootloader
+static int is_boot_partition(const char* name)
+{
+	const struct partition_info* part = partition_by_name(name);
+
+	return part != NULL && (strcmp(part->partname, "bp30") == 0 || strcmp(part->partname, "bp31") == 0);
+}
+
+// same rules as the GPT partition search of fdisk -l
+static int lookup_devices(const char* kernel_name, const char* rootfs_name, const char* disk)
+{
+	const struct partition_info* kernel = partition_by_partname(kernel_name, disk);
+	const struct partition_info* rootfs = partition_by_partname(rootfs_name, disk);
+	char dev[100];
+
+	if (kernel != NULL)
+	{
+		sprintf(dev, "/dev/%s", kernel->disk);
+		ext4_kernel_dev_found(dev, kernel->partn);
+	}
+	if (rootfs != NULL)
+	{
+		sprintf(dev, "/dev/%s", rootfs->disk);
+		ext4_rootfs_dev_found(dev, rootfs->partn);
+	}
+	return kernel != NULL || rootfs != NULL;
+}
+
+// Finds kernel and rootfs partitions by their names. Returns 0 if the
+// partition names are unknown and fdisk has to read the partition tables.
+int find_named_partitions()
+{
+	const struct partition_info* current;
+	char kernel_name[100];
+	char rootfs_name[100];
+	const char* disk = NULL;
+
+	if (!partitions_scan() || !partitions_named())
+		return 0;
+
+	current = partition_by_name(current_rootfs_device);
+	if (current != NULL)
+		disk = current->disk;
+
+	if ((user_kernel && is_boot_partition(kernel_device_arg))
+	 || (user_rootfs && is_boot_partition(rootfs_device_arg)))
+	{
+		my_printf("User specified device is a bp30/bp31 partition. These partitions shouldn't be used. Never!\nAborting...\n");
+		exit(EXIT_FAILURE);
+	}
+
+	set_part_names(kernel_name, rootfs_name);
+	// If kernel OR rootfs found, return. If one is missing, handle error later.
+	// If multiboot partition was specified, return also as user wanted to use a specific partition which was not found.
+	if (lookup_devices(kernel_name, rootfs_name, disk) || multiboot_partition != -1)
+		return 1;
+
+	my_printf("No matching partition names are found. Use current kernel and rootfs devices\n");
+	if (current == NULL)
+	{
+		my_printf("Error: Partition not found. Device name: %s\n", current_rootfs_device);
+		return 1;
+	}
+
+	if (current_rootfs_sub_dir[0] == '\0')
+	{
+		// expecting names starting with "rootfs" and after that a number. So e.g. rootfs3
+		if (sscanf(current->partname, "%*[a-z]%d", &multiboot_partition) != 1)
+			return 1;
+		my_printf("Using current multiboot partition %d\n", multiboot_partition);
+		set_part_names(kernel_name, rootfs_name);
+	}
+	else // box with rootSubDir feature, part name is either linuxrootfs or userdata
+	{
+		if (strcmp(current->partname, "linuxrootfs") == 0)
+		{
+			multiboot_partition = 1;
+			my_printf("Using current multiboot partition %d\n", multiboot_partition);
+			strcpy(kernel_name, "linuxkernel");
+			strcpy(rootfs_name, "linuxrootfs");
+		}
+		else
+		{
+			multiboot_partition = -1;
+			my_printf("Using current multiboot partition userdata\n");
+			strcpy(kernel_name, current_kernel_device);
+			strcpy(rootfs_name, "userdata");
+		}
+		strcpy(rootfs_sub_dir, current_rootfs_sub_dir);
+	}
+
+	lookup_devices(kernel_name, rootfs_name, disk);
+	return 1;
+}
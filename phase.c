@@ -0,0 +1,98 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+// Phases of the flash flow which wait for the system: instead of sleeping
+// a fixed time each phase polls a readiness condition and continues as soon
+// as it holds. The time spent in each phase is recorded to see the real
+// downtime of the box.
+
+#define PHASE_MAX     32
+#define PHASE_POLL_MS 50
+
+static struct phase_record phases[PHASE_MAX];
+static int phases_cnt;
+static const char* phase_name;
+static long long phase_start;
+
+static long long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void phase_record(const char* name, long long ms, int ready)
+{
+	if (phases_cnt >= PHASE_MAX)
+		return;
+	phases[phases_cnt].name  = name;
+	phases[phases_cnt].ms    = ms;
+	phases[phases_cnt].ready = ready;
+	phases_cnt++;
+	my_printf("Phase %s: %s after %lld ms\n", name, ready ? "done" : "timeout", ms);
+}
+
+void phase_begin(const char* name)
+{
+	phase_name  = name;
+	phase_start = now_ms();
+}
+
+void phase_end(int ready)
+{
+	phase_record(phase_name, now_ms() - phase_start, ready);
+}
+
+int phase_wait(const char* name, int (*ready)(void* arg), void* arg, int timeout)
+{
+	long long start = now_ms();
+	long long waited = 0;
+	int ret;
+
+	while (!(ret = ready(arg)) && waited < timeout)
+	{
+		usleep(PHASE_POLL_MS * 1000);
+		waited = now_ms() - start;
+	}
+	phase_record(name, now_ms() - start, ret);
+	return ret;
+}
+
+const struct phase_record* phase_records(int* cnt)
+{
+	*cnt = phases_cnt;
+	return phases;
+}
+
+void phase_report()
+{
+	long long total = 0;
+	int i;
+
+	for (i = 0; i < phases_cnt; i++)
+		total += phases[i].ms;
+	my_printf("Waited %lld ms in %d phases\n", total, phases_cnt);
+}
+
+// all dirty pages have been written to the devices
+int writeback_done(void* arg)
+{
+	char line[100];
+	long kb = -1;
+	FILE* f;
+
+	f = fopen("/proc/meminfo", "r");
+	if (f == NULL)
+		return 1;
+	while (fgets(line, sizeof(line), f) != NULL)
+		if (sscanf(line, "Writeback: %ld kB", &kb) == 1)
+			break;
+	fclose(f);
+
+	return kb <= 0;
+}
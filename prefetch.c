@@ -0,0 +1,605 @@
+#include "ofgwrite.h"
+
+#include "libbb.h"
+#include "bb_archive.h"
+
+#include <pthread.h>
+#include <sys/statfs.h>
+#include <sys/statvfs.h>
+#include <sys/wait.h>
+#include <telemetry.h>
+#include <tune.h>
+
+// Decompresses and validates the rootfs image while E2 shuts down, the
+// box is idle until the first write anyway. The decompressed stream is
+// staged to the /newroot tmpfs as long as it fits into the RAM budget, so
+// flashing starts from an already checked copy. Images above the budget
+// are validated only and flashed from the original file.
+//
+// Compressed archives are decompressed by a child process like busybox
+// tar does, the prefetch thread checks the tar headers and stages the
+// output. bzip2 verifies its block CRCs itself.
+//
+// Slow sources (network shares, slow USB sticks) must not stall flashing
+// once the old rootfs is gone. Their throughput is probed first:
+//   fast source           stage the decompressed stream as described above
+//   slow, fits budget     copy the image file to tmpfs, the copy also feeds
+//                         the validation; flashing waits for the copy
+//   slow, above budget    a reader thread keeps up to the budget of the
+//                         image in the page cache ahead of the flash tools
+
+#define PREFETCH_FILE       "rootfs.prefetch"
+#define PREFETCH_COPY_FILE  "rootfs.image"
+#define PREFETCH_BUFSIZE    (tune_get()->image_buf)
+#define PREFETCH_RESERVE    (16 * 1024 * 1024) // bytes of tmpfs and RAM left for flashing
+#define PREFETCH_PROBE_SIZE (4 * 1024 * 1024)
+#define PREFETCH_SLOW_RATE  (8 * 1024 * 1024)  // bytes/s
+#define PREFETCH_POLL_MS    20
+
+#ifndef NFS_SUPER_MAGIC
+#define NFS_SUPER_MAGIC     0x6969
+#endif
+#define CIFS_SUPER_MAGIC    0xFF534D42
+#define SMB2_SUPER_MAGIC    0xFE534D42
+#define SMB_SUPER_MAGIC     0x517B
+
+extern int g_fbFd;
+
+enum PrefetchModeEnum
+{
+	PREFETCH_STREAM, PREFETCH_COPY, PREFETCH_READAHEAD
+};
+
+struct tar_check
+{
+	unsigned char hdr[512];
+	int hdr_len;
+	long long skip;
+	int headers;
+	int end;
+	int error;
+};
+
+static enum PrefetchModeEnum mode;
+static pthread_t prefetch_thread;
+static pthread_t feeder_thread;
+static int prefetch_running;
+static int feeder_running;
+static volatile int prefetch_done;
+static volatile int copy_done;
+static volatile int cancelled;
+static volatile int flashing;
+static volatile long long copied;
+static long long read_base;
+static int copy_ok;
+static int img_fd = -1;   // shares the file offset with the decompressor
+static int dir_fd = -1;
+static int stage_fd = -1;
+static int copy_fd = -1;
+static int pipe_fd = -1;  // decompressed data
+static int feed_fd = -1;  // compressed data for the decompressor in copy mode
+static off_t feed_skip;   // signature bytes already consumed from the image
+static pid_t xformer_pid;
+static int tar;
+static off_t img_size;
+static long long budget;
+static long long stage_budget;
+static enum PrefetchResultEnum result;
+
+static long long now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long long prefetch_budget(const char* dir)
+{
+	char line[100];
+	long long kb = 0;
+	long long bytes;
+	struct statvfs st;
+	FILE* f;
+
+	f = fopen("/proc/meminfo", "r");
+	if (f != NULL)
+	{
+		while (fgets(line, sizeof(line), f) != NULL)
+			if (sscanf(line, "MemAvailable: %lld kB", &kb) == 1)
+				break;
+		fclose(f);
+	}
+	// on small boxes the staged image mustn't push ofgwrite out of RAM
+	bytes = kb * 1024 / (tune_get()->low_ram ? 4 : 2) - PREFETCH_RESERVE;
+
+	if (statvfs(dir, &st) == 0
+	 && (long long)st.f_bavail * st.f_frsize - PREFETCH_RESERVE < bytes)
+		bytes = (long long)st.f_bavail * st.f_frsize - PREFETCH_RESERVE;
+
+	return bytes > 0 ? bytes : 0;
+}
+
+// bytes per second of the image source, measured on the first few MB
+static long long probe_rate(int fd, int* network)
+{
+	struct statfs sfs;
+	char* buf;
+	long long start, us;
+	off_t off = 0;
+	off_t size = img_size < PREFETCH_PROBE_SIZE ? img_size : PREFETCH_PROBE_SIZE;
+	ssize_t len;
+
+	*network = fstatfs(fd, &sfs) == 0
+		&& (sfs.f_type == NFS_SUPER_MAGIC || (unsigned)sfs.f_type == CIFS_SUPER_MAGIC
+		 || (unsigned)sfs.f_type == SMB2_SUPER_MAGIC || sfs.f_type == SMB_SUPER_MAGIC);
+
+	buf = xmalloc(PREFETCH_BUFSIZE);
+	start = now_us();
+	while (off < size && (len = pread(fd, buf, PREFETCH_BUFSIZE, off)) > 0)
+		off += len;
+	us = now_us() - start;
+	free(buf);
+
+	return us > 0 ? off * 1000000 / us : off * 1000000;
+}
+
+static unsigned long long tar_number(const unsigned char* p, int len)
+{
+	unsigned long long n = 0;
+	int i;
+
+	if (p[0] & 0x80) // base-256 (GNU)
+	{
+		n = p[0] & 0x3f;
+		for (i = 1; i < len; i++)
+			n = n << 8 | p[i];
+		return n;
+	}
+	for (; len && (*p == ' ' || *p == '\0'); p++, len--)
+		;
+	for (; len && *p >= '0' && *p <= '7'; p++, len--)
+		n = n * 8 + *p - '0';
+	return n;
+}
+
+static int tar_header_ok(const unsigned char* h)
+{
+	unsigned sum = 0;
+	int ssum = 0;
+	unsigned long long chksum = tar_number(h + 148, 8);
+	int i;
+
+	for (i = 0; i < 512; i++)
+	{
+		sum  += (i >= 148 && i < 156) ? ' ' : h[i];
+		ssum += (i >= 148 && i < 156) ? ' ' : (signed char)h[i];
+	}
+	// some old tar versions sum signed chars
+	return chksum == sum || (long long)chksum == ssum;
+}
+
+static void tar_check(struct tar_check* t, const unsigned char* buf, int len)
+{
+	long long n;
+	int i;
+
+	while (len > 0 && !t->end && !t->error)
+	{
+		// file data
+		if (t->skip)
+		{
+			n = t->skip < len ? t->skip : len;
+			t->skip -= n;
+			buf += n;
+			len -= n;
+			continue;
+		}
+
+		n = 512 - t->hdr_len < len ? 512 - t->hdr_len : len;
+		memcpy(t->hdr + t->hdr_len, buf, n);
+		t->hdr_len += n;
+		buf += n;
+		len -= n;
+		if (t->hdr_len < 512)
+			break;
+		t->hdr_len = 0;
+
+		for (i = 0; i < 512 && t->hdr[i] == 0; i++)
+			;
+		if (i == 512) // end of archive
+		{
+			t->end = 1;
+			break;
+		}
+		if (!tar_header_ok(t->hdr))
+		{
+			t->error = 1;
+			break;
+		}
+		t->headers++;
+		// links, devices, directories and fifos have no data
+		if (strchr("123456", t->hdr[156]) == NULL || t->hdr[156] == '\0')
+			t->skip = (tar_number(t->hdr + 124, 12) + 511) & ~511ULL;
+	}
+}
+
+static int tar_complete(const struct tar_check* t)
+{
+	return !t->error && !t->skip && !t->hdr_len && t->headers > 0;
+}
+
+static void stop_staging()
+{
+	my_printf("Prefetch: image exceeds RAM budget of %lld bytes, validating only\n", stage_budget);
+	ftruncate(stage_fd, 0);
+	close(stage_fd);
+	stage_fd = -1;
+	unlinkat(dir_fd, PREFETCH_FILE, 0);
+}
+
+static void set_result(int read_error, int xformer_ok, int tar_ok, long long total)
+{
+	if (cancelled)
+		result = PREFETCH_UNKNOWN;
+	else if (read_error || !xformer_ok || !tar_ok)
+		result = PREFETCH_INVALID;
+	else
+		result = PREFETCH_VALID;
+
+	if (result == PREFETCH_INVALID)
+		my_printf("Prefetch: image is corrupt (%s)\n", read_error ? "read error" : !xformer_ok ? "bad compressed data" : "bad tar archive");
+	else if (result == PREFETCH_VALID)
+		my_printf("Prefetch: image validated, %lld bytes%s\n", total, stage_fd >= 0 ? " staged" : "");
+}
+
+// reads the (decompressed) image, checks and stages it
+static void* prefetch_run(void* arg)
+{
+	struct tar_check* tc = xzalloc(sizeof(*tc));
+	unsigned char* buf = xmalloc(PREFETCH_BUFSIZE);
+	int in = xformer_pid ? pipe_fd : img_fd;
+	long long total = 0;
+	int read_error = 0;
+	int xformer_ok = 1;
+	int status;
+	ssize_t len;
+
+	while (!cancelled && (len = read(in, buf, PREFETCH_BUFSIZE)) != 0)
+	{
+		if (len < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			read_error = 1;
+			break;
+		}
+		total += len;
+		if (tar)
+			tar_check(tc, buf, len);
+		if (stage_fd >= 0 && (total > stage_budget || full_write(stage_fd, buf, len) != len))
+			stop_staging();
+	}
+
+	if (xformer_pid)
+	{
+		close(pipe_fd); // decompressor gets SIGPIPE if it is cancelled
+		pipe_fd = -1;
+		waitpid(xformer_pid, &status, 0);
+		// killed, e.g. by fuser: nothing known about the image
+		if (WIFSIGNALED(status) && (WTERMSIG(status) == SIGKILL
+		 || WTERMSIG(status) == SIGTERM || WTERMSIG(status) == SIGPIPE))
+			cancelled = 1;
+		xformer_ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	}
+	else if (total != img_size)
+		read_error = 1;
+
+	set_result(read_error, xformer_ok, !tar || tar_complete(tc), total);
+
+	free(buf);
+	free(tc);
+	prefetch_done = 1;
+	return NULL;
+}
+
+// copies the image of a slow source to tmpfs and feeds the decompressor
+static void* feeder_run(void* arg)
+{
+	struct tar_check* tc = xzalloc(sizeof(*tc));
+	unsigned char* buf = xmalloc(PREFETCH_BUFSIZE);
+	int read_error = 0;
+	off_t off = 0;
+	off_t start;
+	ssize_t len;
+	sigset_t set;
+
+	// a failing decompressor must not kill ofgwrite with SIGPIPE
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	while (!cancelled && (len = pread(img_fd, buf, PREFETCH_BUFSIZE, off)) != 0)
+	{
+		if (len < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			read_error = 1;
+			break;
+		}
+		if (full_write(copy_fd, buf, len) != len)
+			break;
+		if (feed_fd >= 0 && off + len > feed_skip)
+		{
+			start = off < feed_skip ? feed_skip - off : 0;
+			if (full_write(feed_fd, buf + start, len - start) != len - start)
+			{
+				close(feed_fd);
+				feed_fd = -1;
+			}
+		}
+		if (tar && !xformer_pid)
+			tar_check(tc, buf, len);
+		off += len;
+		copied = off;
+	}
+	if (feed_fd >= 0)
+		close(feed_fd);
+	feed_fd = -1;
+
+	copy_ok = !cancelled && !read_error && off == img_size;
+	if (!copy_ok)
+		my_printf("Prefetch: copying image to RAM failed after %lld bytes\n", (long long)off);
+	// without decompressor the copy is the validation
+	if (!xformer_pid)
+		set_result(read_error, 1, !tar || tar_complete(tc), off);
+
+	free(buf);
+	free(tc);
+	copy_done = 1;
+	return NULL;
+}
+
+// keeps the image in the page cache ahead of the flash tools
+static void* readahead_run(void* arg)
+{
+	unsigned char* buf = xmalloc(PREFETCH_BUFSIZE);
+	off_t off = 0;
+	long long consumed;
+	ssize_t len;
+
+	while (!cancelled && off < img_size)
+	{
+		consumed = flashing ? telemetry_image_read() - read_base : 0;
+		if (off - consumed >= budget)
+		{
+			usleep(PREFETCH_POLL_MS * 1000);
+			continue;
+		}
+		len = pread(img_fd, buf, PREFETCH_BUFSIZE, off);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
+		off += len;
+	}
+
+	free(buf);
+	prefetch_done = 1;
+	return NULL;
+}
+
+static int start_thread(pthread_t* thread, void* (*fn)(void*))
+{
+	if (pthread_create(thread, NULL, fn, NULL) == 0)
+		return 1;
+	if (xformer_pid)
+		kill(xformer_pid, SIGKILL);
+	return 0;
+}
+
+int prefetch_start(const char* filename, const char* dir, int is_tar)
+{
+	transformer_state_t* xstate;
+	struct stat st;
+	long long rate;
+	int network;
+	int fds[2];
+	int feed[2];
+
+	img_fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (img_fd < 0 || fstat(img_fd, &st) != 0)
+	{
+		my_printf("Prefetch: error opening %s\n", filename);
+		return 0;
+	}
+	img_size = st.st_size;
+	dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	budget = prefetch_budget(dir);
+	stage_budget = budget;
+	tar = is_tar;
+
+	rate = probe_rate(img_fd, &network);
+	mode = PREFETCH_STREAM;
+	if (network || rate < PREFETCH_SLOW_RATE)
+	{
+		if (img_size <= budget && dir_fd >= 0)
+			copy_fd = openat(dir_fd, PREFETCH_COPY_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		mode = copy_fd >= 0 ? PREFETCH_COPY : PREFETCH_READAHEAD;
+	}
+	my_printf("Prefetch: %s source, %lld kB/s\n", network ? "network" : "local", rate / 1024);
+
+	if (mode == PREFETCH_READAHEAD)
+	{
+		my_printf("Prefetch: reading ahead up to %lld bytes of %s\n", budget, filename);
+		posix_fadvise(img_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		prefetch_running = start_thread(&prefetch_thread, readahead_run);
+		return prefetch_running;
+	}
+	if (mode == PREFETCH_COPY)
+		stage_budget = budget - img_size;
+
+	if (tar)
+	{
+		xstate = setup_transformer_on_fd(img_fd, 0);
+		feed[0] = feed[1] = -1;
+		// not inherited by daemons started meanwhile, they would keep
+		// the pipes open
+		if (xstate->xformer && pipe2(fds, O_CLOEXEC) == 0
+		 && (mode != PREFETCH_COPY || pipe2(feed, O_CLOEXEC) == 0))
+		{
+			feed_skip = lseek(img_fd, 0, SEEK_CUR);
+			xformer_pid = fork();
+			if (xformer_pid == 0)
+			{
+				// the GUI progress belongs to the parent
+				g_fbFd = -1;
+				close(fds[0]);
+				if (feed[1] >= 0)
+				{
+					close(feed[1]);
+					xstate->src_fd = feed[0];
+				}
+				xstate->dst_fd = fds[1];
+				_exit(xstate->xformer(xstate) < 0);
+			}
+			close(fds[1]);
+			pipe_fd = fds[0];
+			if (feed[0] >= 0)
+				close(feed[0]);
+			feed_fd = feed[1];
+			if (xformer_pid < 0)
+			{
+				close(pipe_fd);
+				pipe_fd = -1;
+				if (feed_fd >= 0)
+					close(feed_fd);
+				feed_fd = -1;
+				xformer_pid = 0;
+				free(xstate);
+				return 0;
+			}
+		}
+		free(xstate);
+	}
+
+	if (mode == PREFETCH_COPY)
+	{
+		my_printf("Prefetch: copying %s to RAM\n", filename);
+		feeder_running = start_thread(&feeder_thread, feeder_run);
+		if (!feeder_running || !xformer_pid)
+			return feeder_running;
+	}
+	// uncompressed image files are only worth reading when they are staged
+	// or checked; otherwise let the kernel read ahead what fits
+	else if (!xformer_pid && img_size > budget && !tar)
+	{
+		my_printf("Prefetch: reading ahead %lld of %lld bytes\n", budget, (long long)img_size);
+		posix_fadvise(img_fd, 0, budget, POSIX_FADV_WILLNEED);
+		return 1;
+	}
+
+	if (dir_fd >= 0 && (xformer_pid || img_size <= budget))
+		stage_fd = openat(dir_fd, PREFETCH_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	my_printf("Prefetch: %s %s, RAM budget %lld bytes\n", xformer_pid ? "decompressing" : "reading", filename, stage_budget);
+	prefetch_running = start_thread(&prefetch_thread, prefetch_run);
+	return prefetch_running;
+}
+
+static void wait_done(char* text, volatile int* done, volatile long long* pos)
+{
+	int current_percent = -1;
+	int new_percent;
+
+	if (*done)
+		return;
+	set_step_without_incr(text);
+	while (!*done)
+	{
+		// the decompressor shares the file offset of the image
+		new_percent = img_size ? (pos ? *pos : lseek(img_fd, 0, SEEK_CUR)) * 100 / img_size : 0;
+		if (new_percent > current_percent)
+		{
+			set_step_progress(new_percent);
+			current_percent = new_percent;
+		}
+		usleep(100000);
+	}
+}
+
+enum PrefetchResultEnum prefetch_finish(const char* root, char* filename, int size)
+{
+	int staged = 0;
+
+	if (mode == PREFETCH_READAHEAD)
+	{
+		// the reader thread keeps running ahead of the flash tools
+		read_base = telemetry_image_read();
+		flashing = 1;
+		return PREFETCH_UNKNOWN;
+	}
+
+	if (feeder_running)
+	{
+		// the source is too slow to flash from
+		wait_done("Copying image to RAM", &copy_done, &copied);
+		pthread_join(feeder_thread, NULL);
+		feeder_running = 0;
+		close(copy_fd);
+		copy_fd = -1;
+	}
+
+	if (prefetch_running && !prefetch_done && stage_fd < 0)
+	{
+		// the image is flashed from the original file or the copy anyway,
+		// waiting for the validation would only delay it
+		my_printf("Prefetch: validation not finished, cancelled\n");
+		cancelled = 1;
+		if (xformer_pid)
+			kill(xformer_pid, SIGKILL);
+	}
+	else if (prefetch_running && !prefetch_done)
+		wait_done("Verifying image", &prefetch_done, mode == PREFETCH_COPY ? &copied : NULL);
+	if (prefetch_running)
+		pthread_join(prefetch_thread, NULL);
+	prefetch_running = 0;
+	if (img_fd >= 0)
+		close(img_fd);
+	img_fd = -1;
+
+	// a truncated copy breaks the validation, too
+	if (mode == PREFETCH_COPY && !copy_ok)
+		result = PREFETCH_UNKNOWN;
+
+	if (stage_fd >= 0)
+	{
+		close(stage_fd);
+		stage_fd = -1;
+		if (result == PREFETCH_VALID)
+		{
+			snprintf(filename, size, "%s%s", root, PREFETCH_FILE);
+			staged = 1;
+		}
+		else
+			unlinkat(dir_fd, PREFETCH_FILE, 0);
+	}
+	if (mode == PREFETCH_COPY)
+	{
+		if (!staged && copy_ok && result != PREFETCH_INVALID)
+		{
+			snprintf(filename, size, "%s%s", root, PREFETCH_COPY_FILE);
+			staged = 1;
+		}
+		else // not needed or incomplete
+			unlinkat(dir_fd, PREFETCH_COPY_FILE, 0);
+	}
+	if (staged)
+		my_printf("Prefetch: flashing %s\n", filename);
+	if (dir_fd >= 0)
+		close(dir_fd);
+	dir_fd = -1;
+
+	return result;
+}
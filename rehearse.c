@@ -0,0 +1,272 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <libmtd.h>
+#include <mtd/mtd-abi.h>
+#include <crc32.h>
+
+// Rehearsal of flashing: the read, checksum and decompress stages run on
+// the real images, but their output is discarded and nothing is written.
+// The flash time is estimated from the measured throughput and typical
+// program/erase times of the target devices. The devices can't be measured
+// without writing to them, only their read rate is.
+
+#define REHEARSE_BUF      (1024 * 1024)
+#define REHEARSE_DEV_READ (4 * 1024 * 1024)
+
+// typical datasheet figures
+#define NAND_ERASE_US       2000 // per eraseblock
+#define NAND_PROGRAM_US     300  // per 2 KiB page, includes the ECC of the controller
+#define MLC_NAND_ERASE_US   5000
+#define MLC_NAND_PROGRAM_US 1200
+#define NOR_ERASE_US        700000 // per 128 KiB eraseblock
+#define NOR_PROGRAM_KBS     1024
+#define EMMC_WRITE_KBS      (20 * 1024)
+
+extern void (*die_func)(void);
+
+static long long now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void print_stage(const char* name, long long bytes, long long us)
+{
+	double mb = bytes / 1048576.0;
+	double s = us / 1000000.0;
+
+	my_printf("  %-11s %9.1f MB in %6.1f s (%.1f MB/s)\n", name, mb, s, s > 0 ? mb / s : 0);
+}
+
+// reads the image and computes the crc32 over it like ubiformat and the
+// JFFS2 summary do
+static int rehearse_read(const char* filename, long long* bytes, long long* read_us)
+{
+	char* buf;
+	long long start, crc_us = 0;
+	uint32_t crc = 0xFFFFFFFF;
+	ssize_t len;
+	int fd;
+
+	*bytes = 0;
+	*read_us = 0;
+	fd = open(filename, O_RDONLY);
+	buf = malloc(REHEARSE_BUF);
+	if (fd < 0 || buf == NULL)
+	{
+		my_printf("Error opening %s\n", filename);
+		if (fd >= 0)
+			close(fd);
+		free(buf);
+		return 0;
+	}
+
+	for (;;)
+	{
+		start = now_us();
+		len = read(fd, buf, REHEARSE_BUF);
+		*read_us += now_us() - start;
+		if (len <= 0)
+			break;
+		*bytes += len;
+		start = now_us();
+		crc = mtd_crc32(crc, buf, len);
+		crc_us += now_us() - start;
+	}
+	close(fd);
+	free(buf);
+	if (len < 0)
+	{
+		my_printf("Error reading %s\n", filename);
+		return 0;
+	}
+
+	print_stage("read", *bytes, *read_us);
+	print_stage("crc32", *bytes, crc_us);
+	return 1;
+}
+
+// decompresses the image and parses the tar headers in a child process, so
+// a corrupt image can't end ofgwrite
+static int rehearse_untar(const char* filename, long long* size, long long* us)
+{
+	long long start = now_us();
+	int fds[2];
+	int status;
+	pid_t pid;
+
+	*size = 0;
+	if (pipe(fds) != 0)
+		return 0;
+	pid = fork();
+	if (pid == 0)
+	{
+		close(fds[0]);
+		die_func = NULL;
+		status = tar_test(filename, size);
+		if (write(fds[1], size, sizeof(*size)) != sizeof(*size))
+			status = EXIT_FAILURE;
+		_exit(status);
+	}
+	close(fds[1]);
+	if (pid < 0 || read(fds[0], size, sizeof(*size)) != sizeof(*size))
+		*size = 0;
+	close(fds[0]);
+	if (pid < 0 || waitpid(pid, &status, 0) != pid || status != 0)
+	{
+		my_printf("Error decompressing %s. Image is corrupt!\n", filename);
+		return 0;
+	}
+	*us = now_us() - start;
+	print_stage("decompress", *size, *us);
+	return 1;
+}
+
+// reading doesn't harm the device, writing can't be measured
+static long long device_read_rate(const char* device)
+{
+	char* buf;
+	long long start, us, bytes = 0;
+	ssize_t len;
+	int fd;
+
+	fd = open(device, O_RDONLY);
+	buf = malloc(REHEARSE_BUF);
+	if (fd < 0 || buf == NULL)
+	{
+		if (fd >= 0)
+			close(fd);
+		free(buf);
+		return 0;
+	}
+	start = now_us();
+	while (bytes < REHEARSE_DEV_READ && (len = read(fd, buf, REHEARSE_BUF)) > 0)
+		bytes += len;
+	us = now_us() - start;
+	close(fd);
+	free(buf);
+
+	print_stage("device read", bytes, us);
+	return us > 0 ? bytes * 1000000 / us : 0;
+}
+
+static long long estimate_mtd_us(const char* device, long long size, long long read_rate)
+{
+	struct mtd_dev_info mtd;
+	long long blocks, pages, erase_us, program_us, verify_us = 0;
+	libmtd_t libmtd;
+
+	libmtd = libmtd_open();
+	if (libmtd == NULL || mtd_get_dev_info(libmtd, device, &mtd) != 0)
+	{
+		my_printf("Error reading MTD device info of %s\n", device);
+		if (libmtd != NULL)
+			libmtd_close(libmtd);
+		return -1;
+	}
+	libmtd_close(libmtd);
+
+	blocks = (size + mtd.eb_size - 1) / mtd.eb_size;
+	pages  = (size + mtd.min_io_size - 1) / mtd.min_io_size;
+	if (mtd.type == MTD_NANDFLASH || mtd.type == MTD_MLCNANDFLASH)
+	{
+		int mlc = mtd.type == MTD_MLCNANDFLASH;
+
+		erase_us   = blocks * (mlc ? MLC_NAND_ERASE_US : NAND_ERASE_US);
+		program_us = pages * (mlc ? MLC_NAND_PROGRAM_US : NAND_PROGRAM_US);
+		if (mtd.min_io_size > 2048)
+			program_us = program_us * mtd.min_io_size / 2048;
+		my_printf("  device      %s %s NAND, %lld eraseblocks, %lld pages of %d bytes\n",
+			device, mlc ? "MLC" : "SLC", blocks, pages, mtd.min_io_size);
+	}
+	else if (mtd.type == MTD_NORFLASH)
+	{
+		erase_us   = blocks * NOR_ERASE_US * mtd.eb_size / (128 * 1024);
+		program_us = size * 1000000 / (NOR_PROGRAM_KBS * 1024LL);
+		// flashcp reads the written data back
+		if (read_rate > 0)
+			verify_us = size * 1000000 / read_rate;
+		my_printf("  device      %s NOR, %lld eraseblocks\n", device, blocks);
+	}
+	else
+	{
+		my_printf("Flash type \"%d\" not supported\n", mtd.type);
+		return -1;
+	}
+
+	my_printf("  estimate    erase %.1f s, program %.1f s, verify %.1f s\n",
+		erase_us / 1000000.0, program_us / 1000000.0, verify_us / 1000000.0);
+	return erase_us + program_us + verify_us;
+}
+
+// returns the estimated time in us, -1 if the image can't be flashed
+static long long rehearse_image(const char* name, char* filename, char* device, enum FlashModeTypeEnum mode, int is_tar, int copies)
+{
+	long long size, read_us, unpacked, untar_us, device_us, write_us, est;
+	long long read_rate;
+
+	my_printf("%s %s -> %s:\n", name, filename, device);
+	if (!rehearse_read(filename, &size, &read_us))
+		return -1;
+	if (is_tar && !rehearse_untar(filename, &unpacked, &untar_us))
+		return -1;
+	read_rate = device_read_rate(device);
+
+	if (mode == MTD)
+	{
+		device_us = estimate_mtd_us(device, size, read_rate);
+		if (device_us < 0)
+			return -1;
+		// reading the image and writing the device alternate
+		est = read_us + device_us;
+	}
+	else
+	{
+		write_us = (is_tar ? unpacked : size) * copies * 1000000 / (EMMC_WRITE_KBS * 1024LL);
+		my_printf("  estimate    write %.1f s at a typical %d MB/s\n", write_us / 1000000.0, EMMC_WRITE_KBS / 1024);
+		// the files are extracted while the image is decompressed
+		est = is_tar ? (untar_us > write_us ? untar_us : write_us) : read_us + write_us;
+	}
+	my_printf("  total       %.1f s\n", est / 1000000.0);
+	return est;
+}
+
+// kernel or rootfs is NULL if it isn't flashed, copies is the number of
+// multiboot partitions to write
+int rehearse_flash(struct flash_job* kernel, struct flash_job* rootfs, int copies)
+{
+	long long kernel_us = 0;
+	long long rootfs_us = 0;
+	long long total;
+
+	my_printf("Rehearsal: images are read and checked, nothing is written\n");
+	if (kernel != NULL)
+	{
+		kernel_us = rehearse_image("Kernel", kernel->filename, kernel->device, kernel->flash_mode, 0, 1);
+		if (kernel_us < 0)
+			return 0;
+		kernel_us *= copies;
+	}
+	if (rootfs != NULL)
+	{
+		rootfs_us = rehearse_image("Rootfs", rootfs->filename, rootfs->device, rootfs->flash_mode,
+			rootfs->flash_mode == TARBZ2, copies);
+		if (rootfs_us < 0)
+			return 0;
+	}
+
+	total = (kernel_us + rootfs_us) / 1000000;
+	my_printf("Estimated flash time: %lld min %lld s (kernel %.1f s, rootfs %.1f s) plus stopping E2 and reboot\n",
+		total / 60, total % 60, kernel_us / 1000000.0, rootfs_us / 1000000.0);
+	return 1;
+}
@@ -0,0 +1,265 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <libmtd.h>
+#include <telemetry.h>
+
+// Records start/end time and I/O counters of every step shown by set_step().
+// MTD erase/read/write operations are counted by libmtd, everything else
+// (image reads, flashcp and ext4 writes) is reported by the flash code.
+
+#define TELEMETRY_MAX_STEPS   64
+#define TELEMETRY_MAX_DEVICES 4
+
+extern const char ofgwrite_version[];
+
+struct telemetry_counters
+{
+	long long bytes_read;
+	long long bytes_written;
+	long long erase_cnt;
+	long long write_cnt;
+	long long read_cnt;
+	long long errors;
+};
+
+struct telemetry_step
+{
+	char* name;
+	long long start_ms;
+	long long end_ms;
+	struct telemetry_counters start;
+	struct telemetry_counters delta;
+};
+
+struct telemetry_device
+{
+	char device[32];
+	int eb_cnt;
+	int bad_cnt;
+	long long mean_ec;
+};
+
+static struct telemetry_counters* own;
+static struct telemetry_step steps[TELEMETRY_MAX_STEPS];
+static int steps_cnt;
+static struct telemetry_device devices[TELEMETRY_MAX_DEVICES];
+static int devices_cnt;
+static long long start_ms;
+static time_t start_time;
+
+static long long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// The counters are shared with forked children, busybox tar decompresses
+// the image in a child process.
+static struct telemetry_counters* counters()
+{
+	static struct telemetry_counters fallback;
+
+	if (own == NULL)
+	{
+		own = mmap(NULL, sizeof(*own), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (own == MAP_FAILED)
+			own = &fallback;
+	}
+	return own;
+}
+
+static void get_counters(struct telemetry_counters* c)
+{
+	struct telemetry_counters* o = counters();
+	struct mtd_op_stats mtd;
+
+	mtd_get_op_stats(&mtd);
+	c->bytes_read    = __sync_fetch_and_add(&o->bytes_read, 0) + mtd.bytes_read;
+	c->bytes_written = __sync_fetch_and_add(&o->bytes_written, 0) + mtd.bytes_written;
+	c->erase_cnt     = __sync_fetch_and_add(&o->erase_cnt, 0) + mtd.erase_cnt;
+	c->write_cnt     = mtd.write_cnt;
+	c->read_cnt      = mtd.read_cnt;
+	c->errors        = __sync_fetch_and_add(&o->errors, 0) + mtd.errors;
+}
+
+static void end_step()
+{
+	struct telemetry_step* s;
+	struct telemetry_counters now;
+
+	if (steps_cnt == 0 || steps[steps_cnt - 1].end_ms >= 0)
+		return;
+	s = &steps[steps_cnt - 1];
+	get_counters(&now);
+	s->end_ms = now_ms() - start_ms;
+	s->delta.bytes_read    = now.bytes_read    - s->start.bytes_read;
+	s->delta.bytes_written = now.bytes_written - s->start.bytes_written;
+	s->delta.erase_cnt     = now.erase_cnt     - s->start.erase_cnt;
+	s->delta.write_cnt     = now.write_cnt     - s->start.write_cnt;
+	s->delta.read_cnt      = now.read_cnt      - s->start.read_cnt;
+	s->delta.errors        = now.errors        - s->start.errors;
+}
+
+void telemetry_step(const char* name)
+{
+	struct telemetry_step* s;
+
+	if (start_ms == 0)
+	{
+		start_ms = now_ms();
+		start_time = time(NULL);
+	}
+	end_step();
+	if (steps_cnt >= TELEMETRY_MAX_STEPS)
+		return;
+
+	s = &steps[steps_cnt++];
+	s->name = strdup(name);
+	s->start_ms = now_ms() - start_ms;
+	s->end_ms = -1;
+	get_counters(&s->start);
+}
+
+void telemetry_add_read(long long bytes)
+{
+	__sync_fetch_and_add(&counters()->bytes_read, bytes);
+}
+
+void telemetry_add_written(long long bytes)
+{
+	__sync_fetch_and_add(&counters()->bytes_written, bytes);
+}
+
+void telemetry_add_erase(long long cnt)
+{
+	__sync_fetch_and_add(&counters()->erase_cnt, cnt);
+}
+
+void telemetry_add_error(void)
+{
+	__sync_fetch_and_add(&counters()->errors, 1);
+}
+
+long long telemetry_image_read(void)
+{
+	return __sync_fetch_and_add(&counters()->bytes_read, 0);
+}
+
+void telemetry_device(const char* device, int eb_cnt, int bad_cnt, long long mean_ec)
+{
+	struct telemetry_device* d;
+
+	if (devices_cnt >= TELEMETRY_MAX_DEVICES)
+		return;
+	d = &devices[devices_cnt++];
+	snprintf(d->device, sizeof(d->device), "%s", device);
+	d->eb_cnt  = eb_cnt;
+	d->bad_cnt = bad_cnt;
+	d->mean_ec = mean_ec;
+}
+
+static void write_json_string(FILE* f, const char* str)
+{
+	fputc('"', f);
+	for (; *str; str++)
+	{
+		if (*str == '"' || *str == '\\')
+			fputc('\\', f);
+		if ((unsigned char)*str >= ' ')
+			fputc(*str, f);
+	}
+	fputc('"', f);
+}
+
+int telemetry_write(const char* dir, int success)
+{
+	const struct phase_record* phases;
+	int phases_cnt, i, slowest = -1;
+	long long total_ms;
+	struct telemetry_counters total;
+	char path[1000];
+	FILE* f;
+	int dir_fd, err;
+
+	end_step();
+	get_counters(&total);
+	total_ms = start_ms ? now_ms() - start_ms : 0;
+	for (i = 0; i < steps_cnt; i++)
+		if (slowest < 0 || steps[i].end_ms - steps[i].start_ms > steps[slowest].end_ms - steps[slowest].start_ms)
+			slowest = i;
+
+	syslog(LOG_INFO, "summary: %s in %lld ms, read %lld, written %lld bytes, %lld erases, %lld writes, %lld errors, slowest step %s (%lld ms)",
+		success ? "flashed" : "failed", total_ms, total.bytes_read, total.bytes_written,
+		total.erase_cnt, total.write_cnt, total.errors,
+		slowest >= 0 ? steps[slowest].name : "-",
+		slowest >= 0 ? steps[slowest].end_ms - steps[slowest].start_ms : 0);
+
+	snprintf(path, sizeof(path), "%s/%s", dir, TELEMETRY_FILE);
+	f = fopen(path, "w");
+	if (f == NULL)
+	{
+		my_printf("Error writing telemetry to %s\n", path);
+		return -1;
+	}
+
+	fprintf(f, "{\"version\":\"%s\",\"start\":%ld,\"duration_ms\":%lld,\"success\":%s,\"steps\":[",
+		ofgwrite_version, (long)start_time, total_ms, success ? "true" : "false");
+	for (i = 0; i < steps_cnt; i++)
+	{
+		const struct telemetry_step* s = &steps[i];
+
+		fprintf(f, "%s{\"name\":", i ? "," : "");
+		write_json_string(f, s->name);
+		fprintf(f, ",\"start_ms\":%lld,\"end_ms\":%lld,\"read\":%lld,\"written\":%lld,"
+			"\"erase_ops\":%lld,\"program_ops\":%lld,\"read_ops\":%lld,\"errors\":%lld}",
+			s->start_ms, s->end_ms, s->delta.bytes_read, s->delta.bytes_written,
+			s->delta.erase_cnt, s->delta.write_cnt, s->delta.read_cnt, s->delta.errors);
+	}
+
+	fprintf(f, "],\"phases\":[");
+	phases = phase_records(&phases_cnt);
+	for (i = 0; i < phases_cnt; i++)
+	{
+		fprintf(f, "%s{\"name\":", i ? "," : "");
+		write_json_string(f, phases[i].name);
+		fprintf(f, ",\"ms\":%lld,\"ready\":%s}", phases[i].ms, phases[i].ready ? "true" : "false");
+	}
+
+	fprintf(f, "],\"devices\":[");
+	for (i = 0; i < devices_cnt; i++)
+	{
+		fprintf(f, "%s{\"device\":", i ? "," : "");
+		write_json_string(f, devices[i].device);
+		fprintf(f, ",\"eb_cnt\":%d,\"bad_blocks\":%d,\"mean_ec\":%lld}",
+			devices[i].eb_cnt, devices[i].bad_cnt, devices[i].mean_ec);
+	}
+	fprintf(f, "]}\n");
+
+	// the box reboots right after this, so get the file and its directory
+	// entry onto the media now
+	err = fflush(f) || fsync(fileno(f));
+	if (fclose(f) || err)
+	{
+		my_printf("Error writing telemetry to %s\n", path);
+		return -1;
+	}
+	dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (dir_fd >= 0)
+	{
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+	my_printf("Telemetry written to %s\n", path);
+	return 0;
+}
@@ -0,0 +1,289 @@
+#include "ofgwrite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/statfs.h>
+#include <tune.h>
+
+// Probes the box once before flashing and chooses the buffer sizes and
+// queue depths of all stages: the read rates of the image source and of the
+// target block device, the number of cores and the free RAM.
+
+#define TUNE_PROBE_SIZE   (4 * 1024 * 1024)
+#define TUNE_TARGET_PROBE (1024 * 1024)
+#define TUNE_FAST_RATE    (32 * 1024 * 1024) // bytes/s
+#define TUNE_MIN_BUF      (64 * 1024)
+#define TUNE_MAX_BUF      (1024 * 1024)
+#define TUNE_LOW_RAM      (256LL * 1024 * 1024) // RAM of small boxes
+#define TUNE_LOW_RAM_BUDGET (512 * 1024)
+
+#ifndef NFS_SUPER_MAGIC
+#define NFS_SUPER_MAGIC   0x6969
+#endif
+#define CIFS_SUPER_MAGIC  0xFF534D42
+#define SMB2_SUPER_MAGIC  0xFE534D42
+#define SMB_SUPER_MAGIC   0x517B
+
+#ifndef MCL_ONFAULT
+#define MCL_ONFAULT       4
+#endif
+
+extern unsigned bunzip_iobuf_size;
+extern unsigned bb_copybuf_size;
+extern char *bb_copybuf;
+
+// used if tune_probe() wasn't called
+static struct tune_params params =
+{
+	.cores       = 1,
+	.image_buf   = TUNE_MIN_BUF,
+	.write_buf   = TUNE_MIN_BUF,
+	.bunzip_buf  = 4096,
+	.copy_buf    = 4096,
+	.erase_ahead = 4,
+};
+
+// The stage buffers are slices of one mapping, so they are allocated once
+// and their sum is bounded by the budget.
+static char* arena;
+static size_t arena_size;
+static size_t arena_off[TUNE_BUF_CNT];
+
+static long long now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void read_meminfo(long long* total, long long* avail)
+{
+	char line[100];
+	long long kb;
+	FILE* f;
+
+	*total = 0;
+	*avail = 0;
+	f = fopen("/proc/meminfo", "r");
+	if (f == NULL)
+		return;
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		if (sscanf(line, "MemTotal: %lld kB", &kb) == 1)
+			*total = kb * 1024;
+		else if (sscanf(line, "MemAvailable: %lld kB", &kb) == 1)
+			*avail = kb * 1024;
+	}
+	fclose(f);
+}
+
+// bytes per second of the image source, measured on the first few MB
+static long long probe_image(const char* filename, int* network)
+{
+	struct statfs sfs;
+	long long start, us;
+	off_t off = 0;
+	ssize_t len;
+	char* buf;
+	int fd;
+
+	*network = 0;
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	*network = fstatfs(fd, &sfs) == 0
+		&& (sfs.f_type == NFS_SUPER_MAGIC || (unsigned)sfs.f_type == CIFS_SUPER_MAGIC
+		 || (unsigned)sfs.f_type == SMB2_SUPER_MAGIC || sfs.f_type == SMB_SUPER_MAGIC);
+
+	buf = malloc(TUNE_MIN_BUF);
+	if (buf == NULL)
+	{
+		close(fd);
+		return 0;
+	}
+	start = now_us();
+	while (off < TUNE_PROBE_SIZE && (len = pread(fd, buf, TUNE_MIN_BUF, off)) > 0)
+		off += len;
+	us = now_us() - start;
+	free(buf);
+	close(fd);
+
+	return us > 0 ? off * 1000000 / us : off * 1000000;
+}
+
+// Bytes per second read from a block device. Nothing is ever written to
+// the target just to measure it, the read rate with O_DIRECT bypassing the
+// page cache is used as an estimate of what the device can take.
+static long long probe_target(const char* device)
+{
+	long long start, us;
+	void* buf;
+	int fd;
+
+	if (device == NULL || device[0] == '\0' || strncmp(device, "/dev/mtd", 8) == 0)
+		return 0;
+	fd = open(device, O_RDONLY | O_DIRECT | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	if (posix_memalign(&buf, 4096, TUNE_TARGET_PROBE) != 0)
+	{
+		close(fd);
+		return 0;
+	}
+	us = 0;
+	start = now_us();
+	if (pread(fd, buf, TUNE_TARGET_PROBE, 0) == TUNE_TARGET_PROBE)
+		us = now_us() - start;
+	free(buf);
+	close(fd);
+
+	return us > 0 ? TUNE_TARGET_PROBE * 1000000LL / us : 0;
+}
+
+// buffer holding about 20 ms of data
+static int buf_for_rate(long long rate, int max)
+{
+	long long size = rate / 50;
+	int buf = TUNE_MIN_BUF;
+
+	while (buf < size && buf < max)
+		buf *= 2;
+	return buf;
+}
+
+static size_t page_align(size_t size)
+{
+	long page = sysconf(_SC_PAGESIZE);
+
+	return (size + page - 1) / page * page;
+}
+
+static void arena_alloc()
+{
+	int sizes[TUNE_BUF_CNT] = { params.image_buf, params.write_buf, params.copy_buf, params.write_buf };
+	size_t size = 0;
+	int i;
+
+	if (arena != NULL)
+		munmap(arena, arena_size);
+	for (i = 0; i < TUNE_BUF_CNT; i++)
+	{
+		arena_off[i] = size;
+		size += page_align(sizes[i]);
+	}
+	arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (arena == MAP_FAILED)
+	{
+		my_printf("Error allocating %zu bytes of buffers\n", size);
+		arena = NULL;
+	}
+	arena_size = arena != NULL ? size : 0;
+	bb_copybuf = arena != NULL ? arena + arena_off[TUNE_COPY_BUF] : NULL;
+}
+
+void tune_probe(const char* image, const char* target, int low_ram)
+{
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int max_buf;
+
+	params.cores = cores > 0 ? cores : 1;
+	read_meminfo(&params.mem_total, &params.mem_avail);
+	params.low_ram = low_ram || (params.mem_total > 0 && params.mem_total <= TUNE_LOW_RAM);
+	if (image != NULL && image[0] != '\0')
+		params.image_rate = probe_image(image, &params.network);
+	params.target_rate = probe_target(target);
+
+	// all buffers together stay below 1/64 of the free RAM, on small boxes
+	// below a fixed budget
+	if (params.low_ram)
+		params.budget = TUNE_LOW_RAM_BUDGET;
+	else if (params.mem_avail > 0 && params.mem_avail / 64 < 8 * TUNE_MAX_BUF)
+		params.budget = params.mem_avail / 64;
+	else
+		params.budget = 8 * TUNE_MAX_BUF;
+	max_buf = TUNE_MAX_BUF;
+	while (max_buf > TUNE_MIN_BUF && max_buf * 8LL > params.budget)
+		max_buf /= 2;
+
+	// network sources deliver big requests best, local ones their rate
+	params.image_buf = params.network ? max_buf : buf_for_rate(params.image_rate, max_buf);
+	params.write_buf = params.target_rate ? buf_for_rate(params.target_rate, max_buf) : TUNE_MIN_BUF;
+	// bunzip2 reads compressed input which is small compared to its
+	// output, the output goes through a pipe
+	if (params.low_ram)
+		params.bunzip_buf = 4096;
+	else
+		params.bunzip_buf = params.image_rate >= TUNE_FAST_RATE || params.network ? 64 * 1024 : 16 * 1024;
+	params.copy_buf = params.write_buf;
+	// the eraseblocks are erased by a thread while the main one writes, on
+	// more cores it can run further ahead
+	params.erase_ahead = params.cores > 1 ? 8 : 4;
+
+	bunzip_iobuf_size = params.bunzip_buf;
+	bb_copybuf_size = params.copy_buf;
+	arena_alloc();
+
+	my_printf("Tuning: %d cores, %lld of %lld MB free, image %s %lld kB/s, target %lld kB/s\n",
+		params.cores, params.mem_avail >> 20, params.mem_total >> 20, params.network ? "network" : "local",
+		params.image_rate / 1024, params.target_rate / 1024);
+	my_printf("Tuning: %sbudget %d kB, buffers image %d kB, write %d kB, bunzip2 %d kB, erase ahead %d\n",
+		params.low_ram ? "low RAM mode, " : "", params.budget / 1024, params.image_buf / 1024,
+		params.write_buf / 1024, params.bunzip_buf / 1024, params.erase_ahead);
+}
+
+const struct tune_params* tune_get()
+{
+	return &params;
+}
+
+void* tune_buffer(enum TuneBufferEnum buf)
+{
+	// sizes of the defaults if tune_probe() wasn't called
+	if (arena == NULL)
+		arena_alloc();
+	return arena != NULL ? arena + arena_off[buf] : NULL;
+}
+
+// mlock() of a file mapping reads it in, so the whole binary and its
+// libraries are resident
+static void lock_file_mappings()
+{
+	unsigned long start, end;
+	char line[600];
+	char path[512];
+	FILE* f;
+
+	f = fopen("/proc/self/maps", "r");
+	if (f == NULL)
+		return;
+	while (fgets(line, sizeof(line), f) != NULL)
+		if (sscanf(line, "%lx-%lx %*s %*s %*s %*s %511s", &start, &end, path) == 3 && path[0] == '/')
+			mlock((void*)start, end - start);
+	fclose(f);
+}
+
+void tune_lock_memory()
+{
+	if (!params.low_ram)
+		return;
+
+	// Pages of the heap and the thread stacks are locked when touched, so
+	// the untouched parts of the stacks don't take RAM. Old kernels don't
+	// know MCL_ONFAULT, then only the binary and the buffers are locked.
+	if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) == 0)
+		my_printf("Locked ofgwrite in RAM\n");
+	else
+	{
+		my_printf("Locking future allocations failed: %s\n", strerror(errno));
+		if (arena != NULL)
+			mlock(arena, arena_size);
+	}
+	lock_file_mappings();
+}
@@ -30,6 +30,7 @@
 #include <string.h>
 
 #include <libubi.h>
+#include <mtd_dev.h>
 #include "common.h"
 
 #define DEFAULT_CTRL_DEV "/dev/ubi_ctrl"
@@ -205,3 +206,23 @@ out_libubi:
 	return -1;
 }
 
+
+int ubidetach_dev(struct mtd_dev_handle *dev)
+{
+	int err;
+	libubi_t libubi;
+
+	libubi = libubi_open();
+	if (!libubi) {
+		if (errno == 0)
+			return errmsg("UBI is not present in the system");
+		return sys_errmsg("cannot open libubi");
+	}
+
+	err = ubi_detach_mtd(libubi, DEFAULT_CTRL_DEV, dev->mtd.mtd_num);
+	if (err)
+		sys_errmsg("cannot detach mtd%d", dev->mtd.mtd_num);
+
+	libubi_close(libubi);
+	return err ? -1 : 0;
+}
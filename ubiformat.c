@@ -37,11 +37,14 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include <libubi.h>
 #include <libmtd.h>
 #include <libscan.h>
 #include <libubigen.h>
+#include <mtd_dev.h>
+#include <telemetry.h>
 #include <mtd_swab.h>
 #include <crc32.h>
 #include "common.h"
@@ -65,6 +68,7 @@ struct args {
 	const char *node;
 	int node_fd;
 	unsigned int no_detach_check:1;
+	int erase_ahead;
 };
 
 static struct args args =
@@ -94,6 +98,8 @@ static const char optionsstr[] =
 "                             (default is 1)\n"
 "-Q, --image-seq=<num>        32-bit UBI image sequence number to use\n"
 "                             (by default a random number is picked)\n"
+"-E, --erase-ahead=<num>      erase up to <num> eraseblocks in a separate\n"
+"                             thread while flashing the image (default 0)\n"
 "-y, --yes                    assume the answer is \"yes\" for all question\n"
 "                             this program would otherwise ask\n"
 "-q, --quiet                  suppress progress percentage information\n"
@@ -103,10 +109,10 @@ static const char optionsstr[] =
 
 static const char usage[] =
 "Usage: " PROGRAM_NAME " <MTD device node file name> [-s <bytes>] [-O <offs>] [-n]\n"
-"\t\t\t[-Q <num>] [-f <file>] [-S <bytes>] [-e <value>] [-x <num>] [-y] [-q] [-v] [-h]\n"
+"\t\t\t[-Q <num>] [-f <file>] [-S <bytes>] [-e <value>] [-x <num>] [-E <num>] [-y] [-q] [-v] [-h]\n"
 "\t\t\t[--sub-page-size=<bytes>] [--vid-hdr-offset=<offs>] [--no-volume-table]\n"
 "\t\t\t[--flash-image=<file>] [--image-size=<bytes>] [--erase-counter=<value>]\n"
-"\t\t\t[--image-seq=<num>] [--ubi-ver=<num>] [--yes] [--quiet] [--verbose]\n"
+"\t\t\t[--image-seq=<num>] [--ubi-ver=<num>] [--erase-ahead=<num>] [--yes] [--quiet] [--verbose]\n"
 "\t\t\t[--help] [--version]\n\n"
 "Example 1: " PROGRAM_NAME " /dev/mtd0 -y - format MTD device number 0 and do\n"
 "           not ask questions.\n"
@@ -127,6 +133,7 @@ static const struct option long_options[] = {
 	{ .name = "help",            .has_arg = 0, .flag = NULL, .val = 'h' },
 	{ .name = "version",         .has_arg = 0, .flag = NULL, .val = 'V' },
 	{ .name = "no-detach-check", .has_arg = 0, .flag = NULL, .val = 'D' },
+	{ .name = "erase-ahead",     .has_arg = 1, .flag = NULL, .val = 'E' },
 	{ NULL, 0, NULL, 0},
 };
 
@@ -139,7 +146,7 @@ static int parse_opt(int argc, char * const argv[])
 		int key, error = 0;
 		unsigned long int image_seq;
 
-		key = getopt_long(argc, argv, "nh?Vyqve:x:s:O:f:S:D", long_options, NULL);
+		key = getopt_long(argc, argv, "nh?Vyqve:x:s:O:f:S:DE:", long_options, NULL);
 		if (key == -1)
 			break;
 
@@ -193,6 +200,12 @@ static int parse_opt(int argc, char * const argv[])
 			args.no_detach_check = 1;
 			break;
 
+		case 'E':
+			args.erase_ahead = simple_strtoul(optarg, &error);
+			if (error || args.erase_ahead < 0)
+				return errmsg("bad erase-ahead count: \"%s\"", optarg);
+			break;
+
 		case 'x':
 			args.ubi_ver = simple_strtoul(optarg, &error);
 			if (error || args.ubi_ver < 0)
@@ -353,6 +366,7 @@ static int read_all(int fd, void *buf, size_t len)
 		if (l == 0)
 			return errmsg("eof reached; %zu bytes remaining", len);
 		else if (l > 0) {
+			telemetry_add_read(l);
 			buf += l;
 			len -= l;
 		} else if (errno == EINTR || errno == EAGAIN)
@@ -424,6 +438,169 @@ static int mark_bad(const struct mtd_dev_info *mtd, struct ubi_scan_info *si, in
 	return consecutive_bad_check(eb);
 }
 
+/*
+ * Erase-ahead: a worker thread erases the next good eraseblocks while
+ * flash_image() programs the current one. The state of each eraseblock is
+ * kept in @state: %EA_PENDING until the worker erased it, then %EA_ERASED or
+ * the (positive) errno of the failed erase.
+ */
+#define EA_PENDING -1
+#define EA_ERASED   0
+
+struct erase_ahead {
+	libmtd_t libmtd;
+	const struct mtd_dev_info *mtd;
+	const struct ubi_scan_info *si;
+	int *state;
+	int depth;	/* max. number of erased but not yet programmed eraseblocks */
+	int ahead;	/* current number of erased but not yet programmed eraseblocks */
+	int next;	/* next eraseblock to erase */
+	int wanted;	/* number of good eraseblocks still needed */
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+};
+
+static void *erase_ahead_thread(void *arg)
+{
+	struct erase_ahead *ea = arg;
+
+	pthread_mutex_lock(&ea->lock);
+	while (1) {
+		int eb, err;
+
+		while (!ea->stop && (ea->ahead >= ea->depth || ea->wanted == 0))
+			pthread_cond_wait(&ea->cond, &ea->lock);
+		if (ea->stop)
+			break;
+
+		/* bad eraseblocks from the scan are skipped by flash_image() too */
+		while (ea->next < ea->mtd->eb_cnt && ea->si->ec[ea->next] == EB_BAD)
+			ea->next += 1;
+		if (ea->next >= ea->mtd->eb_cnt)
+			break;
+		eb = ea->next++;
+		pthread_mutex_unlock(&ea->lock);
+
+		err = mtd_erase(ea->libmtd, ea->mtd, args.node_fd, eb);
+
+		pthread_mutex_lock(&ea->lock);
+		ea->state[eb] = err ? errno : EA_ERASED;
+		ea->ahead += 1;
+		ea->wanted -= 1;
+		pthread_cond_broadcast(&ea->cond);
+	}
+	ea->stop = 1;
+	pthread_cond_broadcast(&ea->cond);
+	pthread_mutex_unlock(&ea->lock);
+
+	return NULL;
+}
+
+static int erase_ahead_start(struct erase_ahead *ea, libmtd_t libmtd,
+			     const struct mtd_dev_info *mtd,
+			     const struct ubi_scan_info *si, int img_ebs)
+{
+	int eb;
+
+	memset(ea, 0, sizeof(*ea));
+	ea->state = malloc(mtd->eb_cnt * sizeof(int));
+	if (!ea->state)
+		return sys_errmsg("cannot allocate %zd bytes of memory",
+				  mtd->eb_cnt * sizeof(int));
+	for (eb = 0; eb < mtd->eb_cnt; eb++)
+		ea->state[eb] = EA_PENDING;
+
+	ea->libmtd = libmtd;
+	ea->mtd = mtd;
+	ea->si = si;
+	ea->depth = args.erase_ahead;
+	ea->wanted = img_ebs;
+	pthread_mutex_init(&ea->lock, NULL);
+	pthread_cond_init(&ea->cond, NULL);
+
+	errno = pthread_create(&ea->thread, NULL, erase_ahead_thread, ea);
+	if (errno) {
+		sys_errmsg("cannot create erase-ahead thread");
+		pthread_cond_destroy(&ea->cond);
+		pthread_mutex_destroy(&ea->lock);
+		free(ea->state);
+		return -1;
+	}
+
+	verbose(args.verbose, "erasing up to %d eraseblocks ahead", ea->depth);
+	return 0;
+}
+
+/*
+ * Wait until the worker erased eraseblock @eb. Returns %0 if it was erased
+ * successfully, otherwise %-1 with errno set to the erase error. If the worker
+ * stopped before reaching @eb, the eraseblock is erased here.
+ */
+static int erase_ahead_wait(struct erase_ahead *ea, int eb)
+{
+	int state;
+
+	pthread_mutex_lock(&ea->lock);
+	while (ea->state[eb] == EA_PENDING && !ea->stop)
+		pthread_cond_wait(&ea->cond, &ea->lock);
+	state = ea->state[eb];
+	if (state != EA_PENDING)
+		ea->ahead -= 1;
+	/* a failed eraseblock has to be replaced by the next good one */
+	if (state != EA_ERASED && state != EA_PENDING)
+		ea->wanted += 1;
+	pthread_cond_broadcast(&ea->cond);
+	pthread_mutex_unlock(&ea->lock);
+
+	if (state == EA_PENDING)
+		/* worker ran out of eraseblocks, should not happen */
+		return mtd_erase(ea->libmtd, ea->mtd, args.node_fd, eb);
+	if (state != EA_ERASED) {
+		errno = state;
+		return -1;
+	}
+	return 0;
+}
+
+/* Request one more good eraseblock, e.g. to rewrite data after a write error */
+static void erase_ahead_want_more(struct erase_ahead *ea)
+{
+	pthread_mutex_lock(&ea->lock);
+	ea->wanted += 1;
+	pthread_cond_broadcast(&ea->cond);
+	pthread_mutex_unlock(&ea->lock);
+}
+
+static void erase_ahead_stop(struct erase_ahead *ea)
+{
+	pthread_mutex_lock(&ea->lock);
+	ea->stop = 1;
+	pthread_cond_broadcast(&ea->cond);
+	pthread_mutex_unlock(&ea->lock);
+
+	pthread_join(ea->thread, NULL);
+	pthread_cond_destroy(&ea->cond);
+	pthread_mutex_destroy(&ea->lock);
+	free(ea->state);
+}
+
+/* mark_bad() while the worker may be scanning @si->ec for the next eraseblock */
+static int erase_ahead_mark_bad(struct erase_ahead *ea, const struct mtd_dev_info *mtd,
+				struct ubi_scan_info *si, int eb)
+{
+	int err;
+
+	if (!ea)
+		return mark_bad(mtd, si, eb);
+
+	pthread_mutex_lock(&ea->lock);
+	err = mark_bad(mtd, si, eb);
+	pthread_mutex_unlock(&ea->lock);
+	return err;
+}
+
 static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 		       const struct ubigen_info *ui, struct ubi_scan_info *si)
 {
@@ -431,6 +608,8 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 
 	int fd, img_ebs, eb, written_ebs = 0, divisor, skip_data_read = 0;
 	off_t st_size;
+	struct erase_ahead ea;
+	int use_erase_ahead = 0;
 
 	fd = open_file(&st_size);
 	if (fd < 0)
@@ -452,16 +631,25 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 
 	verbose(args.verbose, "will write %d eraseblocks", img_ebs);
 	divisor = img_ebs;
+
+	if (args.erase_ahead > 0 && img_ebs > 0) {
+		if (erase_ahead_start(&ea, libmtd, mtd, si, img_ebs))
+			goto out_close;
+		use_erase_ahead = 1;
+	}
+
 	for (eb = 0; eb < mtd->eb_cnt; eb++) {
 		int err, new_len;
 		char buf[mtd->eb_size];
 		long long ec;
 
 		if (!args.quiet && !args.verbose) {
-			printf("\r" PROGRAM_NAME ": flashing eraseblock %d -- %2lld %% complete  ",
-			       eb, (long long)(eb + 1) * 100 / divisor);
 			set_step_progress((int)((long long)(eb + 1) * 100 / divisor));
-			fflush(stdout);
+			if (progress_due(written_ebs + 1 == img_ebs)) {
+				printf("\r" PROGRAM_NAME ": flashing eraseblock %d -- %2lld %% complete  ",
+				       eb, (long long)(eb + 1) * 100 / divisor);
+				fflush(stdout);
+			}
 		}
 
 		if (si->ec[eb] == EB_BAD) {
@@ -474,7 +662,10 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 			fflush(stdout);
 		}
 
-		err = mtd_erase(libmtd, mtd, args.node_fd, eb);
+		if (use_erase_ahead)
+			err = erase_ahead_wait(&ea, eb);
+		else
+			err = mtd_erase(libmtd, mtd, args.node_fd, eb);
 		if (err) {
 			if (!args.quiet)
 				my_printf("\n");
@@ -483,7 +674,7 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 			if (errno != EIO)
 				goto out_close;
 
-			if (mark_bad(mtd, si, eb))
+			if (erase_ahead_mark_bad(use_erase_ahead ? &ea : NULL, mtd, si, eb))
 				goto out_close;
 
 			continue;
@@ -535,7 +726,7 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 
 			err = mtd_torture(libmtd, mtd, args.node_fd, eb);
 			if (err) {
-				if (mark_bad(mtd, si, eb))
+				if (erase_ahead_mark_bad(use_erase_ahead ? &ea : NULL, mtd, si, eb))
 					goto out_close;
 			}
 
@@ -545,18 +736,24 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 			 * write buf first instead.
 			 */
 			skip_data_read = 1;
+			if (use_erase_ahead)
+				erase_ahead_want_more(&ea);
 			continue;
 		}
 		if (++written_ebs >= img_ebs)
 			break;
 	}
 
+	if (use_erase_ahead)
+		erase_ahead_stop(&ea);
 	if (!args.quiet && !args.verbose)
 		my_printf("\n");
 	close(fd);
 	return eb + 1;
 
 out_close:
+	if (use_erase_ahead)
+		erase_ahead_stop(&ea);
 	close(fd);
 	return -1;
 }
@@ -585,10 +782,12 @@ static int format(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 		long long ec;
 
 		if (!args.quiet && !args.verbose) {
-			printf("\r" PROGRAM_NAME ": formatting eraseblock %d -- %2lld %% complete  ",
-			       eb, (long long)(eb + 1 - start_eb) * 100 / (mtd->eb_cnt - start_eb));
 			set_step_progress((int)((long long)(eb + 1 - start_eb) * 100 / (mtd->eb_cnt - start_eb)));
-			fflush(stdout);
+			if (progress_due(eb == mtd->eb_cnt - 1)) {
+				printf("\r" PROGRAM_NAME ": formatting eraseblock %d -- %2lld %% complete  ",
+				       eb, (long long)(eb + 1 - start_eb) * 100 / (mtd->eb_cnt - start_eb));
+				fflush(stdout);
+			}
 		}
 
 		if (si->ec[eb] == EB_BAD)
@@ -695,42 +894,31 @@ out_free:
 	return -1;
 }
 
-int ubiformat_main(int argc, char * const argv[])
+/*
+ * Format the MTD device opened as args.node_fd and flash the image if one
+ * was given. The device description is copied because the sub-page size
+ * might be overridden by the -s option.
+ */
+static int ubiformat(libmtd_t libmtd, const struct mtd_dev_info *dev_mtd)
 {
 	int err, verbose;
-	libmtd_t libmtd;
 	struct mtd_info mtd_info;
-	struct mtd_dev_info mtd;
+	struct mtd_dev_info mtd = *dev_mtd;
 	libubi_t libubi;
 	struct ubigen_info ui;
 	struct ubi_scan_info *si;
 
-	libmtd = libmtd_open();
-	if (!libmtd)
-		return errmsg("MTD subsystem is not present");
-
-	err = parse_opt(argc, argv);
-	if (err)
-		goto out_close_mtd;
-
 	err = mtd_get_info(libmtd, &mtd_info);
 	if (err) {
 		if (errno == ENODEV)
 			errmsg("MTD is not present");
-		sys_errmsg("cannot get MTD information");
-		goto out_close_mtd;
-	}
-
-	err = mtd_get_dev_info(libmtd, args.node, &mtd);
-	if (err) {
-		sys_errmsg("cannot get information about \"%s\"", args.node);
-		goto out_close_mtd;
+		return sys_errmsg("cannot get MTD information");
 	}
 
 	if (!is_power_of_2(mtd.min_io_size)) {
 		errmsg("min. I/O size is %d, but should be power of 2",
 		       mtd.min_io_size);
-		goto out_close_mtd;
+		return -1;
 	}
 
 	if (!mtd_info.sysfs_supported) {
@@ -758,37 +946,31 @@ int ubiformat_main(int argc, char * const argv[])
 		/* Do some sanity check */
 		if (args.subpage_size > mtd.min_io_size) {
 			errmsg("sub-page cannot be larger than min. I/O unit");
-			goto out_close_mtd;
+			return -1;
 		}
 
 		if (mtd.min_io_size % args.subpage_size) {
 			errmsg("min. I/O unit size should be multiple of "
 			       "sub-page size");
-			goto out_close_mtd;
+			return -1;
 		}
 	}
 
-	args.node_fd = open(args.node, O_RDWR);
-	if (args.node_fd == -1) {
-		sys_errmsg("cannot open \"%s\"", args.node);
-		goto out_close_mtd;
-	}
-
 	/* Validate VID header offset if it was specified */
 	if (args.vid_hdr_offs != 0) {
 		if (args.vid_hdr_offs % 8) {
 			errmsg("VID header offset has to be multiple of min. I/O unit size");
-			goto out_close;
+			return -1;
 		}
 		if (args.vid_hdr_offs + (int)UBI_VID_HDR_SIZE > mtd.eb_size) {
 			errmsg("bad VID header offset");
-			goto out_close;
+			return -1;
 		}
 	}
 
 	if (!mtd.writable) {
 		errmsg("mtd%d (%s) is a read-only device", mtd.mtd_num, args.node);
-		goto out_close;
+		return -1;
 	}
 
 	/* Make sure this MTD device is not attached to UBI */
@@ -803,7 +985,7 @@ int ubiformat_main(int argc, char * const argv[])
 			if (!err) {
 				errmsg("please, first detach mtd%d (%s) from ubi%d",
 					mtd.mtd_num, args.node, ubi_dev_num);
-				goto out_close;
+				return -1;
 			}
 		}
 	}
@@ -825,9 +1007,12 @@ int ubiformat_main(int argc, char * const argv[])
 	err = ubi_scan(&mtd, args.node_fd, &si, verbose);
 	if (err) {
 		errmsg("failed to scan mtd%d (%s)", mtd.mtd_num, args.node);
-		goto out_close;
+		return -1;
 	}
 
+	telemetry_device(args.node, mtd.eb_cnt, si->bad_cnt,
+			 si->ok_cnt ? si->mean_ec : -1);
+
 	if (si->good_cnt == 0) {
 		errmsg("all %d eraseblocks are bad", si->bad_cnt);
 		goto out_free;
@@ -942,15 +1127,63 @@ int ubiformat_main(int argc, char * const argv[])
 			goto out_free;
 	}
 
-	//ubi_scan_free(si);
-	//close(args.node_fd);
-	libmtd_close(libmtd);
+	ubi_scan_free(si);
 	return 0;
 
 out_free:
 	ubi_scan_free(si);
-out_close:
+	return -1;
+}
+
+int ubiformat_dev(struct mtd_dev_handle *dev, const char *img,
+		  int erase_ahead, int quiet)
+{
+	/* same defaults as ofgwrite used with "ubiformat <dev> -f <img> -D" */
+	memset(&args, 0, sizeof(args));
+	args.ubi_ver = 1;
+	ubiutils_srand();
+	args.image_seq = rand();
+	args.quiet = quiet;
+	args.no_detach_check = 1;
+	args.erase_ahead = erase_ahead;
+	args.image = img;
+	args.node = dev->node;
+	args.node_fd = dev->fd;
+
+	return ubiformat(dev->libmtd, &dev->mtd);
+}
+
+int ubiformat_main(int argc, char * const argv[])
+{
+	int err;
+	libmtd_t libmtd;
+	struct mtd_dev_info mtd;
+
+	libmtd = libmtd_open();
+	if (!libmtd)
+		return errmsg("MTD subsystem is not present");
+
+	err = parse_opt(argc, argv);
+	if (err)
+		goto out_close_mtd;
+
+	err = mtd_get_dev_info(libmtd, args.node, &mtd);
+	if (err) {
+		sys_errmsg("cannot get information about \"%s\"", args.node);
+		goto out_close_mtd;
+	}
+
+	args.node_fd = open(args.node, O_RDWR);
+	if (args.node_fd == -1) {
+		sys_errmsg("cannot open \"%s\"", args.node);
+		goto out_close_mtd;
+	}
+
+	err = ubiformat(libmtd, &mtd);
 	close(args.node_fd);
+	libmtd_close(libmtd);
+	return err;
+
 out_close_mtd:
 	libmtd_close(libmtd);
 	return -1;